@@ -7,8 +7,15 @@
 #include <clang/Basic/Version.h>
 #include <clang/AST/Mangle.h>
 
+#include <llvm/ADT/DenseSet.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Signals.h>
+#include <llvm/Support/VirtualFileSystem.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 #include "Action.h"
 
@@ -26,35 +33,354 @@ using namespace llvm;
 
 namespace {
 
+enum class StorageKind {
+  Postgres,
+  Memory,
+  SQLite,
+};
+
+// Each translation unit's results belong to the compile command its source
+// was added to the compilation database with
 class CheckFactory : public FrontendActionFactory {
 public:
-  CheckFactory(Database &DB) : DB(DB) {}
+  CheckFactory(Database &DB, const PostgresCompilationDatabase &Compilations)
+      : DB(DB), Compilations(Compilations) {}
   FrontendAction *create() override {
+    DB.setCompileCommand(Compilations.getCurrentCompileCommandID());
     return new InsertIntoDatabaseAction(DB);
   }
 private:
   Database &DB;
+  const PostgresCompilationDatabase &Compilations;
+};
+
+// Takes IDs like 12, 3-7 or 1,4-6. Returns false if one can't be read.
+bool parseCompileCommandIDs(StringRef Spec, std::vector<unsigned> &IDs) {
+  SmallVector<StringRef, 4> Parts;
+  Spec.split(Parts, ',', -1, false);
+  for (StringRef Part : Parts) {
+    std::pair<StringRef, StringRef> Range = Part.split('-');
+    unsigned First, Last;
+    if (Range.first.getAsInteger(10, First) || First == 0) {
+      return false;
+    }
+    Last = First;
+    if (!Range.second.empty()
+        && (Range.second.getAsInteger(10, Last) || Last < First)) {
+      return false;
+    }
+    for (unsigned ID = First; ID <= Last; ++ID) {
+      IDs.push_back(ID);
+    }
+  }
+  return true;
+}
+
+// What -incremental skipped and why the rest ran, shared by the workers
+class IncrementalReport {
+public:
+  void addSkipped() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    ++NumSkipped;
+  }
+  void addChecked(unsigned CompileCommandID, std::string Reason) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Checked.emplace_back(CompileCommandID, std::move(Reason));
+  }
+  void print(raw_ostream &OS) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    std::sort(Checked.begin(), Checked.end());
+    OS << "Skipped " << NumSkipped << " of " << NumSkipped + Checked.size()
+       << " compile commands, their package files are unchanged\n";
+    for (auto &Entry : Checked) {
+      OS << "  Checked " << Entry.first << ": " << Entry.second << '\n';
+    }
+  }
+private:
+  std::mutex Mutex;
+  unsigned NumSkipped = 0;
+  std::vector<std::pair<unsigned, std::string>> Checked;
 };
 
+// Runs the compile commands in rounds, a ClangTool runs at most one compile
+// command per source file and the files of one tool share its file manager.
+// Workers give each tool a file system of its own, the default one changes
+// the working directory of the whole process. With a report the ones whose
+// package files are unchanged are skipped.
+int checkCompileCommands(Database &DB, std::vector<unsigned> Remaining,
+                         bool OwnFileSystem, IncrementalReport *Report) {
+  int Ret = 0;
+  if (Report) {
+    std::vector<unsigned> Changed;
+    for (unsigned ID : Remaining) {
+      std::string Reason;
+      if (DB.hasUnchangedInputs(ID, Reason)) {
+        Report->addSkipped();
+        continue;
+      }
+      Report->addChecked(ID, std::move(Reason));
+      Changed.push_back(ID);
+    }
+    Remaining = std::move(Changed);
+  }
+  while (!Remaining.empty()) {
+    clang::immutability::PostgresCompilationDatabase CompilationDatabase;
+    std::vector<std::string> Sources;
+    std::vector<unsigned> Later;
+    for (unsigned ID : Remaining) {
+      const CompileCommandInfo &Info = DB.prefetchCompileCommand(ID);
+      if (CompilationDatabase.hasSource(Info.Source)) {
+        Later.push_back(ID);
+        continue;
+      }
+      CompilationDatabase.addCompileCommand(ID, Info);
+      Sources.push_back(Info.Source);
+    }
+
+    IntrusiveRefCntPtr<vfs::FileSystem> FileSystem =
+      OwnFileSystem ? vfs::createPhysicalFileSystem().release()
+                    : vfs::getRealFileSystem();
+    ClangTool Tool(CompilationDatabase, Sources,
+                   std::make_shared<PCHContainerOperations>(), FileSystem);
+    CheckFactory Factory(DB, CompilationDatabase);
+    if (Tool.run(&Factory) != 0) {
+      Ret = 1;
+    }
+    Remaining = std::move(Later);
+  }
+  return Ret;
+}
+
 }
 
 int main(int argc, const char **argv) {
   llvm::sys::PrintStackTraceOnErrorSignal(argv[0]);
 
   llvm::cl::OptionCategory Category("clang-immutability-check Options");
-  cl::opt<unsigned> CompileCommandID(
-      cl::Positional, cl::desc("<compile_command_id>"), cl::Required,
+  cl::list<std::string> CompileCommandSpecs(
+      cl::Positional,
+      cl::desc("<compile_command_id>... (single IDs or ranges like 3-7, "
+               "separated by commas or spaces)"),
+      cl::ZeroOrMore, cl::cat(Category));
+  cl::opt<unsigned> PendingPackage(
+      "pending-package",
+      cl::desc("Also check every compile command of this package that wasn't "
+               "checked yet"),
+      cl::value_desc("package id"), cl::init(0), cl::cat(Category));
+  cl::opt<bool> PrintStatistics(
+      "print-db-stats", cl::desc("Print database statement counters on exit"),
+      cl::cat(Category));
+  cl::opt<unsigned> NumJobs(
+      "j",
+      cl::desc("Worker threads taking compile commands from a shared queue, "
+               "each with its own connection"),
+      cl::init(1), cl::cat(Category));
+  cl::opt<bool> Worker(
+      "worker",
+      cl::desc("Claim compile commands from the database's job queue until "
+               "it's empty, the compile commands given are queued first"),
+      cl::cat(Category));
+  cl::opt<unsigned> LeaseSeconds(
+      "lease-seconds",
+      cl::desc("How long a claimed job stays claimed without a heartbeat"),
+      cl::init(600), cl::cat(Category));
+  cl::opt<bool> Incremental(
+      "incremental",
+      cl::desc("Skip compile commands whose package files are unchanged "
+               "since they were last checked, -pending-package then takes "
+               "every compile command of the package"),
+      cl::cat(Category));
+  cl::opt<bool> ReuseStoredChecks(
+      "reuse-stored-checks",
+      cl::desc("Skip methods whose result an earlier run stored, only for "
+               "sources that haven't changed since"),
+      cl::cat(Category));
+  cl::opt<bool> AsyncWrites(
+      "async-writes", cl::desc("Write results from a background thread"),
+      cl::cat(Category));
+  cl::opt<std::string> FactFile(
+      "fact-file",
+      cl::desc("Write results to this file for const-checker-load instead of "
+               "the database"),
+      cl::value_desc("path"), cl::cat(Category));
+  cl::opt<bool> UnloggedStaging(
+      "unlogged-staging",
+      cl::desc("Stage results in the package's unlogged partitions until "
+               "const-checker-load -promote publishes them"),
+      cl::cat(Category));
+  cl::opt<StorageKind> StorageOption(
+      "storage", cl::desc("Where the results are kept"),
+      cl::values(clEnumValN(StorageKind::Postgres, "postgres",
+                            "The cpp_doc database (default)"),
+                 clEnumValN(StorageKind::Memory, "memory",
+                            "In memory, dropped on exit"),
+                 clEnumValN(StorageKind::SQLite, "sqlite",
+                            "The SQLite file given by -sqlite-file")),
+      cl::init(StorageKind::Postgres), cl::cat(Category));
+  cl::opt<std::string> ConnInfo(
+      "conninfo", cl::desc("libpq connection string of the database"),
+      cl::init("dbname = cpp_doc"), cl::cat(Category));
+  cl::opt<std::string> SQLiteFile(
+      "sqlite-file", cl::desc("SQLite file for -storage=sqlite"),
+      cl::init("cpp_doc.sqlite"), cl::value_desc("path"), cl::cat(Category));
+  cl::opt<std::string> CompileCommands(
+      "compile-commands",
+      cl::desc("JSON compilation database the compile command is taken from "
+               "with memory or SQLite storage"),
+      cl::init("compile_commands.json"), cl::value_desc("path"),
       cl::cat(Category));
   cl::ResetAllOptionOccurrences();
   cl::HideUnrelatedOptions(Category);
   cl::ParseCommandLineOptions(argc, argv);
 
-  Database DB(CompileCommandID);
-  std::vector<std::string> Sources = { DB.getSource() };
-  clang::immutability::PostgresCompilationDatabase CompilationDatabase(DB);
+  std::vector<unsigned> CompileCommandIDs;
+  for (auto &Spec : CompileCommandSpecs) {
+    if (!parseCompileCommandIDs(Spec, CompileCommandIDs)) {
+      errs() << "Not a compile command ID or range: " << Spec << '\n';
+      return 1;
+    }
+  }
+  if (CompileCommandIDs.empty() && PendingPackage == 0 && !Worker) {
+    errs() << "No compile commands given\n";
+    return 1;
+  }
+  if (Worker && StorageOption != StorageKind::Postgres) {
+    errs() << "-worker takes its compile commands from the database\n";
+    return 1;
+  }
+
+  // Workers each have their own storage, with their own fact file
+  auto CreateStorage = [&](unsigned Worker) -> std::unique_ptr<Storage> {
+    std::string WorkerFactFile = FactFile;
+    if (!FactFile.empty() && NumJobs > 1) {
+      WorkerFactFile += '.' + std::to_string(Worker);
+    }
+    switch (StorageOption) {
+    case StorageKind::Postgres:
+      return createPostgresStorage(ConnInfo, WorkerFactFile, AsyncWrites,
+                                   UnloggedStaging);
+    case StorageKind::Memory:
+      return createMemoryStorage(CompileCommands);
+    case StorageKind::SQLite:
+      return createSQLiteStorage(SQLiteFile, CompileCommands);
+    }
+    llvm_unreachable("Unknown storage");
+  };
+  std::unique_ptr<Storage> Store = CreateStorage(0);
+
+  // Workers only run the compile commands they claim
+  std::unique_ptr<JobQueue> Jobs;
+  if (Worker) {
+    Jobs = llvm::make_unique<JobQueue>(ConnInfo, LeaseSeconds);
+    for (unsigned ID : CompileCommandIDs) {
+      Jobs->enqueue(ID);
+    }
+    if (PendingPackage != 0 && Incremental) {
+      for (unsigned ID : Store->getCompileCommands(PendingPackage)) {
+        Jobs->enqueue(ID);
+      }
+    }
+    else if (PendingPackage != 0) {
+      Jobs->enqueuePackage(PendingPackage);
+    }
+    CompileCommandIDs.clear();
+  }
+  else if (PendingPackage != 0) {
+    std::vector<unsigned> Pending =
+      Incremental ? Store->getCompileCommands(PendingPackage)
+                  : Store->getPendingCompileCommands(PendingPackage);
+    CompileCommandIDs.insert(CompileCommandIDs.end(), Pending.begin(),
+                             Pending.end());
+  }
+  // Each compile command runs once, in the order given
+  DenseSet<unsigned> Seen;
+  CompileCommandIDs.erase(
+    std::remove_if(CompileCommandIDs.begin(), CompileCommandIDs.end(),
+                   [&Seen](unsigned ID) { return !Seen.insert(ID).second; }),
+    CompileCommandIDs.end());
+  if (CompileCommandIDs.empty() && !Jobs) {
+    errs() << "No pending compile commands\n";
+    return 0;
+  }
+
+  IncrementalReport Report;
+  IncrementalReport *ReportIfIncremental = Incremental ? &Report : nullptr;
 
-  ClangTool Tool(CompilationDatabase, Sources);
+  // The connection and the package's caches are shared by every translation
+  // unit of a worker
+  if (NumJobs <= 1 && !Jobs) {
+    Database DB(CompileCommandIDs.front(), std::move(Store));
+    DB.setReuseStoredChecks(ReuseStoredChecks);
+    int Ret = checkCompileCommands(DB, std::move(CompileCommandIDs),
+                                   /*OwnFileSystem=*/ false,
+                                   ReportIfIncremental);
+    if (PrintStatistics) {
+      DB.printStatistics(llvm::errs());
+    }
+    if (Incremental) {
+      Report.print(llvm::errs());
+    }
+    return Ret;
+  }
 
-  CheckFactory Factory(DB);
-  return Tool.run(&Factory);
+  // The storages are created up front so a bad connection fails right away
+  unsigned NumWorkers = std::max(NumJobs.getValue(), 1u);
+  if (!Jobs) {
+    NumWorkers = std::min<size_t>(NumWorkers, CompileCommandIDs.size());
+  }
+  std::vector<std::unique_ptr<Storage>> Stores;
+  Stores.push_back(std::move(Store));
+  for (unsigned Worker = 1; Worker < NumWorkers; ++Worker) {
+    Stores.push_back(CreateStorage(Worker));
+  }
+  // Returns 0 once there's nothing left
+  std::atomic<size_t> NextCompileCommand{0};
+  auto Next = [&]() -> unsigned {
+    if (Jobs) {
+      return Jobs->claim();
+    }
+    size_t i = NextCompileCommand++;
+    return i < CompileCommandIDs.size() ? CompileCommandIDs[i] : 0;
+  };
+  std::atomic<int> Ret{0};
+  std::mutex StatisticsMutex;
+  auto Work = [&](unsigned Worker) {
+    unsigned ID = Next();
+    if (ID == 0) {
+      return;
+    }
+    Database DB(ID, std::move(Stores[Worker]));
+    DB.setReuseStoredChecks(ReuseStoredChecks);
+    for (; ID != 0; ID = Next()) {
+      bool Checked =
+        checkCompileCommands(DB, {ID}, /*OwnFileSystem=*/ true,
+                             ReportIfIncremental) == 0;
+      if (!Checked) {
+        Ret = 1;
+      }
+      // The unit of work committed before checkCompileCommands returned
+      if (Jobs) {
+        Jobs->finish(ID, Checked);
+      }
+    }
+    if (PrintStatistics) {
+      std::lock_guard<std::mutex> Lock(StatisticsMutex);
+      llvm::errs() << "Worker " << Worker << ":\n";
+      DB.printStatistics(llvm::errs());
+    }
+  };
+  std::vector<std::thread> Threads;
+  for (unsigned Worker = 0; Worker < NumWorkers; ++Worker) {
+    Threads.emplace_back(Work, Worker);
+  }
+  for (std::thread &Thread : Threads) {
+    Thread.join();
+  }
+  if (PrintStatistics && Jobs) {
+    Jobs->printStatistics(llvm::errs());
+  }
+  if (Incremental) {
+    Report.print(llvm::errs());
+  }
+  return Ret;
 }
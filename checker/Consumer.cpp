@@ -3,6 +3,7 @@
 #include <clang/AST/ASTConsumer.h>
 #include <clang/AST/CXXInheritance.h>
 #include <clang/AST/RecursiveASTVisitor.h>
+#include <llvm/ADT/DenseSet.h>
 #include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/Support/raw_ostream.h>
 
@@ -39,6 +40,31 @@ bool isSkippedRecord(ClangDatabase &ClangDB, const CXXRecordDecl *D) {
   return false;
 }
 
+// Collects the decls whose presumed locations the consumer asks for, so they
+// can be resolved with a single query before the real traversal
+class PresumedLocCollector
+    : public RecursiveASTVisitor<PresumedLocCollector> {
+public:
+  std::vector<const Decl *> Decls;
+
+  bool VisitCXXRecordDecl(CXXRecordDecl *D) {
+    Decls.push_back(D->getCanonicalDecl());
+    return true;
+  }
+
+  bool VisitCXXMethodDecl(CXXMethodDecl *D) {
+    Decls.push_back(D->getCanonicalDecl());
+    if (const FunctionDecl *Definition = D->getDefinition())
+      Decls.push_back(Definition);
+    return true;
+  }
+
+  bool VisitFieldDecl(FieldDecl *D) {
+    Decls.push_back(D->getCanonicalDecl());
+    return true;
+  }
+};
+
 class InsertIntoDatabaseConsumer
     : public ASTConsumer,
       public RecursiveASTVisitor<InsertIntoDatabaseConsumer> {
@@ -82,42 +108,41 @@ private:
     }
   }
 
-  void addPublicMethodsAndFields(
-      const CXXRecordDecl *Class,
-      llvm::SmallPtrSet<const CXXMethodDecl *, 16> &PublicMethods,
-      std::vector<FieldDecl *> &PublicFields) {
-    llvm::SmallPtrSet<const CXXMethodDecl *, 16> OverriddenMethods;
+  // Only a record's own public methods and fields are stored, along with the
+  // base methods they override. The server expands inherited ones through the
+  // public bases.
+  void insertDirectPublicMembers(const CXXRecordDecl *Class) {
+    if (!RecordsWithMembers.insert(Class->getCanonicalDecl()).second) {
+      return;
+    }
 
+    llvm::SmallPtrSet<const CXXMethodDecl *, 16> PublicMethods;
+    llvm::SmallPtrSet<const CXXMethodDecl *, 16> OverriddenMethods;
     addUnskippedPublicMethods(Class, PublicMethods, OverriddenMethods);
+    for (auto Method : PublicMethods) {
+      ClangDB.insertPublicMethod(Class, Method);
+      for (auto OverriddenMethod : Method->overridden_methods()) {
+        ClangDB.insertPublicOverride(Method, OverriddenMethod);
+      }
+    }
     for (auto Field : Class->fields()) {
       if (Field->getAccess() == AS_public)
-        PublicFields.push_back(Field);
+        ClangDB.insertPublicField(Class, Field);
     }
+  }
 
-    auto UntilLeaf = [](const CXXBaseSpecifier *Specifier, CXXBasePath &Path) {
-      CXXRecordDecl *Class = Specifier->getType()->getAsCXXRecordDecl();
-      if (Class->getNumBases() == 0 && Class->getNumVBases() == 0)
-        return true;
-      else
-        return false;
-    };
-
-    CXXBasePaths Paths;
-    Class->lookupInBases(UntilLeaf, Paths, /*LookupInDependent=*/ false);
-    for (CXXBasePath &Path : Paths) {
-      for (CXXBasePathElement &Element : Path) {
-        // Stop exploring this path, no inherited methods or fields are public
-        const CXXBaseSpecifier *Specifier = Element.Base;
-        if (Specifier->getAccessSpecifier() != AS_public) {
-          break;
-        }
+  void insertPublicBases(const CXXRecordDecl *Class) {
+    for (const CXXBaseSpecifier &Specifier : Class->bases()) {
+      // No inherited methods or fields are public through this base
+      if (Specifier.getAccessSpecifier() != AS_public) {
+        continue;
+      }
 
-        CXXRecordDecl *Base = Specifier->getType()->getAsCXXRecordDecl();
-        addUnskippedPublicMethods(Base, PublicMethods, OverriddenMethods);
-        for (auto Field : Base->fields()) {
-          if (Field->getAccess() == AS_public)
-            PublicFields.push_back(Field);
-        }
+      CXXRecordDecl *Base = Specifier.getType()->getAsCXXRecordDecl();
+      ClangDB.insertPublicBase(Class, Base);
+      if (!RecordsWithMembers.count(Base->getCanonicalDecl())) {
+        insertDirectPublicMembers(Base);
+        insertPublicBases(Base);
       }
     }
   }
@@ -126,12 +151,26 @@ public:
   explicit InsertIntoDatabaseConsumer(Database &DB,
 				      ASTContext &Ctx,
 				      SourceManager &SM)
-      : Ctx(Ctx), SM(SM), DB(DB), ClangDB(DB, Ctx, SM) {
+      : Ctx(Ctx), SM(SM), DB(DB), ClangDB(DB, Ctx, SM), Committed(false) {
+    DB.beginUnit();
+  }
+  ~InsertIntoDatabaseConsumer() override {
+    // The translation unit never finished, don't leave a partial result
+    if (!Committed) {
+      DB.rollbackUnit();
+    }
   }
 
   void HandleTranslationUnit(ASTContext &Context) override {
     TranslationUnitDecl *D = Context.getTranslationUnitDecl();
+    PresumedLocCollector Collector;
+    Collector.TraverseDecl(D);
+    ClangDB.resolvePresumedLocs(Collector.Decls);
     TraverseDecl(D);
+    ClangDB.insertInputs();
+    ClangDB.flush();
+    DB.commitUnit();
+    Committed = true;
   }
   void HandleVTable(CXXRecordDecl *RD) override {
   }
@@ -172,16 +211,9 @@ public:
       llvm::errs() << "Class: " << D->getQualifiedNameAsString() << '\n';
     }
 
-    llvm::SmallPtrSet<const CXXMethodDecl *, 16> PublicMethods;
-    std::vector<FieldDecl *> PublicFields;
-
-    addPublicMethodsAndFields(D, PublicMethods, PublicFields);
-
-    for (auto Method : PublicMethods) {
-      ClangDB.insertPublicMethod(D, Method);
-    }
-    for (auto Field : PublicFields) {
-      ClangDB.insertPublicField(D, Field);
+    if (!RecordsWithMembers.count(D)) {
+      insertDirectPublicMembers(D);
+      insertPublicBases(D);
     }
 
     return true;
@@ -196,6 +228,10 @@ public:
       else
         return true;
 
+    // Every redeclaration leads to the same definition
+    if (!CheckedMethods.insert(D).second)
+      return true;
+
     if (ClangDB.isSkippedMethod(D))
       return true;
 
@@ -203,6 +239,9 @@ public:
     if (PresumedLocID == 0)
       return true;
 
+    if (ClangDB.isCheckedMethod(D))
+      return true;
+
     for (const CXXMethodDecl *Overridden : D->overridden_methods()) {
       ClangDB.insertMethodDependence(D, Overridden);
       ClangDB.insertMethodDependence(Overridden, D);
@@ -235,8 +274,13 @@ public:
 private:
   Database &DB;
   ClangDatabase ClangDB;
+  // Records whose public members and bases are already inserted
+  llvm::DenseSet<const CXXRecordDecl *> RecordsWithMembers;
+  // Method definitions already visited in this translation unit
+  llvm::DenseSet<const CXXMethodDecl *> CheckedMethods;
   const ASTContext &Ctx;
   const SourceManager &SM;
+  bool Committed;
 };
 
 
@@ -0,0 +1,79 @@
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Signals.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "Database.h"
+
+using namespace clang::immutability;
+using namespace llvm;
+
+int main(int argc, const char **argv) {
+  llvm::sys::PrintStackTraceOnErrorSignal(argv[0]);
+
+  llvm::cl::OptionCategory Category("const-checker-export Options");
+  cl::list<unsigned> PackageIDs(
+      cl::Positional, cl::desc("<package id>..."), cl::OneOrMore,
+      cl::cat(Category));
+  cl::opt<std::string> OutputFile(
+      "o", cl::desc("Write the results to this file instead of stdout"),
+      cl::init("-"), cl::value_desc("path"), cl::cat(Category));
+  cl::opt<std::string> ConnInfo(
+      "conninfo", cl::desc("libpq connection string of the database"),
+      cl::init("dbname = cpp_doc"), cl::cat(Category));
+  cl::opt<std::string> ShardDirectory(
+      "shards",
+      cl::desc("Write static JSON shards for the website to this directory "
+               "instead of result lines"),
+      cl::value_desc("directory"), cl::cat(Category));
+  cl::opt<unsigned> NumJobs(
+      "j", cl::desc("Threads writing shards, one per core by default"),
+      cl::init(0), cl::cat(Category));
+  cl::opt<bool> PrintStatistics(
+      "print-db-stats", cl::desc("Print export counters on exit"),
+      cl::cat(Category));
+  cl::HideUnrelatedOptions(Category);
+  cl::ParseCommandLineOptions(argc, argv);
+
+  if (!ShardDirectory.empty()) {
+    int Ret = 0;
+    ShardGenerator Generator(ConnInfo, NumJobs);
+    for (unsigned PackageID : PackageIDs) {
+      if (!Generator.generate(PackageID, ShardDirectory)) {
+        Ret = 1;
+      }
+    }
+    if (!Generator.writePackageIndex(ShardDirectory)) {
+      Ret = 1;
+    }
+    if (PrintStatistics) {
+      Generator.printStatistics(llvm::errs());
+    }
+    return Ret;
+  }
+
+  std::error_code EC;
+  raw_fd_ostream OS(OutputFile, EC, sys::fs::OF_None);
+  if (EC) {
+    errs() << OutputFile << ": " << EC.message() << '\n';
+    return 1;
+  }
+
+  int Ret = 0;
+  ResultExporter Exporter(ConnInfo);
+  for (unsigned PackageID : PackageIDs) {
+    if (!Exporter.exportPackage(PackageID, OS)) {
+      Ret = 1;
+    }
+  }
+  OS.flush();
+  if (OS.has_error()) {
+    errs() << OutputFile << ": " << OS.error().message() << '\n';
+    OS.clear_error();
+    Ret = 1;
+  }
+  if (PrintStatistics) {
+    Exporter.printStatistics(llvm::errs());
+  }
+  return Ret;
+}
@@ -2,6 +2,7 @@
 #define CLANG_IMMUTABILITY_CHECK_DATABASE_H
 
 #include "MethodResultTuple.h"
+#include "Storage.h"
 
 #include <clang/AST/DeclCXX.h>
 #include <clang/Tooling/CompilationDatabase.h>
@@ -13,23 +14,135 @@ struct DatabaseImpl;
 
 class Database {
 public:
-  explicit Database(unsigned CompileCommandID);
+  explicit Database(unsigned CompileCommandID,
+                    std::unique_ptr<Storage> Store = createPostgresStorage());
   ~Database();
+  const CompileCommandInfo &getCompileCommandInfo() const;
+  // Fetches a compile command to be run later, the current one stays
+  const CompileCommandInfo &prefetchCompileCommand(unsigned CompileCommandID);
+  // The following units of work belong to this compile command. The caches
+  // are kept, only the package's are reloaded when it's another package.
+  void setCompileCommand(unsigned CompileCommandID);
   std::string getSource();
   std::string getDirectory();
   std::vector<std::string> getCommands();
   uint32_t getCompileCommandID() const;
   uint32_t getPackageID() const;
   uint32_t getRootDeclID() const;
+  void printStatistics(raw_ostream &OS) const;
+  // Public views, bases, overrides and method dependences not sent since
+  // they were already written by this process
+  uint64_t getNumSuppressedWrites() const;
   uint32_t getFileDescriptorID(StringRef FullPath);
+  // Whether every package file the compile command read the last time it was
+  // checked still hashes the same. Otherwise Reason says why it has to run
+  // again, and the methods it sees are analyzed again.
+  bool hasUnchangedInputs(unsigned CompileCommandID, std::string &Reason);
+  // Waits for every write sent so far. In the database a failed transaction is
+  // run again if its error is retryable, and spooled if the server stays down.
+  // Returns false if it was dropped instead.
+  bool sync();
+  // Skips methods whose check an earlier run stored, their sources have to
+  // be unchanged since. Compile commands whose files changed still analyze
+  // them again.
+  void setReuseStoredChecks(bool Reuse);
+  void beginUnit();
+  void commitUnit();
+  void rollbackUnit();
 private:
+  void loadPackage();
   std::string getSourceDirectory() const;
+  // Relative to the source directory, empty if it's outside of the package.
+  // Returns false if the path can't be resolved.
+  bool getPackagePath(StringRef FullPath, std::string &Path);
   uint32_t getFileDescriptorIDFromPath(StringRef Path);
   std::unique_ptr<DatabaseImpl> Impl;
 
   friend class ClangDatabase;
 };
 
+struct FactLoaderImpl;
+
+// Merges fact files into the database, each in the transactions it was
+// written with. Files from any number of packages can be loaded.
+class FactLoader {
+public:
+  explicit FactLoader(StringRef ConnInfo);
+  ~FactLoader();
+  // Returns false if the file couldn't be read or one of its transactions
+  // couldn't be written
+  bool load(StringRef Path);
+  // Publishes the rows staged in the package's unlogged partitions
+  bool promote(uint32_t PackageID);
+  void printStatistics(raw_ostream &OS) const;
+private:
+  std::unique_ptr<FactLoaderImpl> Impl;
+};
+
+struct JobQueueImpl;
+
+// The backlog of compile commands in the database, shared by workers on any
+// number of machines. Claimed jobs hold a lease that's renewed in the
+// background until they're finished, a job whose worker dies is claimed
+// again once its lease expires. Safe to use from several threads.
+class JobQueue {
+public:
+  JobQueue(StringRef ConnInfo, unsigned LeaseSeconds);
+  ~JobQueue();
+  // Queues the compile command again if it's done or failed
+  void enqueue(unsigned CompileCommandID);
+  // Queues every compile command of the package that was never checked.
+  // Returns how many were added.
+  unsigned enqueuePackage(uint32_t PackageID);
+  // Returns 0 once there's nothing left to claim
+  unsigned claim();
+  // A failed job goes back to the queue unless it's out of attempts
+  void finish(unsigned CompileCommandID, bool Succeeded);
+  void printStatistics(raw_ostream &OS) const;
+private:
+  std::unique_ptr<JobQueueImpl> Impl;
+};
+
+struct ResultExporterImpl;
+
+// Streams the check results of packages as lines, one per method or field:
+//   M <path> <is const> <mutate result> <return result>
+//   F <path> <is explicit> <is transitive>
+// Fields are separated by tabs, tabs, newlines and backslashes in paths are
+// escaped with a backslash. Only a chunk of rows is in memory at a time.
+class ResultExporter {
+public:
+  explicit ResultExporter(StringRef ConnInfo);
+  ~ResultExporter();
+  // The methods and fields are read in one snapshot. Returns false if the
+  // query failed, some of the package may already have been written.
+  bool exportPackage(uint32_t PackageID, raw_ostream &OS);
+  void printStatistics(raw_ostream &OS) const;
+private:
+  std::unique_ptr<ResultExporterImpl> Impl;
+};
+
+struct ShardGeneratorImpl;
+
+// Writes the results of packages as static JSON for the website, one shard
+// per record and namespace in <output>/<package id>/<decl id>.json, along
+// with an index.json of every shard. Shards that didn't change since the
+// last run of the package aren't written again.
+class ShardGenerator {
+public:
+  // With NumJobs 0 there's a thread per core
+  ShardGenerator(StringRef ConnInfo, unsigned NumJobs);
+  ~ShardGenerator();
+  // Every decl of the package is read in one snapshot, then top-level
+  // namespaces are written in parallel
+  bool generate(uint32_t PackageID, StringRef OutputDirectory);
+  // Lists every package with shards in <output>/packages.json
+  bool writePackageIndex(StringRef OutputDirectory);
+  void printStatistics(raw_ostream &OS) const;
+private:
+  std::unique_ptr<ShardGeneratorImpl> Impl;
+};
+
 struct ClangDatabaseImpl;
 
 class ClangDatabase {
@@ -39,18 +152,36 @@ public:
                 SourceManager &SM);
   ~ClangDatabase();
   uint32_t getPresumedLocID(const Decl *D);
+  void resolvePresumedLocs(ArrayRef<const Decl *> Decls);
   bool isSkippedMethod(const CXXMethodDecl *MD);
+  // Whether an earlier translation unit of this process already checked the
+  // method, inline methods of headers are seen by every unit including them.
+  // Checks stored by earlier runs only count when they're reused.
+  bool isCheckedMethod(const CXXMethodDecl *MD);
   void insertPublicMethod(const CXXRecordDecl *RD, const CXXMethodDecl *MD);
   void insertPublicField(const CXXRecordDecl *RD, const FieldDecl *FD);
+  // Inherited public members aren't stored with each derived record, only
+  // the edges to its public bases and the base methods it overrides
+  void insertPublicBase(const CXXRecordDecl *RD, const CXXRecordDecl *Base);
+  void insertPublicOverride(const CXXMethodDecl *MD, const CXXMethodDecl *Overridden);
   void insertMethodCheck(const CXXMethodDecl *MD, MethodResultTuple Result);
   void insertFieldCheck(const FieldDecl *FD, bool isExplicit, bool isTransitive);
   void insertMethodDependence(const CXXMethodDecl *Method, const CXXMethodDecl *Callee);
+  // Hashes the files of the package the translation unit read, they're
+  // recorded for the compile command when the unit of work commits
+  void insertInputs();
+  void flush();
 private:
   std::string getMangledName(const CXXMethodDecl *D);
   std::string getSignature(const FunctionDecl *Target, bool Qualified);
   uint32_t getPresumedLocIDPLoc(PresumedLoc PLoc);
+  uint32_t getFileID(PresumedLoc PLoc);
   void insertMethod(const CXXMethodDecl *MD);
-  uint32_t getDeclID(const Decl *D);
+  void ship();
+  void shipIfFull();
+  uint64_t getDeclKey(const Decl *D);
+  void stageDecl(StagedDecl &&Staged);
+  void insertPublicView(uint64_t RecordKey, uint64_t DeclKey);
   std::unique_ptr<DatabaseImpl> &getDatabaseImpl() const;
   std::unique_ptr<ClangDatabaseImpl> Impl;
 };
@@ -5,43 +5,73 @@
 
 #include <clang/Tooling/Tooling.h>
 
+#include <algorithm>
+
 namespace clang {
 namespace immutability {
 
+// The compile commands of a batch, at most one per source file. ClangTool
+// asks for a file's compile commands right before running them, so the last
+// one asked for is the one running.
 class PostgresCompilationDatabase : public clang::tooling::CompilationDatabase {
 public:
   PostgresCompilationDatabase(Database &DB) {
-    CC.Directory = DB.getDirectory();
-    CC.Filename = DB.getSource();;
-    CC.CommandLine = DB.getCommands();
+    addCompileCommand(DB.getCompileCommandID(), DB.getCompileCommandInfo());
+  }
+  PostgresCompilationDatabase() = default;
+
+  void addCompileCommand(unsigned CompileCommandID,
+                         const CompileCommandInfo &Info) {
+    clang::tooling::CompileCommand CC;
+    CC.Directory = Info.Directory;
+    CC.Filename = Info.Source;
+    CC.CommandLine = Info.CommandLine;
     CC.CommandLine.push_back("-I/usr/lib/clang/"
                              CLANG_VERSION_STRING
                              "/include");
     // CC.CommandLine.push_back("-I/usr/include/tirpc");
     // CC.CommandLine.push_back("-I/usr/share/skypeforlinux/glibc/usr/include");
+    CCs.push_back(std::move(CC));
+    CompileCommandIDs.push_back(CompileCommandID);
+  }
+
+  bool hasSource(StringRef FilePath) const {
+    return std::find_if(CCs.begin(), CCs.end(),
+                        [FilePath](const clang::tooling::CompileCommand &CC) {
+                          return CC.Filename == FilePath;
+                        }) != CCs.end();
+  }
+
+  unsigned getCurrentCompileCommandID() const {
+    return CurrentCompileCommandID;
   }
 
   std::vector<clang::tooling::CompileCommand>
   getCompileCommands(StringRef FilePath) const override {
     std::vector<clang::tooling::CompileCommand> Commands;
-    if (FilePath == CC.Filename) {
-      Commands.push_back(CC);
+    for (size_t i = 0; i < CCs.size(); ++i) {
+      if (FilePath == CCs[i].Filename) {
+        Commands.push_back(CCs[i]);
+        CurrentCompileCommandID = CompileCommandIDs[i];
+      }
     }
     return Commands;
   }
   std::vector<std::string> getAllFiles() const override {
     std::vector<std::string> Files;
-    Files.push_back(CC.Filename);
+    for (auto &CC : CCs) {
+      Files.push_back(CC.Filename);
+    }
     return Files;
   }
   std::vector<clang::tooling::CompileCommand> getAllCompileCommands() const override {
-    std::vector<clang::tooling::CompileCommand> Commands;
-    Commands.push_back(CC);
-    return Commands;
+    return CCs;
   }
 
 private:
-  clang::tooling::CompileCommand CC;
+  std::vector<clang::tooling::CompileCommand> CCs;
+  std::vector<unsigned> CompileCommandIDs;
+  mutable unsigned CurrentCompileCommandID = 0;
 };
 
 }
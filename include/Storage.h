@@ -0,0 +1,194 @@
+#ifndef CLANG_IMMUTABILITY_CHECK_STORAGE_H
+#define CLANG_IMMUTABILITY_CHECK_STORAGE_H
+
+#include "MethodResultTuple.h"
+
+#include <clang/Tooling/CompilationDatabase.h>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace clang {
+namespace immutability {
+
+// Everything needed to run a compile command, fetched in one query
+struct CompileCommandInfo {
+  uint32_t PackageID;
+  // Every file descriptor path is relative to this directory
+  std::string SourceDirectory;
+  std::string Source;
+  std::string Directory;
+  std::vector<std::string> CommandLine;
+  uint32_t RootDeclID;
+  uint32_t RootFileDescriptorID;
+};
+
+enum class DeclKind {
+  Other,
+  Record,
+  Namespace,
+  Field,
+  Method,
+  Function,
+};
+
+// A decl waiting to be merged, along with the details for the table of its
+// kind
+struct StagedDecl {
+  uint64_t Key = 0;
+  uint64_t ParentKey = 0;
+  uint32_t Depth = 0;
+  std::string Name;
+  std::string Path;
+  uint32_t PresumedLocID = 0;
+
+  DeclKind Kind = DeclKind::Other;
+  bool IsAbstract = false;
+  bool IsDependent = false;
+  bool IsMutable = false;
+  std::string MangledName;
+  bool IsConst = false;
+  bool IsPure = false;
+  uint32_t Access = 0;
+};
+
+// What we know about a decl that's already stored
+struct KnownDecl {
+  uint32_t PresumedLocID = 0;
+  bool HasKind = false;
+  // A method whose check result is stored
+  bool IsChecked = false;
+};
+
+// A file of the package read by a compile command, its path is relative to
+// the package's source directory like a file descriptor's. The one with an
+// empty path is the compile command's directory and command line.
+struct InputFile {
+  std::string Path;
+  // 64-bit FNV-1a of its contents
+  uint64_t Hash = 0;
+};
+
+// Rows of a unit of work, handed to the storage at the end of it or in
+// batches while it runs
+struct FactBatch {
+  std::vector<StagedDecl> Decls;
+  std::vector<std::pair<uint64_t, MethodResultTuple>> MethodChecks;
+  std::vector<std::tuple<uint64_t, bool, bool>> FieldChecks;
+  // Only the direct public members of each record, inherited ones are found
+  // through its public bases
+  std::vector<std::pair<uint64_t, uint64_t>> PublicViews;
+  std::vector<std::pair<uint64_t, uint64_t>> PublicBases;
+  // Public methods and the base methods they hide
+  std::vector<std::pair<uint64_t, uint64_t>> PublicOverrides;
+  std::vector<std::pair<uint64_t, uint64_t>> MethodDependences;
+};
+
+// Where the facts of the analysis are kept. Lookups take effect right away,
+// writes only once their unit of work commits.
+class Storage {
+public:
+  virtual ~Storage();
+
+  // Only fetches the compile command, any number of them can be fetched
+  // ahead of running them
+  virtual CompileCommandInfo getCompileCommandInfo(unsigned CompileCommandID) = 0;
+  // Units of work belong to the compile command selected last
+  virtual void setCompileCommand(unsigned CompileCommandID,
+                                 uint32_t PackageID) = 0;
+  // Compile commands of the package that were never committed, in order
+  virtual std::vector<unsigned>
+  getPendingCompileCommands(uint32_t PackageID) = 0;
+  // Every compile command of the package, in order
+  virtual std::vector<unsigned> getCompileCommands(uint32_t PackageID) = 0;
+  // The package files the compile command read the last time it committed,
+  // empty if they were never recorded
+  virtual std::vector<InputFile>
+  getCompileCommandInputs(unsigned CompileCommandID, uint32_t PackageID) = 0;
+  // Replaces the recorded package files of the current compile command once
+  // the unit of work commits
+  virtual void setCompileCommandInputs(std::vector<InputFile> Inputs) = 0;
+  // Every file descriptor of the package keyed on its path
+  virtual void getFileDescriptors(uint32_t PackageID,
+                                  llvm::StringMap<uint32_t> &FileDescriptors) = 0;
+  // Every keyed decl of the package
+  virtual void getDeclIndex(uint32_t PackageID,
+                            llvm::DenseMap<uint64_t, KnownDecl> &Decls) = 0;
+  // Creates a chain of file descriptors below ParentID, each name is the child
+  // of the one before it. Returns their IDs in the same order.
+  virtual std::vector<uint32_t>
+  createFileDescriptors(uint32_t PackageID, uint32_t ParentID,
+                        llvm::StringRef ParentPath,
+                        llvm::ArrayRef<std::string> Names) = 0;
+  // Returns the IDs of presumed locations in the same order, creating the
+  // ones that don't exist yet
+  virtual std::vector<uint32_t>
+  getPresumedLocs(llvm::ArrayRef<uint32_t> FileIDs,
+                  llvm::ArrayRef<uint32_t> Lines,
+                  llvm::ArrayRef<uint32_t> Columns) = 0;
+
+  virtual void beginUnit() = 0;
+  virtual void commitUnit() = 0;
+  virtual void rollbackUnit() = 0;
+  // Rows are only guaranteed to be visible once merged
+  virtual void write(uint32_t PackageID, FactBatch &Batch) = 0;
+  // Merges every row written so far in the unit of work
+  virtual void merge(uint32_t PackageID) = 0;
+  // Waits for every write sent so far. Returns false if a failed
+  // transaction's writes were dropped.
+  virtual bool sync() {
+    return true;
+  }
+  // Whether rows should be written in batches while the unit runs instead of
+  // all at the end
+  virtual bool wantsBatches() const {
+    return false;
+  }
+  virtual void printStatistics(llvm::raw_ostream &OS) const = 0;
+};
+
+// The cpp_doc database. With AsyncWrites every write runs on a background
+// thread. With a fact file nothing is written to the database, every write
+// is appended to the file instead for const-checker-load to merge later. With
+// UnloggedStaging rows stay in the package's unlogged staging partitions
+// until const-checker-load promotes it.
+std::unique_ptr<Storage> createPostgresStorage(llvm::StringRef ConnInfo,
+                                               llvm::StringRef FactFile,
+                                               bool AsyncWrites,
+                                               bool UnloggedStaging);
+std::unique_ptr<Storage> createPostgresStorage();
+// Keeps everything in memory and drops it on exit, for measuring the
+// analysis on its own
+std::unique_ptr<Storage> createMemoryStorage(llvm::StringRef CompileCommands);
+// A single SQLite file, created if it doesn't exist
+std::unique_ptr<Storage> createSQLiteStorage(llvm::StringRef Path,
+                                             llvm::StringRef CompileCommands);
+
+// The JSON compilation database storage other than the database runs its
+// compile commands from, loaded once. A compile command's ID is its 1-based
+// position in the file. Its package is everything below the closest common
+// directory of all of them.
+class LocalCompileCommands {
+public:
+  explicit LocalCompileCommands(llvm::StringRef Path);
+  // The package and root IDs are left for the storage to fill in
+  CompileCommandInfo getCompileCommandInfo(unsigned CompileCommandID) const;
+  // Every compile command of the file
+  std::vector<unsigned> getCompileCommandIDs() const;
+private:
+  std::string Path;
+  std::vector<tooling::CompileCommand> Commands;
+  std::string SourceDirectory;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,436 @@
+#include "Connection.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <thread>
+
+using namespace llvm;
+
+namespace clang {
+namespace immutability {
+
+namespace {
+
+// Upper bound on queries in flight before we force a sync point, this keeps
+// the server from blocking on a full socket while we're still sending
+constexpr size_t MaxInFlight = 256;
+
+#ifdef LIBPQ_HAS_CHUNK_MODE
+// Rows held at once when streaming a result in chunks
+constexpr int StreamChunkSize = 4096;
+#endif
+
+bool isPipelined(Connection &Conn) {
+#ifdef LIBPQ_HAS_PIPELINING
+  return PQpipelineStatus(Conn.Handle) == PQ_PIPELINE_ON;
+#else
+  return false;
+#endif
+}
+
+ErrorKind classify(const Connection &Conn, StringRef SQLState) {
+  if (PQstatus(Conn.Handle) != CONNECTION_OK) {
+    return ErrorKind::ConnectionLost;
+  }
+  // serialization_failure and deadlock_detected
+  if (SQLState == "40001" || SQLState == "40P01") {
+    return ErrorKind::Retryable;
+  }
+  // Connection exceptions, and the server shutting down or starting up
+  if (SQLState.startswith("08") || SQLState.startswith("57P")) {
+    return ErrorKind::ConnectionLost;
+  }
+  return ErrorKind::Fatal;
+}
+
+QueryError getError(const Connection &Conn, const PGresult *R, StringRef Q) {
+  QueryError Error;
+  if (R != nullptr) {
+    auto Status = PQresultStatus(R);
+    if (Status == PGRES_TUPLES_OK || Status == PGRES_COMMAND_OK) {
+      return Error;
+    }
+    const char *SQLState = PQresultErrorField(R, PG_DIAG_SQLSTATE);
+    Error.SQLState = SQLState ? SQLState : "";
+    Error.Message = PQresultErrorMessage(R);
+    if (Error.Message.empty()) {
+      Error.Message = PQresStatus(Status);
+    }
+  }
+  else {
+    Error.Message = PQerrorMessage(Conn.Handle);
+  }
+  Error.Kind = classify(Conn, Error.SQLState);
+  Error.Query = Q.str();
+  return Error;
+}
+
+// Returns the prepared statement for Q, preparing it on first use. In pipeline
+// mode the prepare is queued in front of the query that needs it.
+PreparedStatement &prepare(Connection &Conn,
+                           const char *Q, const Params &P) {
+  PreparedStatement &Statement = Conn.Statements[Q];
+  ++Statement.NumExecutions;
+  if (!Statement.Name.empty()) {
+    return Statement;
+  }
+
+  std::stringstream ss;
+  ss << "s" << ++Conn.NumPrepared;
+  Statement.Name = ss.str();
+  ++Statement.NumPrepares;
+
+#ifdef LIBPQ_HAS_PIPELINING
+  if (isPipelined(Conn)) {
+    int Sent = PQsendPrepare(Conn.Handle, Statement.Name.c_str(), Q,
+                             P.getN(), nullptr);
+    if (!Sent) {
+      recordError(Conn, nullptr, Q);
+      Statement.Name.clear();
+      return Statement;
+    }
+    Conn.InFlight.emplace_back(Q, /*IsPrepare=*/ true);
+    return Statement;
+  }
+#endif
+  PGresult *R = PQprepare(Conn.Handle, Statement.Name.c_str(), Q,
+                          P.getN(), nullptr);
+  if (PQresultStatus(R) != PGRES_COMMAND_OK) {
+    recordError(Conn, R, Q);
+    Statement.Name.clear();
+  }
+  PQclear(R);
+  return Statement;
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+// A prepare the server never confirmed has to be sent again, it's skipped if
+// an earlier query in the pipeline failed
+void forgetPrepare(Connection &Conn, const InFlightQuery &Query) {
+  if (Query.IsPrepare) {
+    Conn.Statements[Query.Query].Name.clear();
+  }
+}
+
+void forgetPrepares(Connection &Conn) {
+  for (const InFlightQuery &Query : Conn.InFlight) {
+    forgetPrepare(Conn, Query);
+  }
+  Conn.InFlight.clear();
+}
+
+void send(Connection &Conn, const char *Q, const Params &P) {
+  PreparedStatement &Statement = prepare(Conn, Q, P);
+  int Sent = PQsendQueryPrepared(Conn.Handle, Statement.Name.c_str(),
+                                 P.getN(), P.getValues(), P.getLengths(),
+                                 P.getFormats(), 1);
+  if (!Sent) {
+    recordError(Conn, nullptr, Q);
+    return;
+  }
+  Conn.InFlight.emplace_back(Q);
+}
+
+// Ends the current pipeline and reads the results of every query in flight.
+// The result of the last query is returned if KeepLast is set, otherwise all
+// of them are only checked for success.
+PGresult *drain(Connection &Conn, bool KeepLast) {
+  PGresult *Last = nullptr;
+  bool Synced = PQpipelineSync(Conn.Handle);
+  if (!Synced) {
+    recordError(Conn, nullptr, "PQpipelineSync");
+    forgetPrepares(Conn);
+  }
+
+  while (!Conn.InFlight.empty()) {
+    PGresult *R = PQgetResult(Conn.Handle);
+    if (R == nullptr) {
+      // We only run out of results early if the connection is gone
+      recordError(Conn, nullptr, Conn.InFlight.front().Query);
+      forgetPrepares(Conn);
+      break;
+    }
+    if (PQresultStatus(R) != PGRES_COMMAND_OK) {
+      forgetPrepare(Conn, Conn.InFlight.front());
+    }
+    if (KeepLast && Conn.InFlight.size() == 1) {
+      Last = R;
+    }
+    else {
+      recordError(Conn, R, Conn.InFlight.front().Query);
+      PQclear(R);
+    }
+    Conn.InFlight.pop_front();
+    // Each query's results are terminated by a null result
+    PQclear(PQgetResult(Conn.Handle));
+  }
+
+  if (Synced && PQstatus(Conn.Handle) == CONNECTION_OK) {
+    PGresult *Sync = PQgetResult(Conn.Handle);
+    assert(Sync == nullptr || PQresultStatus(Sync) == PGRES_PIPELINE_SYNC);
+    PQclear(Sync);
+  }
+  if (KeepLast && Last == nullptr) {
+    Last = PQmakeEmptyPGresult(Conn.Handle, PGRES_FATAL_ERROR);
+  }
+  return Last;
+}
+#endif
+
+PGresult *execOnce(Connection &Conn, const char *Q, const Params &P) {
+#ifdef LIBPQ_HAS_PIPELINING
+  if (isPipelined(Conn)) {
+    send(Conn, Q, P);
+    return drain(Conn, /*KeepLast=*/ true);
+  }
+#endif
+  PreparedStatement &Statement = prepare(Conn, Q, P);
+  PGresult *R = PQexecPrepared(Conn.Handle, Statement.Name.c_str(), P.getN(),
+                               P.getValues(), P.getLengths(), P.getFormats(),
+                               1);
+  if (R == nullptr) {
+    R = PQmakeEmptyPGresult(Conn.Handle, PGRES_FATAL_ERROR);
+  }
+  return R;
+}
+
+}
+
+void sleepBeforeRetry(unsigned Attempt) {
+  static thread_local std::mt19937 Generator{std::random_device()()};
+  // 100ms doubling up to 30s, we sleep for a random time between half of it
+  // and all of it so workers that failed together don't retry together
+  unsigned Delay = 100 << std::min(Attempt, 9u);
+  Delay = std::min(Delay, 30000u);
+  std::uniform_int_distribution<unsigned> Jitter(Delay / 2, Delay);
+  std::this_thread::sleep_for(std::chrono::milliseconds(Jitter(Generator)));
+}
+
+void recordError(Connection &Conn, const PGresult *R, StringRef Q) {
+  if (Conn.Error) {
+    return;
+  }
+  Conn.Error = getError(Conn, R, Q);
+  if (Conn.Error) {
+    errs() << "Query failed: " << Conn.Error.Message;
+    errs() << "Query: " << Q << '\n';
+  }
+}
+
+PGresult *exec(Connection &Conn, const char *Q, const Params &P,
+               QueryError &Error) {
+  // Only a query on its own can simply be run again
+  auto Status = PQtransactionStatus(Conn.Handle);
+  bool CanRetry = Conn.InFlight.empty()
+    && (Status == PQTRANS_IDLE || Status == PQTRANS_UNKNOWN);
+
+  for (unsigned Attempt = 0; ; ++Attempt) {
+    bool HadError = static_cast<bool>(Conn.Error);
+    PGresult *R = execOnce(Conn, Q, P);
+    Error = getError(Conn, R, Q);
+    if (!HadError && Conn.Error) {
+      // The prepare failed, the error is ours rather than the connection's
+      if (!Error) {
+        Error = Conn.Error;
+      }
+      Conn.Error = QueryError();
+    }
+
+    if (!Error || Error.Kind == ErrorKind::Fatal || !CanRetry
+        || Attempt == MaxRetries) {
+      return R;
+    }
+    errs() << "Retrying query: " << Error.Message;
+    PQclear(R);
+    ++Conn.NumRetries;
+    sleepBeforeRetry(Attempt);
+    if (Error.Kind == ErrorKind::ConnectionLost) {
+      reconnect(Conn);
+    }
+  }
+}
+
+void connect(Connection &Conn) {
+  for (unsigned Attempt = 0; ; ++Attempt) {
+    Conn.Handle = PQconnectdb(Conn.ConnInfo.c_str());
+    if (PQstatus(Conn.Handle) == CONNECTION_OK) {
+      return;
+    }
+    errs() << "connect: " << PQerrorMessage(Conn.Handle);
+    PQfinish(Conn.Handle);
+    Conn.Handle = nullptr;
+    if (Attempt == MaxRetries) {
+      report_fatal_error("Could not connect to the database");
+    }
+    sleepBeforeRetry(Attempt);
+  }
+}
+
+bool reconnect(Connection &Conn) {
+  PQreset(Conn.Handle);
+  if (PQstatus(Conn.Handle) != CONNECTION_OK) {
+    errs() << "reconnect: " << PQerrorMessage(Conn.Handle);
+    return false;
+  }
+  ++Conn.NumReconnects;
+
+  // The new session has none of the old one's prepared statements or
+  // temporary tables
+  for (auto &Entry : Conn.Statements) {
+    Entry.getValue().Name.clear();
+  }
+  Conn.InFlight.clear();
+  Conn.HasStagingTables = false;
+  Conn.Error = QueryError();
+  if (Conn.IsPipelined) {
+    enterPipelineMode(Conn);
+  }
+  return true;
+}
+
+void disconnect(Connection &Conn) {
+  PQfinish(Conn.Handle);
+  Conn.Handle = nullptr;
+}
+
+void enterPipelineMode(Connection &Conn) {
+#ifdef LIBPQ_HAS_PIPELINING
+  int Entered = PQenterPipelineMode(Conn.Handle);
+  assert(Entered && "PQenterPipelineMode failed");
+  Conn.IsPipelined = true;
+#endif
+}
+
+void sync(Connection &Conn) {
+#ifdef LIBPQ_HAS_PIPELINING
+  if (isPipelined(Conn) && !Conn.InFlight.empty()) {
+    drain(Conn, /*KeepLast=*/ false);
+  }
+#endif
+}
+
+bool streamRows(Connection &Conn, const char *Q, const Params &P,
+                function_ref<void(const PGresult *R, int Row)> OnRow) {
+  assert(!isPipelined(Conn) && "Can't stream rows in pipeline mode");
+  if (Conn.Error) {
+    return false;
+  }
+
+  PreparedStatement &Statement = prepare(Conn, Q, P);
+  if (Conn.Error) {
+    return false;
+  }
+  int Sent = PQsendQueryPrepared(Conn.Handle, Statement.Name.c_str(),
+                                 P.getN(), P.getValues(), P.getLengths(),
+                                 P.getFormats(), 1);
+  if (!Sent) {
+    recordError(Conn, nullptr, Q);
+    return false;
+  }
+#ifdef LIBPQ_HAS_CHUNK_MODE
+  int RowMode = PQsetChunkedRowsMode(Conn.Handle, StreamChunkSize);
+#else
+  int RowMode = PQsetSingleRowMode(Conn.Handle);
+#endif
+  assert(RowMode && "Could not stream the result");
+
+  // Every result has to be read, even after an error
+  while (PGresult *R = PQgetResult(Conn.Handle)) {
+    switch (PQresultStatus(R)) {
+#ifdef LIBPQ_HAS_CHUNK_MODE
+    case PGRES_TUPLES_CHUNK:
+#endif
+    case PGRES_SINGLE_TUPLE:
+      if (!Conn.Error) {
+        for (int Row = 0; Row < PQntuples(R); ++Row) {
+          OnRow(R, Row);
+        }
+      }
+      break;
+    case PGRES_TUPLES_OK:
+      // The end of the rows, with none of its own
+      break;
+    default:
+      recordError(Conn, R, Q);
+      break;
+    }
+    PQclear(R);
+  }
+  if (PQstatus(Conn.Handle) != CONNECTION_OK) {
+    recordError(Conn, nullptr, Q);
+  }
+  return !Conn.Error;
+}
+
+// A COPY can't run in pipeline mode, so we leave it for the duration.
+void copyIn(Connection &Conn, const char *Q, const std::string &Data) {
+  if (Conn.Error) {
+    return;
+  }
+
+  bool WasPipelined = isPipelined(Conn);
+#ifdef LIBPQ_HAS_PIPELINING
+  if (WasPipelined) {
+    if (!Conn.InFlight.empty()) {
+      drain(Conn, /*KeepLast=*/ false);
+      if (Conn.Error) {
+        return;
+      }
+    }
+    if (!PQexitPipelineMode(Conn.Handle)) {
+      recordError(Conn, nullptr, Q);
+      return;
+    }
+  }
+#endif
+
+  PGresult *R = PQexec(Conn.Handle, Q);
+  if (PQresultStatus(R) == PGRES_COPY_IN) {
+    PQclear(R);
+    if (PQputCopyData(Conn.Handle, Data.data(), Data.size()) != 1
+        || PQputCopyEnd(Conn.Handle, nullptr) != 1) {
+      recordError(Conn, nullptr, Q);
+    }
+    // The COPY's result, then the null result that ends it
+    R = PQgetResult(Conn.Handle);
+    recordError(Conn, R, Q);
+    PQclear(R);
+    while ((R = PQgetResult(Conn.Handle)) != nullptr) {
+      PQclear(R);
+    }
+  }
+  else {
+    recordError(Conn, R, Q);
+    PQclear(R);
+  }
+
+#ifdef LIBPQ_HAS_PIPELINING
+  if (WasPipelined && PQstatus(Conn.Handle) == CONNECTION_OK) {
+    enterPipelineMode(Conn);
+  }
+#endif
+}
+
+DeferredResult::DeferredResult(Connection &Conn,
+                               const char *Q, const Params &P) {
+#ifdef LIBPQ_HAS_PIPELINING
+  if (isPipelined(Conn)) {
+    send(Conn, Q, P);
+    if (Conn.InFlight.size() >= MaxInFlight) {
+      drain(Conn, /*KeepLast=*/ false);
+    }
+    return;
+  }
+#endif
+  QueryError Error;
+  PGresult *R = exec(Conn, Q, P, Error);
+  if (Error) {
+    recordError(Conn, R, Q);
+  }
+  PQclear(R);
+}
+
+}
+}
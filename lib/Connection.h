@@ -0,0 +1,426 @@
+#ifndef CLANG_IMMUTABILITY_CHECK_CONNECTION_H
+#define CLANG_IMMUTABILITY_CHECK_CONNECTION_H
+
+#include <cassert>
+#include <deque>
+#include <list>
+#include <string>
+#include <vector>
+
+#include <libpq-fe.h>
+#include <arpa/inet.h>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/raw_ostream.h>
+
+namespace clang {
+namespace immutability {
+
+struct PreparedStatement {
+  std::string Name;
+  unsigned NumPrepares = 0;
+  unsigned NumExecutions = 0;
+};
+
+// A query sent in pipeline mode, or the prepare queued in front of it
+struct InFlightQuery {
+  explicit InFlightQuery(std::string Query, bool IsPrepare = false)
+    : Query(std::move(Query)), IsPrepare(IsPrepare) {}
+
+  std::string Query;
+  bool IsPrepare;
+};
+
+// Decides what we do after a query fails
+enum class ErrorKind {
+  None,
+  // A serialization failure or deadlock, the transaction can be run again
+  Retryable,
+  // The connection is gone, we reconnect and run the transaction again
+  ConnectionLost,
+  // Retrying won't help
+  Fatal,
+};
+
+struct QueryError {
+  ErrorKind Kind = ErrorKind::None;
+  std::string SQLState;
+  std::string Message;
+  std::string Query;
+
+  explicit operator bool() const {
+    return Kind != ErrorKind::None;
+  }
+};
+
+// A libpq connection along with the state we keep per connection
+struct Connection {
+  Connection() = default;
+  Connection(const Connection &) = delete;
+  Connection &operator=(const Connection &) = delete;
+
+  std::string ConnInfo = "dbname = cpp_doc";
+  PGconn *Handle = nullptr;
+  // Queries sent in pipeline mode whose results have not been read yet
+  std::deque<InFlightQuery> InFlight;
+  // Every distinct query is prepared once per connection, keyed by its text
+  llvm::StringMap<PreparedStatement> Statements;
+  unsigned NumPrepared = 0;
+  bool HasStagingTables = false;
+  bool IsPipelined = false;
+  // The first failure of a query whose result we don't read, any later ones
+  // are usually caused by it. It's cleared once the transaction is dealt with.
+  QueryError Error;
+  unsigned NumRetries = 0;
+  unsigned NumReconnects = 0;
+};
+
+// Attempts before we give up on a retryable error
+constexpr unsigned MaxRetries = 10;
+
+// Sleeps for an exponentially growing, jittered delay
+void sleepBeforeRetry(unsigned Attempt);
+
+// Connecting is retried, the process only exits if the server stays down
+void connect(Connection &Conn);
+// Reestablishes a lost connection, along with its prepared statements
+bool reconnect(Connection &Conn);
+void disconnect(Connection &Conn);
+// Queries are then only sent, their results are read at the next sync point
+void enterPipelineMode(Connection &Conn);
+// Reads the results of every query still in flight
+void sync(Connection &Conn);
+// Keeps the error of R, or of the connection if R is null, unless we have one
+void recordError(Connection &Conn, const PGresult *R, llvm::StringRef Q);
+
+class Params {
+  std::vector<const char *> Values;
+  std::list<uint32_t> BinaryValues; // Required for stable iterators
+  std::list<std::string> BinaryArrays; // Required for stable iterators
+  std::vector<int> Lengths;
+  std::vector<int> Formats;
+
+  static void appendBinary(std::string &BinaryArray, uint32_t Binary) {
+    Binary = htonl(Binary);
+    BinaryArray.append((const char *) &Binary, sizeof(Binary));
+  }
+  std::string &addArrayHeader(uint32_t ElementOID, size_t NumElements) {
+    BinaryArrays.emplace_back();
+    std::string &BinaryArray = BinaryArrays.back();
+    appendBinary(BinaryArray, 1); // Number of dimensions
+    appendBinary(BinaryArray, 0); // Has nulls
+    appendBinary(BinaryArray, ElementOID);
+    appendBinary(BinaryArray, NumElements);
+    appendBinary(BinaryArray, 1); // Lower bound
+    return BinaryArray;
+  }
+  void addArray(const std::string &BinaryArray) {
+    Values.push_back(BinaryArray.data());
+    Lengths.push_back(BinaryArray.size());
+    Formats.push_back(1); // 1 is binary
+  }
+public:
+  void addText(const char *Text) {
+    Values.push_back(Text);
+    Lengths.push_back(0); // Ignored for text, used for binary
+    Formats.push_back(0); // 0 is text, 1 is binary
+  }
+  void addBinary(uint32_t Binary) {
+    BinaryValues.push_back(htonl(Binary));
+    auto &BinaryValue = BinaryValues.back();
+    const char *Value = (const char *) &BinaryValue;
+
+    Values.push_back(Value);
+    Lengths.push_back(sizeof(BinaryValue));
+    Formats.push_back(1); // 1 is binary
+  }
+  void addBool(bool B) {
+    if (B)
+      addText("true");
+    else
+      addText("false");
+  }
+  // Encodes a one dimensional text[] in the binary array format
+  void addTextArray(llvm::ArrayRef<std::string> Texts) {
+    std::string &BinaryArray = addArrayHeader(25, Texts.size()); // text
+    for (auto &Text : Texts) {
+      appendBinary(BinaryArray, Text.size());
+      BinaryArray.append(Text);
+    }
+    addArray(BinaryArray);
+  }
+  // Encodes a one dimensional integer[] in the binary array format
+  void addBinaryArray(llvm::ArrayRef<uint32_t> Binaries) {
+    std::string &BinaryArray = addArrayHeader(23, Binaries.size()); // int4
+    for (uint32_t Binary : Binaries) {
+      appendBinary(BinaryArray, sizeof(Binary));
+      appendBinary(BinaryArray, Binary);
+    }
+    addArray(BinaryArray);
+  }
+  void clear() {
+    Values.clear();
+    BinaryValues.clear();
+    BinaryArrays.clear();
+    Lengths.clear();
+    Formats.clear();
+  }
+
+  const char * const * getValues() const {
+    return Values.data();
+  }
+  const int * getLengths() const {
+    return Lengths.data();
+  }
+  const int * getFormats() const {
+    return Formats.data();
+  }
+  int getN() const {
+    assert(Values.size() == Lengths.size());
+    assert(Values.size() == Formats.size());
+    return Values.size();
+  }
+
+  void dump() const {
+    auto iBinary = BinaryValues.begin();
+    for (size_t i = 0; i < getN(); ++i) {
+      llvm::errs() << "    ." << i << " = ";
+      if (Formats[i] == 0) {
+        llvm::errs() << Values[i];
+      }
+      else if (Lengths[i] == sizeof(uint32_t)) {
+        llvm::errs() << ntohl(*iBinary);
+        ++iBinary;
+      }
+      else {
+        llvm::errs() << "<array>";
+      }
+      llvm::errs() << '\n';
+    }
+  }
+};
+
+// Runs Q and returns its result, which is never null. Outside of a
+// transaction the query is retried after a retryable error.
+PGresult *exec(Connection &Conn, const char *Q, const Params &P,
+               QueryError &Error);
+
+class Result {
+protected:
+  PGresult *PGResult;
+  QueryError Error;
+public:
+  Result(Connection &Conn,
+         const char *Q, const Params &P) : PGResult(nullptr) {
+    PGResult = exec(Conn, Q, P, Error);
+    assert(PGResult != nullptr);
+  }
+  ~Result() {
+    PQclear(PGResult);
+  }
+
+  const QueryError &getError() const {
+    return Error;
+  }
+
+  Result(const Result &) = delete;
+  Result operator=(const Result &) = delete;
+};
+
+class TupleResult : public Result {
+public:
+  // We can't carry on without the tuples, so failing after the retries is
+  // fatal
+  TupleResult(Connection &Conn,
+              const char *Q, const Params &P) : Result(Conn, Q, P) {
+    if (Error || PQresultStatus(PGResult) != PGRES_TUPLES_OK) {
+      llvm::errs() << "TupleResult: " << PQresultErrorMessage(PGResult);
+      llvm::errs() << "Query: " << Q << '\n';
+      P.dump();
+      llvm::report_fatal_error("TupleResult failed");
+    }
+  }
+
+  TupleResult(const TupleResult &) = delete;
+  TupleResult operator=(const TupleResult &) = delete;
+
+  int getNumTuples() {
+    return PQntuples(PGResult);
+  }
+  uint32_t getID() {
+    assert(getNumTuples() == 1);
+    int FieldIndex = PQfnumber(PGResult, "id");
+    char *Value = PQgetvalue(PGResult, 0, FieldIndex);
+    uint32_t ID = ntohl(*((uint32_t *) Value));
+    return ID;
+  }
+  uint32_t getID(const char *FieldName) {
+    assert(getNumTuples() == 1);
+    return getID(0, FieldName);
+  }
+  uint32_t getID(int Row, const char *FieldName) {
+    int FieldIndex = PQfnumber(PGResult, FieldName);
+    char *Value = PQgetvalue(PGResult, Row, FieldIndex);
+    uint32_t ID = ntohl(*((uint32_t *) Value));
+    return ID;
+  }
+  const char *getValue(const char *FieldName) {
+    assert(getNumTuples() == 1);
+    return getValue(0, FieldName);
+  }
+  const char *getValue(int Row, const char *FieldName) {
+    int FieldIndex = PQfnumber(PGResult, FieldName);
+    char *Value = PQgetvalue(PGResult, Row, FieldIndex);
+    return Value;
+  }
+  // Reads a one dimensional text[] in the binary array format
+  std::vector<std::string> getTextArray(const char *FieldName) {
+    assert(getNumTuples() == 1);
+    int FieldIndex = PQfnumber(PGResult, FieldName);
+    const char *Value = PQgetvalue(PGResult, 0, FieldIndex);
+    auto Next = [&Value]() {
+      uint32_t Binary = ntohl(*((uint32_t *) Value));
+      Value += sizeof(Binary);
+      return Binary;
+    };
+
+    std::vector<std::string> Elements;
+    uint32_t NumDimensions = Next();
+    Next(); // Has nulls
+    Next(); // Element type
+    if (NumDimensions == 0) {
+      return Elements;
+    }
+    assert(NumDimensions == 1);
+    uint32_t NumElements = Next();
+    Next(); // Lower bound
+    for (uint32_t i = 0; i < NumElements; ++i) {
+      int32_t Length = Next();
+      if (Length < 0) {
+        Elements.emplace_back();
+        continue;
+      }
+      Elements.emplace_back(Value, Length);
+      Value += Length;
+    }
+    return Elements;
+  }
+  uint32_t getBinary() {
+    assert(getNumTuples() == 1);
+    return getBinary(0);
+  }
+  uint32_t getBinary(int Row) {
+    assert(PQnfields(PGResult) == 1);
+    char *Value = PQgetvalue(PGResult, Row, 0);
+    uint32_t Binary = ntohl(*((uint32_t *) Value));
+    return Binary;
+  }
+  uint64_t getBinary64(int Row, const char *FieldName) {
+    int FieldIndex = PQfnumber(PGResult, FieldName);
+    const uint32_t *Value = (const uint32_t *) PQgetvalue(PGResult, Row, FieldIndex);
+    return (static_cast<uint64_t>(ntohl(Value[0])) << 32) | ntohl(Value[1]);
+  }
+  bool getBool(int Row, const char *FieldName) {
+    int FieldIndex = PQfnumber(PGResult, FieldName);
+    return *PQgetvalue(PGResult, Row, FieldIndex) != 0;
+  }
+};
+
+class CommandResult : public Result {
+public:
+  // A failure is kept as the connection's error
+  CommandResult(Connection &Conn,
+		const char *Q, const Params &P) : Result(Conn, Q, P) {
+    if (Error) {
+      recordError(Conn, PGResult, Q);
+    }
+  }
+
+  CommandResult(const CommandResult &) = delete;
+  CommandResult operator=(const CommandResult &) = delete;
+};
+
+// Rows encoded in the binary COPY format
+class CopyBuffer {
+  std::string Data;
+  size_t NumTuples = 0;
+
+  void addInt16(uint16_t Value) {
+    Value = htons(Value);
+    Data.append((const char *) &Value, sizeof(Value));
+  }
+  void addInt32(uint32_t Value) {
+    Value = htonl(Value);
+    Data.append((const char *) &Value, sizeof(Value));
+  }
+public:
+  CopyBuffer() {
+    Data.append("PGCOPY\n\377\r\n\0", 11);
+    addInt32(0); // Flags
+    addInt32(0); // Header extension length
+  }
+  void addTuple(uint16_t NumFields) {
+    addInt16(NumFields);
+    ++NumTuples;
+  }
+  bool empty() const {
+    return NumTuples == 0;
+  }
+  void addBinary(uint32_t Binary) {
+    addInt32(sizeof(Binary));
+    addInt32(Binary);
+  }
+  void addBinary64(uint64_t Binary) {
+    addInt32(sizeof(Binary));
+    addInt32(Binary >> 32);
+    addInt32(Binary & 0xffffffff);
+  }
+  void addBool(bool B) {
+    addInt32(1);
+    Data.push_back(B ? 1 : 0);
+  }
+  void addText(llvm::StringRef Text) {
+    addInt32(Text.size());
+    Data.append(Text.data(), Text.size());
+  }
+  void addNull() {
+    addInt32(-1);
+  }
+  // Returns the data with its trailer, the buffer can't be added to after
+  std::string finish() {
+    addInt16(-1);
+    return std::move(Data);
+  }
+};
+
+// Runs Q with binary results and hands each row to OnRow as it arrives. Rows
+// come in chunks where libpq supports it, one at a time otherwise, so memory
+// stays bounded however large the result. The connection can't be pipelined.
+// A failure is kept as the connection's error, it's never retried since rows
+// may have been handed out already.
+bool streamRows(Connection &Conn, const char *Q, const Params &P,
+                llvm::function_ref<void(const PGresult *R, int Row)> OnRow);
+
+// Streams the data of a finished CopyBuffer into the table named in the
+// COPY ... FROM STDIN query. Nothing is sent if the connection has an error.
+void copyIn(Connection &Conn, const char *Q, const std::string &Data);
+
+// A query whose result we don't need. In pipeline mode it stays in flight and
+// is only checked at the next sync point, otherwise it runs immediately. A
+// failure is kept as the connection's error.
+class DeferredResult {
+public:
+  DeferredResult(Connection &Conn, const char *Q, const Params &P);
+
+  DeferredResult(const DeferredResult &) = delete;
+  DeferredResult operator=(const DeferredResult &) = delete;
+};
+
+}
+}
+
+#endif
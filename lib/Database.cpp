@@ -1,19 +1,22 @@
 #include "Database.h"
+#include "FNV.h"
 
-#include <sstream>
-#include <unordered_set>
+#include <algorithm>
+#include <memory>
 #include <unordered_map>
 
-#include <libpq-fe.h>
-#include <arpa/inet.h>
-
 #include <clang/AST/CXXInheritance.h>
 #include <clang/AST/DeclCXX.h>
 #include <clang/AST/DeclTemplate.h>
 #include <clang/AST/Mangle.h>
 #include <clang/Tooling/Tooling.h>
 
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/Hashing.h>
 #include <llvm/ADT/StringMap.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
 
 using namespace llvm;
 using namespace clang;
@@ -28,13 +31,63 @@ struct DatabaseImpl {
   DatabaseImpl(const DatabaseImpl &Impl) = delete;
 
   unsigned CompileCommandID;
-  std::string SourceDirectory;
+  CompileCommandInfo Info;
+  // Compile commands fetched before they're run
+  std::unordered_map<unsigned, CompileCommandInfo> PrefetchedInfos;
 
-  PGconn *Connection;
-  uint32_t PackageID;
-  uint32_t RootDeclID;
+  std::unique_ptr<Storage> Store;
+  bool InUnit = false;
 
   StringMap<uint32_t> FDCache;
+  // Presumed location IDs keyed on file ID and line and column packed together
+  DenseMap<std::pair<uint32_t, uint64_t>, uint32_t> PresumedLocCache;
+
+  // Every keyed decl of the package, loaded at startup and extended with the
+  // decls of each unit of work once it's committed
+  DenseMap<uint64_t, KnownDecl> KnownDecls;
+  std::vector<std::pair<uint64_t, KnownDecl>> PendingDecls;
+
+  // Public views, bases, overrides and method dependences are idempotent, each
+  // one is written at most once per process. They're hashed pairs of decl keys,
+  // the facts of the current unit of work are only known to be written once it
+  // commits.
+  DenseSet<uint64_t> WrittenFacts;
+  DenseSet<uint64_t> PendingFacts;
+  uint64_t NumSuppressedWrites = 0;
+
+  // Methods checked by a committed unit of work of this process aren't
+  // analyzed again, ones with a check stored by an earlier run only when
+  // asked to
+  DenseSet<uint64_t> MethodsCheckedByProcess;
+  bool ReuseStoredChecks = false;
+  uint64_t NumSkippedMethods = 0;
+  // Compile commands run again since their files changed, they never reuse
+  // stored checks
+  DenseSet<unsigned> ChangedCompileCommands;
+
+  // Package files read by the current unit of work, keyed on their path
+  StringMap<uint64_t> Inputs;
+  bool HasUnresolvedInputs = false;
+  // Hashes of files on disk keyed on their full path, they're assumed not to
+  // change while the process runs
+  StringMap<uint64_t> FileHashCache;
+
+  bool isNewFact(uint64_t Fact) {
+    if (WrittenFacts.count(Fact) || !PendingFacts.insert(Fact).second) {
+      ++NumSuppressedWrites;
+      return false;
+    }
+    return true;
+  }
+
+  void addKnownDecl(uint64_t Key, KnownDecl Decl) {
+    KnownDecl &Known = KnownDecls[Key];
+    if (Decl.PresumedLocID != 0) {
+      Known.PresumedLocID = Decl.PresumedLocID;
+    }
+    Known.HasKind |= Decl.HasKind;
+    Known.IsChecked |= Decl.IsChecked;
+  }
 };
 
 struct ClangDatabaseImpl {
@@ -71,11 +124,23 @@ struct ClangDatabaseImpl {
   PrintingPolicy PP;
   ItaniumMangleContext *Mangler;
 
-  std::unordered_map<const RecordDecl *, uint32_t> RecordIDCache;
-  std::unordered_map<const NamespaceDecl *, uint32_t> NamespaceIDCache;
-  std::unordered_map<const CXXMethodDecl *, uint32_t> MethodIDCache;
-  std::unordered_map<const FieldDecl *, uint32_t> FieldIDCache;
-  std::unordered_map<const FunctionDecl *, uint32_t> FunctionIDCache;
+  // File descriptor IDs keyed on the filename of a presumed location
+  StringMap<uint32_t> FileIDCache;
+
+  // Keys of records (with a definition), namespaces, fields, methods and
+  // functions we've already staged or found in the decl index
+  DenseMap<const Decl *, uint64_t> KeyCache;
+
+  // Decls and result rows buffered until they're shipped, at the end of the
+  // translation unit or in batches to the writer. They're keyed by decl key so
+  // only the last row for a decl in a batch is written.
+  std::unordered_map<uint64_t, StagedDecl> StagedDecls;
+  std::unordered_map<uint64_t, MethodResultTuple> MethodChecks;
+  std::unordered_map<uint64_t, std::pair<bool, bool>> FieldChecks;
+  std::vector<std::pair<uint64_t, uint64_t>> PublicViews;
+  std::vector<std::pair<uint64_t, uint64_t>> PublicBases;
+  std::vector<std::pair<uint64_t, uint64_t>> PublicOverrides;
+  std::vector<std::pair<uint64_t, uint64_t>> MethodDependences;
 };
 
 }
@@ -83,206 +148,147 @@ struct ClangDatabaseImpl {
 
 namespace {
 
-class Params {
-  std::vector<const char *> Values;
-  std::list<uint32_t> BinaryValues; // Required for stable iterators
-  std::vector<int> Lengths;
-  std::vector<int> Formats;
-public:
-  void addText(const char *Text) {
-    Values.push_back(Text);
-    Lengths.push_back(0); // Ignored for text, used for binary
-    Formats.push_back(0); // 0 is text, 1 is binary
-  }
-  void addBinary(uint32_t Binary) {
-    BinaryValues.push_back(htonl(Binary));
-    auto &BinaryValue = BinaryValues.back();
-    const char *Value = (const char *) &BinaryValue;
-
-    Values.push_back(Value);
-    Lengths.push_back(sizeof(BinaryValue));
-    Formats.push_back(1); // 1 is binary
-  }
-  void addBool(bool B) {
-    if (B)
-      addText("true");
-    else
-      addText("false");
-  }
-  void clear() {
-    Values.clear();
-    BinaryValues.clear();
-    Lengths.clear();
-    Formats.clear();
-  }
-
-  const char * const * getValues() const {
-    return Values.data();
-  }
-  const int * getLengths() const {
-    return Lengths.data();
-  }
-  const int * getFormats() const {
-    return Formats.data();
-  }
-  int getN() const {
-    assert(Values.size() == Lengths.size());
-    assert(Values.size() == Formats.size());
-    return Values.size();
-  }
-
-  void dump() const {
-    auto iBinary = BinaryValues.begin();
-    for (size_t i = 0; i < getN(); ++i) {
-      llvm::errs() << "    ." << i << " = ";
-      if (Formats[i] == 0) {
-        llvm::errs() << Values[i];
-      }
-      else {
-        llvm::errs() << ntohl(*iBinary);
-        ++iBinary;
-      }
-      llvm::errs() << '\n';
-    }
-  }
-};
-
-class Result {
-protected:
-  PGresult *PGResult;
-public:
-  Result(std::unique_ptr<DatabaseImpl> &Impl,
-         const char *Q, const Params &P) : PGResult(nullptr) {
-    PGResult = PQexecParams(Impl->Connection, Q, P.getN(), nullptr,
-                            P.getValues(), P.getLengths(), P.getFormats(), 1);
-    assert(PGResult != nullptr);
-  }
-  ~Result() {
-    PQclear(PGResult);
-  }
-
-  Result(const Result &) = delete;
-  Result operator=(const Result &) = delete;
-};
-
-class TupleResult : public Result {
-public:
-  TupleResult(std::unique_ptr<DatabaseImpl> &Impl,
-              const char *Q, const Params &P) : Result(Impl, Q, P) {
-    auto Status = PQresultStatus(PGResult);
-    if (Status != PGRES_TUPLES_OK) {
-      errs() << "TupleResult: " << PQresultErrorMessage(PGResult);
-      errs() << "Query: " << Q << '\n';
-      P.dump();
-    }
-    assert(Status == PGRES_TUPLES_OK && "TupleResult failed");
-  }
-
-  TupleResult(const TupleResult &) = delete;
-  TupleResult operator=(const TupleResult &) = delete;
-
-  int getNumTuples() {
-    return PQntuples(PGResult);
-  }
-  uint32_t getID() {
-    assert(getNumTuples() == 1);
-    int FieldIndex = PQfnumber(PGResult, "id");
-    char *Value = PQgetvalue(PGResult, 0, FieldIndex);
-    uint32_t ID = ntohl(*((uint32_t *) Value));
-    return ID;
-  }
-  uint32_t getID(const char *FieldName) {
-    assert(getNumTuples() == 1);
-    int FieldIndex = PQfnumber(PGResult, FieldName);
-    char *Value = PQgetvalue(PGResult, 0, FieldIndex);
-    uint32_t ID = ntohl(*((uint32_t *) Value));
-    return ID;
-  }
-  const char *getValue(const char *FieldName) {
-    assert(getNumTuples() == 1);
-    int FieldIndex = PQfnumber(PGResult, FieldName);
-    char *Value = PQgetvalue(PGResult, 0, FieldIndex);
-    return Value;
-  }
-  uint32_t getBinary() {
-    assert(getNumTuples() == 1);
-    assert(PQnfields(PGResult) == 1);
-    char *Value = PQgetvalue(PGResult, 0, 0);
-    uint32_t Binary = ntohl(*((uint32_t *) Value));
-    return Binary;
-  }
-};
-
-class CommandResult : public Result {
-public:
-  CommandResult(std::unique_ptr<DatabaseImpl> &Impl,
-		const char *Q, const Params &P) : Result(Impl, Q, P) {
-    if (PQresultStatus(PGResult) != PGRES_COMMAND_OK) {
-      errs() << "CommandResult: " << PQresultErrorMessage(PGResult);
-    }
-    assert(PQresultStatus(PGResult) == PGRES_COMMAND_OK);
+// The directory and every argument, a compile command whose flags changed
+// has to run again even if its files didn't
+uint64_t hashCommandLine(const CompileCommandInfo &Info) {
+  std::string CommandLine = Info.Directory;
+  for (const std::string &Argument : Info.CommandLine) {
+    CommandLine += '\0';
+    CommandLine += Argument;
   }
-
-  CommandResult(const CommandResult &) = delete;
-  CommandResult operator=(const CommandResult &) = delete;
-};
+  return hashFNV(CommandLine);
+}
 
 }
 
 namespace clang {
 namespace immutability {
 
-Database::Database(unsigned CompileCommandID) {
+Database::Database(unsigned CompileCommandID, std::unique_ptr<Storage> Store) {
   Impl = llvm::make_unique<DatabaseImpl>();
 
   Impl->CompileCommandID = CompileCommandID;
+  Impl->Store = std::move(Store);
+  Impl->Info = Impl->Store->getCompileCommandInfo(CompileCommandID);
+  Impl->Store->setCompileCommand(CompileCommandID, getPackageID());
+  loadPackage();
+}
 
-  Impl->Connection = PQconnectdb("dbname = cpp_doc");
-  assert(PQstatus(Impl->Connection) == CONNECTION_OK);
-
-  Params P;
+void Database::loadPackage() {
+  // Preload the whole file descriptor tree of the package
+  Impl->FDCache.clear();
+  Impl->FDCache[""] = Impl->Info.RootFileDescriptorID;
+  Impl->Store->getFileDescriptors(getPackageID(), Impl->FDCache);
 
-  P.addBinary(CompileCommandID);
-  TupleResult CompileCommandSelect(Impl, "SELECT * FROM cpp_doc_compile_command WHERE id = $1", P);
-  Impl->PackageID = CompileCommandSelect.getID("package_id");
+  // Decls that are already merged don't need to be staged again
+  Impl->KnownDecls.clear();
+  Impl->Store->getDeclIndex(getPackageID(), Impl->KnownDecls);
+}
 
-  P.clear();
-  P.addBinary(Impl->PackageID);
-  TupleResult PackageSelect(Impl, "SELECT * FROM cpp_doc_package WHERE id = $1", P);
-  uint32_t PackageNameID = PackageSelect.getID("package_name_id");
+const CompileCommandInfo &
+Database::prefetchCompileCommand(unsigned CompileCommandID) {
+  if (CompileCommandID == Impl->CompileCommandID) {
+    return Impl->Info;
+  }
+  auto It = Impl->PrefetchedInfos.find(CompileCommandID);
+  if (It != Impl->PrefetchedInfos.end()) {
+    return It->second;
+  }
+  CompileCommandInfo &Info = Impl->PrefetchedInfos[CompileCommandID];
+  Info = Impl->Store->getCompileCommandInfo(CompileCommandID);
+  return Info;
+}
 
-  P.clear();
-  P.addBinary(PackageNameID);
-  TupleResult PackageNameSelect(Impl, "SELECT * FROM cpp_doc_package_name WHERE id = $1", P);
+void Database::setCompileCommand(unsigned CompileCommandID) {
+  assert(!Impl->InUnit && "Can't switch compile commands in a unit of work");
+  if (CompileCommandID == Impl->CompileCommandID) {
+    return;
+  }
+  uint32_t PreviousPackageID = getPackageID();
+  prefetchCompileCommand(CompileCommandID);
+  auto It = Impl->PrefetchedInfos.find(CompileCommandID);
+  Impl->CompileCommandID = CompileCommandID;
+  Impl->Info = std::move(It->second);
+  Impl->PrefetchedInfos.erase(It);
+  Impl->Store->setCompileCommand(CompileCommandID, getPackageID());
+  // Presumed locations and written facts are keyed on IDs and decl keys that
+  // are unique across packages, they're kept
+  if (getPackageID() != PreviousPackageID) {
+    loadPackage();
+  }
+}
 
-  const char *BaseDir = ::getenv("CONST_CHECKER_BASE_DIR");
-  assert(BaseDir != nullptr);
+Database::~Database() {
+  if (Impl->InUnit) {
+    rollbackUnit();
+  }
+  // Whatever the storage still holds is written before it goes
+  Impl->Store.reset();
+}
 
-  std::stringstream ss;
-  ss << BaseDir;
-  ss << '/';
-  ss << PackageNameSelect.getValue("slug");
-  ss << '/';
-  ss << PackageSelect.getValue("version");
-  ss << "/src/";
-  Impl->SourceDirectory = ss.str();
+void Database::beginUnit() {
+  assert(!Impl->InUnit && "Unit of work already started");
+  Impl->Store->beginUnit();
+  Impl->InUnit = true;
+}
 
-  P.clear();
-  P.addBinary(Impl->PackageID);
-  TupleResult RootDeclSelect(Impl, "SELECT get_root_decl($1)", P);
-  Impl->RootDeclID = RootDeclSelect.getBinary();
+void Database::commitUnit() {
+  assert(Impl->InUnit && "No unit of work to commit");
+  // Without every file it read the compile command always runs again
+  std::vector<InputFile> Inputs;
+  if (!Impl->HasUnresolvedInputs) {
+    InputFile CommandLine;
+    CommandLine.Hash = hashCommandLine(Impl->Info);
+    Inputs.push_back(std::move(CommandLine));
+    for (auto &Entry : Impl->Inputs) {
+      InputFile Input;
+      Input.Path = Entry.getKey().str();
+      Input.Hash = Entry.getValue();
+      Inputs.push_back(std::move(Input));
+    }
+  }
+  Impl->Inputs.clear();
+  Impl->HasUnresolvedInputs = false;
+  Impl->Store->setCompileCommandInputs(std::move(Inputs));
+  Impl->Store->commitUnit();
+  Impl->InUnit = false;
+  // Nothing of a dropped transaction was stored, so the unit's decls and
+  // facts are still unwritten
+  if (!sync()) {
+    Impl->PendingDecls.clear();
+    Impl->PendingFacts.clear();
+    return;
+  }
+  for (auto &Pending : Impl->PendingDecls) {
+    Impl->addKnownDecl(Pending.first, Pending.second);
+    if (Pending.second.IsChecked) {
+      Impl->MethodsCheckedByProcess.insert(Pending.first);
+    }
+  }
+  Impl->PendingDecls.clear();
+  for (uint64_t Fact : Impl->PendingFacts) {
+    Impl->WrittenFacts.insert(Fact);
+  }
+  Impl->PendingFacts.clear();
+}
 
-  TupleResult RootFileDescriptorSelect(Impl, "SELECT get_root_file_descriptor($1)", P);
-  uint32_t RootFileDescriptorID = RootFileDescriptorSelect.getBinary();
-  Impl->FDCache[""] = RootFileDescriptorID;
+void Database::rollbackUnit() {
+  assert(Impl->InUnit && "No unit of work to roll back");
+  Impl->Store->rollbackUnit();
+  Impl->InUnit = false;
+  Impl->PendingDecls.clear();
+  Impl->PendingFacts.clear();
+  Impl->Inputs.clear();
+  Impl->HasUnresolvedInputs = false;
+  sync();
 }
 
-Database::~Database() {
-  PQfinish(Impl->Connection);
+bool Database::sync() {
+  return Impl->Store->sync();
 }
 
 std::string Database::getSourceDirectory() const {
-  return Impl->SourceDirectory;
+  return Impl->Info.SourceDirectory;
 }
 
 uint32_t Database::getCompileCommandID() const {
@@ -290,23 +296,52 @@ uint32_t Database::getCompileCommandID() const {
 }
 
 uint32_t Database::getPackageID() const {
-  return Impl->PackageID;
+  return Impl->Info.PackageID;
 }
 
 uint32_t Database::getRootDeclID() const {
-  return Impl->RootDeclID;
+  return Impl->Info.RootDeclID;
 }
-  
+
+uint64_t Database::getNumSuppressedWrites() const {
+  return Impl->NumSuppressedWrites;
+}
+
+void Database::printStatistics(raw_ostream &OS) const {
+  Impl->Store->printStatistics(OS);
+  OS << "Duplicate writes suppressed: " << Impl->NumSuppressedWrites << '\n';
+  OS << "Methods already checked: " << Impl->NumSkippedMethods << '\n';
+}
+
+void Database::setReuseStoredChecks(bool Reuse) {
+  Impl->ReuseStoredChecks = Reuse;
+}
+
 uint32_t Database::getFileDescriptorID(StringRef FullPath) {
-  std::string AbsolutePath = getAbsolutePath(FullPath);
+  std::string Path;
+  if (!getPackagePath(FullPath, Path)) {
+    llvm_unreachable("Call to realpath failed");
+  }
+  if (Path.empty()) {
+    return 0;
+  }
+  return getFileDescriptorIDFromPath(Path);
+}
+
+bool Database::getPackagePath(StringRef FullPath, std::string &Path) {
+  // Relative to the compile command, the process may be running others in
+  // different directories at the same time
+  SmallString<256> AbsolutePath(FullPath);
+  sys::fs::make_absolute(Impl->Info.Directory, AbsolutePath);
   char RealPath[PATH_MAX];
   if (realpath(AbsolutePath.c_str(), RealPath) == nullptr) {
-    llvm_unreachable("Call to realpath failed");
+    return false;
   }
   StringRef ResolvedPath(RealPath);
 
+  Path.clear();
   if (!ResolvedPath.startswith(getSourceDirectory())) {
-    return 0;
+    return true;
   }
 
   if (ResolvedPath.contains("..")) {
@@ -314,99 +349,227 @@ uint32_t Database::getFileDescriptorID(StringRef FullPath) {
     llvm_unreachable("Resolved path still contains '..'");
   }
 
-  StringRef Path = ResolvedPath.substr(getSourceDirectory().size());
+  Path = ResolvedPath.substr(getSourceDirectory().size()).str();
+  return true;
+}
 
-  return getFileDescriptorIDFromPath(Path);
+bool Database::hasUnchangedInputs(unsigned CompileCommandID,
+                                  std::string &Reason) {
+  const CompileCommandInfo &Info = prefetchCompileCommand(CompileCommandID);
+  std::vector<InputFile> Inputs =
+    Impl->Store->getCompileCommandInputs(CompileCommandID, Info.PackageID);
+  if (Inputs.empty()) {
+    Reason = "its files were never recorded";
+  }
+  for (InputFile &Input : Inputs) {
+    if (!Reason.empty()) {
+      break;
+    }
+    if (Input.Path.empty()) {
+      if (Input.Hash != hashCommandLine(Info)) {
+        Reason = "its command line changed";
+      }
+      continue;
+    }
+    std::string FullPath = Info.SourceDirectory + Input.Path;
+    auto Cached = Impl->FileHashCache.find(FullPath);
+    if (Cached == Impl->FileHashCache.end()) {
+      auto Buffer = MemoryBuffer::getFile(FullPath, /*FileSize=*/ -1,
+                                          /*RequiresNullTerminator=*/ false);
+      if (!Buffer) {
+        Reason = Input.Path + " is gone";
+        continue;
+      }
+      Cached = Impl->FileHashCache.insert(
+        std::make_pair(FullPath, hashFNV((*Buffer)->getBuffer()))).first;
+    }
+    if (Cached->getValue() != Input.Hash) {
+      Reason = Input.Path + " changed";
+    }
+  }
+  // Recorded before command lines were
+  bool HasCommandLine =
+    std::any_of(Inputs.begin(), Inputs.end(),
+                [](const InputFile &Input) { return Input.Path.empty(); });
+  if (Reason.empty() && !HasCommandLine) {
+    Reason = "its command line was never recorded";
+  }
+  // Checks stored by earlier runs can't be trusted for any of these
+  if (!Reason.empty()) {
+    Impl->ChangedCompileCommands.insert(CompileCommandID);
+    return false;
+  }
+  // It won't run, unless it's the current one
+  Impl->PrefetchedInfos.erase(CompileCommandID);
+  return true;
 }
 
 uint32_t Database::getFileDescriptorIDFromPath(StringRef Path) {
-  if (Impl->FDCache.count(Path)) {
-    return Impl->FDCache[Path];
+  auto It = Impl->FDCache.find(Path);
+  if (It != Impl->FDCache.end()) {
+    return It->getValue();
+  }
+
+  // Walk up to the closest ancestor we know about, every path in between
+  // gets created at once
+  SmallVector<StringRef, 8> Missing;
+  StringRef Parent = Path;
+  do {
+    Missing.push_back(Parent);
+    auto Index = Parent.rfind('/');
+    if (Index != StringRef::npos) {
+      Parent = Parent.substr(0, Index);
+    }
+    else {
+      Parent = "";
+    }
+  } while (!Impl->FDCache.count(Parent));
+  std::reverse(Missing.begin(), Missing.end());
+
+  std::vector<std::string> Names;
+  for (StringRef MissingPath : Missing) {
+    auto Index = MissingPath.rfind('/');
+    if (Index != StringRef::npos) {
+      Names.push_back(MissingPath.substr(Index + 1).str());
+    }
+    else {
+      Names.push_back(MissingPath.str());
+    }
   }
 
-  std::string Name;
-  auto Index = Path.rfind('/');
-  uint32_t ParentID;
-  if (Index != StringRef::npos) {
-    Name = Path.substr(Index + 1).str();
-    ParentID = getFileDescriptorIDFromPath(Path.substr(0, Index));
+  std::vector<uint32_t> IDs =
+    Impl->Store->createFileDescriptors(getPackageID(), Impl->FDCache[Parent],
+                                       Parent, Names);
+  assert(IDs.size() == Missing.size());
+  for (size_t i = 0; i < Missing.size(); ++i) {
+    Impl->FDCache[Missing[i]] = IDs[i];
   }
-  else {
-    Name = Path.str();
-    ParentID = getFileDescriptorIDFromPath("");
-  }
-
-  Params P;
-  P.addBinary(getPackageID());
-  P.addBinary(ParentID);
-  P.addText(Name.c_str());
-  auto S = Path.str();
-  P.addText(S.c_str());
+  return Impl->FDCache[Path];
+}
 
-  TupleResult FileDescriptorSelect(Impl, "SELECT get_file_descriptor($1, $2, $3, $4)", P);
-  uint32_t FileDescriptorID = FileDescriptorSelect.getBinary();
-  Impl->FDCache[Path] = FileDescriptorID;
-  return FileDescriptorID;
+const CompileCommandInfo &Database::getCompileCommandInfo() const {
+  return Impl->Info;
 }
 
 std::string Database::getSource() {
-  Params P;
-  P.addBinary(getCompileCommandID());
-  TupleResult CompileCommandSelect(Impl, "SELECT * FROM cpp_doc_compile_command WHERE id = $1", P);
-  uint32_t FileID = CompileCommandSelect.getID("file_id");
-  uint32_t PackageID = CompileCommandSelect.getID("package_id");
+  return Impl->Info.Source;
+}
 
-  P.clear();
-  P.addBinary(FileID);
-  TupleResult FileSelect(Impl, "SELECT * FROM cpp_doc_file_descriptor WHERE id = $1", P);
+std::string Database::getDirectory() {
+  return Impl->Info.Directory;
+}
 
-  std::stringstream ss;
-  ss << getSourceDirectory() << FileSelect.getValue("path");
-  return ss.str();
+std::vector<std::string> Database::getCommands() {
+  return Impl->Info.CommandLine;
 }
 
-std::string Database::getDirectory() {
-  Params P;
+ClangDatabase::ClangDatabase(Database &DB,
+			     ASTContext &Ctx,
+			     SourceManager &SM)
+  : Impl(new ClangDatabaseImpl(DB, Ctx, SM)) {
+}
 
-  P.addBinary(getCompileCommandID());
-  TupleResult CompileCommandSelect(Impl, "SELECT * FROM cpp_doc_compile_command WHERE id = $1", P);
-  uint32_t DirectoryID = CompileCommandSelect.getID("directory_id");
-  uint32_t PackageID = CompileCommandSelect.getID("package_id");
+ClangDatabase::~ClangDatabase() = default;
 
-  P.clear();
-  P.addBinary(DirectoryID);
-  TupleResult DirectorySelect(Impl, "SELECT * FROM cpp_doc_file_descriptor WHERE id = $1", P);
+namespace {
 
-  std::stringstream ss;
-  ss << getSourceDirectory() << DirectorySelect.getValue("path");
-  return ss.str();
+// The root decl of every package has key 0, computed keys are never 0
+uint64_t computeDeclKey(uint32_t PackageID, StringRef Path) {
+  FNVHash Hash;
+  for (unsigned i = 0; i < sizeof(PackageID); ++i) {
+    Hash.add((PackageID >> (i * 8)) & 0xff);
+  }
+  Hash.add(Path);
+  return Hash.get() == 0 ? 1 : Hash.get();
 }
 
-std::vector<std::string> Database::getCommands() {
-  Params P;
+enum class FactKind {
+  PublicView,
+  PublicBase,
+  PublicOverride,
+  MethodDependence,
+};
+
+uint64_t getFactHash(FactKind Kind, uint64_t First, uint64_t Second) {
+  uint64_t Hash = hash_combine(static_cast<unsigned>(Kind), First, Second);
+  // Keeps clear of the empty and tombstone keys of DenseSet
+  return Hash >> 1;
+}
 
-  P.addBinary(getCompileCommandID());
-  TupleResult CompileCommandSelect(Impl, "SELECT * FROM cpp_doc_compile_command WHERE id = $1", P);
-  TupleResult CommandLineUpperSelect(Impl, "SELECT array_upper(command_line, 1) FROM cpp_doc_compile_command WHERE id = $1", P);
+uint64_t getLineColumn(PresumedLoc PLoc) {
+  return (static_cast<uint64_t>(PLoc.getLine()) << 32) | PLoc.getColumn();
+}
 
-  std::vector<std::string> Commands;
-  unsigned Upper = CommandLineUpperSelect.getBinary();
-  for (unsigned i = 1; i <= Upper; ++i) {
-    std::stringstream ss;
-    ss << "SELECT command_line[" << i << "] FROM cpp_doc_compile_command WHERE id = $1";
-    TupleResult ArgSelect(Impl, ss.str().c_str(), P);
-    Commands.push_back(ArgSelect.getValue("command_line"));
+uint32_t getDeclDepth(const Decl *D) {
+  uint32_t Depth = 1;
+  for (const DeclContext *DC = D->getDeclContext();
+       !isa<TranslationUnitDecl>(DC); DC = DC->getParent()) {
+    if (!isa<LinkageSpecDecl>(DC)) {
+      ++Depth;
+    }
   }
-  return Commands;
+  return Depth;
 }
 
-ClangDatabase::ClangDatabase(Database &DB,
-			     ASTContext &Ctx,
-			     SourceManager &SM)
-  : Impl(new ClangDatabaseImpl(DB, Ctx, SM)) {
+// Buffered rows are handed to the storage in batches of about this many
+constexpr size_t ShipBatchSize = 4096;
+
 }
 
-ClangDatabase::~ClangDatabase() = default;
+void ClangDatabase::ship() {
+  auto &DBImpl = getDatabaseImpl();
+
+  FactBatch Batch;
+  Batch.Decls.reserve(Impl->StagedDecls.size());
+  for (auto &Entry : Impl->StagedDecls) {
+    StagedDecl &Staged = Entry.second;
+    KnownDecl Pending;
+    Pending.PresumedLocID = Staged.PresumedLocID;
+    Pending.HasKind = Staged.Kind != DeclKind::Other;
+    DBImpl->PendingDecls.emplace_back(Staged.Key, Pending);
+    Batch.Decls.push_back(std::move(Staged));
+  }
+  Impl->StagedDecls.clear();
+
+  // Later units of work skip these methods once they're committed
+  for (auto &Check : Impl->MethodChecks) {
+    KnownDecl Checked;
+    Checked.IsChecked = true;
+    DBImpl->PendingDecls.emplace_back(Check.first, Checked);
+  }
+  Batch.MethodChecks.assign(Impl->MethodChecks.begin(),
+                            Impl->MethodChecks.end());
+  Impl->MethodChecks.clear();
+  for (auto &Check : Impl->FieldChecks) {
+    Batch.FieldChecks.emplace_back(Check.first, Check.second.first,
+                                   Check.second.second);
+  }
+  Impl->FieldChecks.clear();
+  Batch.PublicViews.swap(Impl->PublicViews);
+  Batch.PublicBases.swap(Impl->PublicBases);
+  Batch.PublicOverrides.swap(Impl->PublicOverrides);
+  Batch.MethodDependences.swap(Impl->MethodDependences);
+
+  DBImpl->Store->write(Impl->DB.getPackageID(), Batch);
+}
+
+void ClangDatabase::shipIfFull() {
+  if (!getDatabaseImpl()->Store->wantsBatches()) {
+    return;
+  }
+  size_t NumRows = Impl->StagedDecls.size() + Impl->MethodChecks.size()
+    + Impl->FieldChecks.size() + Impl->PublicViews.size()
+    + Impl->PublicBases.size() + Impl->PublicOverrides.size()
+    + Impl->MethodDependences.size();
+  if (NumRows >= ShipBatchSize) {
+    ship();
+  }
+}
+
+void ClangDatabase::flush() {
+  ship();
+  getDatabaseImpl()->Store->merge(Impl->DB.getPackageID());
+}
 
 std::string ClangDatabase::getMangledName(const CXXMethodDecl *D) {
   std::string Str;
@@ -479,159 +642,186 @@ uint32_t ClangDatabase::getPresumedLocIDPLoc(PresumedLoc PLoc) {
     return 0;
   }
 
-  uint32_t FileID = Impl->DB.getFileDescriptorID(PLoc.getFilename());
+  uint32_t FileID = getFileID(PLoc);
   if (FileID == 0) {
     return 0;
   }
 
-  Params P;
-  P.addBinary(FileID);
-  P.addBinary(PLoc.getLine());
-  P.addBinary(PLoc.getColumn());
+  auto Key = std::make_pair(FileID, getLineColumn(PLoc));
+  auto &Cache = getDatabaseImpl()->PresumedLocCache;
+  auto It = Cache.find(Key);
+  if (It != Cache.end()) {
+    return It->second;
+  }
 
-  TupleResult PresumedLocSelect(getDatabaseImpl(), "SELECT get_presumed_loc($1, $2, $3)", P);
-  return PresumedLocSelect.getBinary();
+  uint32_t Line = PLoc.getLine();
+  uint32_t Column = PLoc.getColumn();
+  uint32_t PresumedLocID =
+    getDatabaseImpl()->Store->getPresumedLocs(FileID, Line, Column)[0];
+  Cache[Key] = PresumedLocID;
+  return PresumedLocID;
 }
 
-uint32_t ClangDatabase::getDeclID(const Decl *D) {
-  if (isa<TranslationUnitDecl>(D)) {
-    return Impl->DB.getRootDeclID();
+uint32_t ClangDatabase::getFileID(PresumedLoc PLoc) {
+  auto Inserted = Impl->FileIDCache.insert(std::make_pair(PLoc.getFilename(), 0));
+  if (Inserted.second) {
+    Inserted.first->second = Impl->DB.getFileDescriptorID(PLoc.getFilename());
   }
+  return Inserted.first->second;
+}
 
-  if (auto RD = dyn_cast<RecordDecl>(D)) {
-    if (Impl->RecordIDCache.count(RD)) {
-      return Impl->RecordIDCache[RD];
+void ClangDatabase::resolvePresumedLocs(ArrayRef<const Decl *> Decls) {
+  auto &Cache = getDatabaseImpl()->PresumedLocCache;
+  DenseSet<std::pair<uint32_t, uint64_t>> Requested;
+  std::vector<uint32_t> FileIDs;
+  std::vector<uint32_t> Lines;
+  std::vector<uint32_t> Columns;
+
+  for (const Decl *D : Decls) {
+    PresumedLoc PLoc = Impl->SM.getPresumedLoc(D->getLocation());
+    if (!PLoc.isValid()) {
+      continue;
     }
-  }
-  else if (auto NSD = dyn_cast<NamespaceDecl>(D)) {
-    if (Impl->NamespaceIDCache.count(NSD)) {
-      return Impl->NamespaceIDCache[NSD];
+    uint32_t FileID = getFileID(PLoc);
+    if (FileID == 0) {
+      continue;
     }
-  }
-  else if (auto MD = dyn_cast<CXXMethodDecl>(D)) {
-    if (Impl->MethodIDCache.count(MD)) {
-      return Impl->MethodIDCache[MD];
+    auto Key = std::make_pair(FileID, getLineColumn(PLoc));
+    if (Cache.count(Key) || !Requested.insert(Key).second) {
+      continue;
     }
+    FileIDs.push_back(FileID);
+    Lines.push_back(PLoc.getLine());
+    Columns.push_back(PLoc.getColumn());
   }
-  // Note: Method is a subclass of Function, so it needs to come after Method
-  else if (auto FD = dyn_cast<FunctionDecl>(D)) {
-    if (Impl->FunctionIDCache.count(FD)) {
-      return Impl->FunctionIDCache[FD];
-    }
+
+  if (FileIDs.empty()) {
+    return;
+  }
+
+  std::vector<uint32_t> IDs =
+    getDatabaseImpl()->Store->getPresumedLocs(FileIDs, Lines, Columns);
+  for (size_t i = 0; i < IDs.size(); ++i) {
+    uint64_t LineColumn = (static_cast<uint64_t>(Lines[i]) << 32) | Columns[i];
+    Cache[std::make_pair(FileIDs[i], LineColumn)] = IDs[i];
+  }
+}
+
+uint64_t ClangDatabase::getDeclKey(const Decl *D) {
+  if (isa<TranslationUnitDecl>(D)) {
+    return 0;
+  }
+
+  auto It = Impl->KeyCache.find(D);
+  if (It != Impl->KeyCache.end()) {
+    return It->second;
   }
 
   const DeclContext *DC = D->getDeclContext();
 
   if (isa<LinkageSpecDecl>(D)) {
     // If this is a linkage spec, ignore it by using the containing decl context
-    return getDeclID(cast<Decl>(DC));
+    return getDeclKey(cast<Decl>(DC));
   }
 
-  uint32_t ParentID = getDeclID(cast<Decl>(DC));
-  std::string Name;
-  std::string Path;
+  StagedDecl Staged;
+  Staged.ParentKey = getDeclKey(cast<Decl>(DC));
+  Staged.Depth = getDeclDepth(D);
 
   if (auto FD = dyn_cast<FunctionDecl>(D)) {
-    Name = getSignature(FD->getCanonicalDecl(), false);
-    Path = getSignature(FD->getCanonicalDecl(), true);
+    Staged.Name = getSignature(FD->getCanonicalDecl(), false);
+    Staged.Path = getSignature(FD->getCanonicalDecl(), true);
   }
   else {
-    Name = cast<NamedDecl>(D)->getNameAsString();
-    Path = cast<NamedDecl>(D)->getQualifiedNameAsString();
+    Staged.Name = cast<NamedDecl>(D)->getNameAsString();
+    Staged.Path = cast<NamedDecl>(D)->getQualifiedNameAsString();
   }
 
-  uint32_t DeclID;
+  uint64_t DeclKey = computeDeclKey(Impl->DB.getPackageID(), Staged.Path);
+  Staged.Key = DeclKey;
 
-  Params P;
-  P.addBinary(Impl->DB.getPackageID());
-  P.addBinary(ParentID);
-  P.addText(Name.c_str());
-  P.addText(Path.c_str());
   if (auto MD = dyn_cast<CXXMethodDecl>(D)) {
-    uint32_t PresumedLocID = 0;
     if (MD->isDefined()) {
       // It can be pure and defined if it's a comment
       // assert (!MD->isPure() && "This should never happen");
       MD = cast<CXXMethodDecl>(MD->getDefinition());
-      PresumedLocID = getPresumedLocID(MD);
+      Staged.PresumedLocID = getPresumedLocID(MD);
     }
     else if (MD->isPure()) {
       assert (!MD->isDefined() && "This should never happen");
-      PresumedLocID = getPresumedLocID(MD);
-    }
-
-    if (PresumedLocID != 0) {
-      P.addBinary(PresumedLocID);
-      TupleResult Select(getDatabaseImpl(), "SELECT get_decl($1, $2, $3, $4, $5)", P);
-      DeclID = Select.getBinary();
-    }
-    else {
-      TupleResult Select(getDatabaseImpl(), "SELECT get_decl($1, $2, $3, $4)", P);
-      DeclID = Select.getBinary();
+      Staged.PresumedLocID = getPresumedLocID(MD);
     }
   }
   else if (auto FD = dyn_cast<FieldDecl>(D)) {
-    uint32_t PresumedLocID = 0;
-    PresumedLocID = getPresumedLocID(FD);
-    if (PresumedLocID != 0) {
-      P.addBinary(PresumedLocID);
-      TupleResult Select(getDatabaseImpl(), "SELECT get_decl($1, $2, $3, $4, $5)", P);
-      DeclID = Select.getBinary();
-    }
-    else {
-      TupleResult Select(getDatabaseImpl(), "SELECT get_decl($1, $2, $3, $4)", P);
-      DeclID = Select.getBinary();
-    }
-  }
-  else {
-    TupleResult Select(getDatabaseImpl(), "SELECT get_decl($1, $2, $3, $4)", P);
-    DeclID = Select.getBinary();
+    Staged.PresumedLocID = getPresumedLocID(FD);
   }
 
-  P.clear();
-  P.addBinary(DeclID);
   if (auto RD = dyn_cast<RecordDecl>(D)) {
     if (auto CRD = dyn_cast<CXXRecordDecl>(RD)) {
       CRD = CRD->getCanonicalDecl();
 
       if (!CRD->hasDefinition()) {
-        return DeclID;
+        stageDecl(std::move(Staged));
+        return DeclKey;
       }
 
-      P.addBool(CRD->isAbstract());
-      P.addBool(CRD->hasAnyDependentBases());
-      TupleResult Select(getDatabaseImpl(), "SELECT get_record_decl($1, $2, $3)", P);
+      Staged.Kind = DeclKind::Record;
+      Staged.IsAbstract = CRD->isAbstract();
+      Staged.IsDependent = CRD->hasAnyDependentBases();
       // Only cache the record if it has a defintion, otherwise we'll miss
       // information
-      Impl->RecordIDCache[RD] = DeclID;
+      Impl->KeyCache[D] = DeclKey;
     }
   }
-  else if (auto NSD = dyn_cast<NamespaceDecl>(D)) {
-    TupleResult Select(getDatabaseImpl(), "SELECT get_namespace_decl($1)", P);
-    Impl->NamespaceIDCache[NSD] = DeclID;
+  else if (isa<NamespaceDecl>(D)) {
+    Staged.Kind = DeclKind::Namespace;
+    Impl->KeyCache[D] = DeclKey;
   }
   else if (auto FD = dyn_cast<FieldDecl>(D)) {
-    P.addBool(FD->isMutable());
-    P.addBinary(FD->getAccess());
-    TupleResult Select(getDatabaseImpl(), "SELECT get_field_decl($1, $2, $3)", P);
-    Impl->FieldIDCache[FD] = DeclID;
+    Staged.Kind = DeclKind::Field;
+    Staged.IsMutable = FD->isMutable();
+    Staged.Access = FD->getAccess();
+    Impl->KeyCache[D] = DeclKey;
   }
   else if (auto MD = dyn_cast<CXXMethodDecl>(D)) {
-    std::string MangledName = getMangledName(MD);
-    P.addText(MangledName.c_str());
-    P.addBool(MD->isConst());
-    P.addBool(MD->isPure());
-    P.addBinary(MD->getAccess());
-    TupleResult Select(getDatabaseImpl(), "SELECT get_method_decl($1, $2, $3, $4, $5)", P);
-    Impl->MethodIDCache[MD] = DeclID;
+    Staged.Kind = DeclKind::Method;
+    Staged.MangledName = getMangledName(MD);
+    Staged.IsConst = MD->isConst();
+    Staged.IsPure = MD->isPure();
+    Staged.Access = MD->getAccess();
+    Impl->KeyCache[D] = DeclKey;
   }
   // Note: Method is a subclass of Function, so it needs to come after Method
-  else if (auto FD = dyn_cast<FunctionDecl>(D)) {
-    TupleResult Select(getDatabaseImpl(), "SELECT get_function_decl($1)", P);
-    Impl->FunctionIDCache[FD] = DeclID;
+  else if (isa<FunctionDecl>(D)) {
+    Staged.Kind = DeclKind::Function;
+    Impl->KeyCache[D] = DeclKey;
   }
 
-  return DeclID;
+  stageDecl(std::move(Staged));
+  return DeclKey;
+}
+
+void ClangDatabase::stageDecl(StagedDecl &&Staged) {
+  // Nothing to write if the decl was merged before with everything we know
+  auto &KnownDecls = getDatabaseImpl()->KnownDecls;
+  auto Known = KnownDecls.find(Staged.Key);
+  if (Known != KnownDecls.end()
+      && (Known->second.HasKind || Staged.Kind == DeclKind::Other)
+      && (Staged.PresumedLocID == 0
+          || Staged.PresumedLocID == Known->second.PresumedLocID)) {
+    return;
+  }
+
+  auto Inserted = Impl->StagedDecls.emplace(Staged.Key, StagedDecl());
+  StagedDecl &Existing = Inserted.first->second;
+  if (Staged.PresumedLocID == 0) {
+    Staged.PresumedLocID = Existing.PresumedLocID;
+  }
+  if (Staged.Kind == DeclKind::Other && !Inserted.second) {
+    Existing.PresumedLocID = Staged.PresumedLocID;
+    return;
+  }
+  Existing = std::move(Staged);
 }
 
 uint32_t ClangDatabase::getPresumedLocID(const Decl *D) {
@@ -641,63 +831,111 @@ uint32_t ClangDatabase::getPresumedLocID(const Decl *D) {
 }
 
 void ClangDatabase::insertMethod(const CXXMethodDecl *MD) {
-  getDeclID(MD);
+  getDeclKey(MD);
+}
+
+void ClangDatabase::insertPublicView(uint64_t RecordKey, uint64_t DeclKey) {
+  if (!getDatabaseImpl()->isNewFact(getFactHash(FactKind::PublicView,
+                                                RecordKey, DeclKey))) {
+    return;
+  }
+  Impl->PublicViews.emplace_back(RecordKey, DeclKey);
+  shipIfFull();
 }
 
 void ClangDatabase::insertPublicMethod(const CXXRecordDecl *RD, const CXXMethodDecl *MD) {
-  Params P;
-  P.addBinary(getDeclID(RD));
-  P.addBinary(getDeclID(MD));
-  TupleResult Select(getDatabaseImpl(), "SELECT get_public_view($1, $2)", P);
+  insertPublicView(getDeclKey(RD), getDeclKey(MD));
 }
 
 void ClangDatabase::insertPublicField(const CXXRecordDecl *RD, const FieldDecl *FD) {
-  Params P;
-  P.addBinary(getDeclID(RD));
-  P.addBinary(getDeclID(FD));
-  TupleResult Select(getDatabaseImpl(), "SELECT get_public_view($1, $2)", P);
+  insertPublicView(getDeclKey(RD), getDeclKey(FD));
 }
 
-void ClangDatabase::insertMethodCheck(const CXXMethodDecl *MD, MethodResultTuple Result) {
-  uint32_t MethodDeclID = getDeclID(MD);
+void ClangDatabase::insertPublicBase(const CXXRecordDecl *RD, const CXXRecordDecl *Base) {
+  uint64_t RecordKey = getDeclKey(RD);
+  uint64_t BaseKey = getDeclKey(Base);
+  if (!getDatabaseImpl()->isNewFact(getFactHash(FactKind::PublicBase,
+                                                RecordKey, BaseKey))) {
+    return;
+  }
+  Impl->PublicBases.emplace_back(RecordKey, BaseKey);
+  shipIfFull();
+}
 
-  Params P;
-  P.addBinary(MethodDeclID);
-  P.addBinary(static_cast<uint32_t>(Result.mutateResult));
-  P.addBinary(static_cast<uint32_t>(Result.returnResult));
+void ClangDatabase::insertPublicOverride(const CXXMethodDecl *MD, const CXXMethodDecl *Overridden) {
+  uint64_t MethodKey = getDeclKey(MD);
+  uint64_t OverriddenKey = getDeclKey(Overridden);
+  if (!getDatabaseImpl()->isNewFact(getFactHash(FactKind::PublicOverride,
+                                                MethodKey, OverriddenKey))) {
+    return;
+  }
+  Impl->PublicOverrides.emplace_back(MethodKey, OverriddenKey);
+  shipIfFull();
+}
 
-  TupleResult Select(getDatabaseImpl(), "SELECT get_clang_immutability_check_method($1, $2, $3)", P);
+void ClangDatabase::insertMethodCheck(const CXXMethodDecl *MD, MethodResultTuple Result) {
+  uint64_t MethodDeclKey = getDeclKey(MD);
+  Impl->MethodChecks[MethodDeclKey] = Result;
+  shipIfFull();
 }
 
 void ClangDatabase::insertFieldCheck(const FieldDecl *FD, bool isExplicit, bool isTransitive) {
     assert(FD);
-  uint32_t FieldDeclID = getDeclID(FD);
-  Params P;
-  P.addBinary(FieldDeclID);
-  if (isExplicit) {
-    P.addText("true");
-  }
-  else {
-    P.addText("false");
-  }
-  if (isTransitive) {
-    P.addText("true");
-  }
-  else {
-    P.addText("false");
-  }
-  TupleResult Select(getDatabaseImpl(), "SELECT get_clang_immutability_check_field($1, $2, $3)", P);
+  uint64_t FieldDeclKey = getDeclKey(FD);
+  Impl->FieldChecks[FieldDeclKey] = std::make_pair(isExplicit, isTransitive);
+  shipIfFull();
 }
 
 void ClangDatabase::insertMethodDependence(const CXXMethodDecl *Method, const CXXMethodDecl *Callee) {
-  uint32_t MethodID = getDeclID(Method);
-  uint32_t CalleeID = getDeclID(Callee);
+  uint64_t MethodKey = getDeclKey(Method);
+  uint64_t CalleeKey = getDeclKey(Callee);
+  if (!getDatabaseImpl()->isNewFact(getFactHash(FactKind::MethodDependence,
+                                                MethodKey, CalleeKey))) {
+    return;
+  }
+  Impl->MethodDependences.emplace_back(MethodKey, CalleeKey);
+  shipIfFull();
+}
 
-  Params P;
-  P.addBinary(MethodID);
-  P.addBinary(CalleeID);
+bool ClangDatabase::isCheckedMethod(const CXXMethodDecl *MD) {
+  auto &DBImpl = getDatabaseImpl();
+  uint64_t Key = getDeclKey(MD);
+  // Checks of this process are of the same sources, stored ones may be of
+  // older ones
+  bool Checked = DBImpl->MethodsCheckedByProcess.count(Key);
+  if (!Checked && DBImpl->ReuseStoredChecks
+      && !DBImpl->ChangedCompileCommands.count(Impl->DB.getCompileCommandID())) {
+    auto Known = DBImpl->KnownDecls.find(Key);
+    Checked = Known != DBImpl->KnownDecls.end() && Known->second.IsChecked;
+  }
+  if (!Checked) {
+    return false;
+  }
+  ++DBImpl->NumSkippedMethods;
+  return true;
+}
 
-  TupleResult Select(getDatabaseImpl(), "SELECT get_method_dependence($1, $2)", P);
+void ClangDatabase::insertInputs() {
+  auto &DBImpl = getDatabaseImpl();
+  for (auto It = Impl->SM.fileinfo_begin(); It != Impl->SM.fileinfo_end();
+       ++It) {
+    // Files that were only looked up were never read
+    const llvm::MemoryBuffer *Buffer = It->second->getRawBuffer();
+    if (Buffer == nullptr) {
+      continue;
+    }
+    std::string Path;
+    if (!Impl->DB.getPackagePath(It->first->getName(), Path)) {
+      errs() << "Can't resolve " << It->first->getName()
+             << ", its compile command's files aren't recorded\n";
+      DBImpl->HasUnresolvedInputs = true;
+      continue;
+    }
+    if (Path.empty()) {
+      continue;
+    }
+    DBImpl->Inputs[Path] = hashFNV(Buffer->getBuffer());
+  }
 }
 
 bool ClangDatabase::isSkippedMethod(const CXXMethodDecl *MD) {
@@ -0,0 +1,39 @@
+#ifndef CLANG_IMMUTABILITY_CHECK_FNV_H
+#define CLANG_IMMUTABILITY_CHECK_FNV_H
+
+#include <llvm/ADT/StringRef.h>
+
+#include <cstdint>
+
+namespace clang {
+namespace immutability {
+
+// 64-bit FNV-1a. Decl keys, shard manifests and input files are compared
+// across runs, so it has to stay stable across runs and releases.
+class FNVHash {
+  uint64_t Hash = 0xcbf29ce484222325;
+public:
+  void add(unsigned char C) {
+    Hash ^= C;
+    Hash *= 0x100000001b3;
+  }
+  void add(llvm::StringRef S) {
+    for (char C : S) {
+      add(static_cast<unsigned char>(C));
+    }
+  }
+  uint64_t get() const {
+    return Hash;
+  }
+};
+
+inline uint64_t hashFNV(llvm::StringRef S) {
+  FNVHash Hash;
+  Hash.add(S);
+  return Hash.get();
+}
+
+}
+}
+
+#endif
@@ -0,0 +1,159 @@
+#include "Database.h"
+#include "Connection.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <llvm/ADT/DenseSet.h>
+
+#include <unistd.h>
+
+using namespace llvm;
+
+namespace clang {
+namespace immutability {
+
+struct JobQueueImpl {
+  // Guards the connection and the claimed jobs, the heartbeat shares them
+  // with every thread claiming jobs
+  std::mutex Mutex;
+  Connection Conn;
+  std::string WorkerName;
+  unsigned LeaseSeconds;
+  DenseSet<unsigned> Claimed;
+
+  std::condition_variable Wakeup;
+  bool Stopping = false;
+  std::thread Heartbeat;
+
+  unsigned NumClaimed = 0;
+  unsigned NumDone = 0;
+  unsigned NumFailed = 0;
+  unsigned NumRenewals = 0;
+  unsigned NumLost = 0;
+
+  void renewLeases();
+};
+
+namespace {
+
+// Unique among the workers of every machine
+std::string getWorkerName() {
+  char Host[256] = "";
+  ::gethostname(Host, sizeof(Host) - 1);
+  return std::string(Host) + ':' + std::to_string(::getpid());
+}
+
+}
+
+// Renewed three times per lease, so a slow round trip doesn't lose it
+void JobQueueImpl::renewLeases() {
+  std::unique_lock<std::mutex> Lock(Mutex);
+  auto Interval = std::chrono::seconds(LeaseSeconds) / 3;
+  while (!Wakeup.wait_for(Lock, Interval, [this] { return Stopping; })) {
+    std::vector<unsigned> Lost;
+    for (unsigned CompileCommandID : Claimed) {
+      Params P;
+      P.addBinary(CompileCommandID);
+      P.addText(WorkerName.c_str());
+      P.addBinary(LeaseSeconds);
+      TupleResult Renew(Conn, "SELECT renew_check_job_lease($1, $2, $3)", P);
+      ++NumRenewals;
+      if (!Renew.getBool(0, "renew_check_job_lease")) {
+        Lost.push_back(CompileCommandID);
+      }
+    }
+    // Another worker may be checking it too, the results merge the same
+    for (unsigned CompileCommandID : Lost) {
+      errs() << "Lost the lease of compile command " << CompileCommandID
+             << '\n';
+      Claimed.erase(CompileCommandID);
+      ++NumLost;
+    }
+  }
+}
+
+JobQueue::JobQueue(StringRef ConnInfo, unsigned LeaseSeconds)
+    : Impl(llvm::make_unique<JobQueueImpl>()) {
+  Impl->Conn.ConnInfo = ConnInfo.str();
+  Impl->WorkerName = getWorkerName();
+  Impl->LeaseSeconds = std::max(LeaseSeconds, 3u);
+  connect(Impl->Conn);
+  Impl->Heartbeat = std::thread(&JobQueueImpl::renewLeases, Impl.get());
+}
+
+JobQueue::~JobQueue() {
+  {
+    std::lock_guard<std::mutex> Lock(Impl->Mutex);
+    Impl->Stopping = true;
+  }
+  Impl->Wakeup.notify_one();
+  Impl->Heartbeat.join();
+  // Jobs still claimed are left to expire and be claimed again
+  disconnect(Impl->Conn);
+}
+
+void JobQueue::enqueue(unsigned CompileCommandID) {
+  std::lock_guard<std::mutex> Lock(Impl->Mutex);
+  Params P;
+  P.addBinary(CompileCommandID);
+  TupleResult Enqueue(Impl->Conn, "SELECT enqueue_check_job($1)", P);
+}
+
+unsigned JobQueue::enqueuePackage(uint32_t PackageID) {
+  std::lock_guard<std::mutex> Lock(Impl->Mutex);
+  Params P;
+  P.addBinary(PackageID);
+  TupleResult Enqueue(Impl->Conn, "SELECT enqueue_package_check_jobs($1)", P);
+  return Enqueue.getBinary();
+}
+
+unsigned JobQueue::claim() {
+  std::lock_guard<std::mutex> Lock(Impl->Mutex);
+  Params P;
+  P.addText(Impl->WorkerName.c_str());
+  P.addBinary(Impl->LeaseSeconds);
+  TupleResult Claim(Impl->Conn, "SELECT * FROM claim_check_job($1, $2) AS id", P);
+  if (Claim.getNumTuples() == 0) {
+    return 0;
+  }
+  unsigned CompileCommandID = Claim.getID();
+  Impl->Claimed.insert(CompileCommandID);
+  ++Impl->NumClaimed;
+  return CompileCommandID;
+}
+
+void JobQueue::finish(unsigned CompileCommandID, bool Succeeded) {
+  std::lock_guard<std::mutex> Lock(Impl->Mutex);
+  Impl->Claimed.erase(CompileCommandID);
+  Params P;
+  P.addBinary(CompileCommandID);
+  P.addText(Impl->WorkerName.c_str());
+  P.addBool(Succeeded);
+  P.addText(Succeeded ? "" : "The translation unit could not be checked");
+  TupleResult Finish(Impl->Conn, "SELECT finish_check_job($1, $2, $3, $4)", P);
+  if (!Finish.getBool(0, "finish_check_job")) {
+    errs() << "Compile command " << CompileCommandID
+           << " was finished by another worker\n";
+  }
+  if (Succeeded) {
+    ++Impl->NumDone;
+  }
+  else {
+    ++Impl->NumFailed;
+  }
+}
+
+void JobQueue::printStatistics(raw_ostream &OS) const {
+  std::lock_guard<std::mutex> Lock(Impl->Mutex);
+  OS << "Jobs claimed: " << Impl->NumClaimed
+     << ", done: " << Impl->NumDone
+     << ", failed: " << Impl->NumFailed << '\n';
+  OS << "Lease renewals: " << Impl->NumRenewals
+     << ", leases lost: " << Impl->NumLost << '\n';
+}
+
+}
+}
@@ -0,0 +1,226 @@
+#include "Storage.h"
+
+#include <unordered_map>
+
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/STLExtras.h>
+
+using namespace llvm;
+
+namespace clang {
+namespace immutability {
+
+namespace {
+
+class MemoryStorage : public Storage {
+public:
+  explicit MemoryStorage(StringRef CompileCommands)
+      : CompileCommands(CompileCommands) {
+    // There's a single package, its root decl's key is always 0 and its root
+    // file descriptor's ID is always 1
+    Decls.emplace(0, StagedDecl());
+    FileDescriptors[""] = 1;
+  }
+
+  CompileCommandInfo getCompileCommandInfo(unsigned CompileCommandID) override {
+    CompileCommandInfo Info =
+      CompileCommands.getCompileCommandInfo(CompileCommandID);
+    Info.PackageID = 1;
+    Info.RootDeclID = 1;
+    Info.RootFileDescriptorID = 1;
+    return Info;
+  }
+
+  // Nothing outlives the process, every compile command is pending
+  std::vector<unsigned>
+  getPendingCompileCommands(uint32_t PackageID) override {
+    return CompileCommands.getCompileCommandIDs();
+  }
+
+  std::vector<unsigned> getCompileCommands(uint32_t PackageID) override {
+    return CompileCommands.getCompileCommandIDs();
+  }
+
+  std::vector<InputFile>
+  getCompileCommandInputs(unsigned CompileCommandID,
+                          uint32_t PackageID) override {
+    auto It = Inputs.find(CompileCommandID);
+    if (It == Inputs.end()) {
+      return {};
+    }
+    return It->second;
+  }
+
+  void setCompileCommandInputs(std::vector<InputFile> Inputs) override {
+    UnitInputs = std::move(Inputs);
+  }
+
+  void setCompileCommand(unsigned CompileCommandID,
+                         uint32_t PackageID) override {
+    this->CompileCommandID = CompileCommandID;
+  }
+
+  void getFileDescriptors(uint32_t PackageID,
+                          StringMap<uint32_t> &Found) override {
+    for (auto &Entry : FileDescriptors) {
+      Found[Entry.getKey()] = Entry.getValue();
+    }
+  }
+
+  void getDeclIndex(uint32_t PackageID,
+                    DenseMap<uint64_t, KnownDecl> &Found) override {
+    for (auto &Entry : Decls) {
+      KnownDecl &Known = Found[Entry.first];
+      Known.PresumedLocID = Entry.second.PresumedLocID;
+      Known.HasKind = Entry.second.Kind != DeclKind::Other;
+      Known.IsChecked = MethodChecks.count(Entry.first);
+    }
+  }
+
+  std::vector<uint32_t>
+  createFileDescriptors(uint32_t PackageID, uint32_t ParentID,
+                        StringRef ParentPath,
+                        ArrayRef<std::string> Names) override {
+    std::vector<uint32_t> IDs;
+    std::string Path = ParentPath.str();
+    for (auto &Name : Names) {
+      if (!Path.empty()) {
+        Path += '/';
+      }
+      Path += Name;
+      auto Inserted = FileDescriptors.insert(std::make_pair(Path, 0));
+      if (Inserted.second) {
+        Inserted.first->second = FileDescriptors.size();
+      }
+      IDs.push_back(Inserted.first->second);
+    }
+    return IDs;
+  }
+
+  std::vector<uint32_t> getPresumedLocs(ArrayRef<uint32_t> FileIDs,
+                                        ArrayRef<uint32_t> Lines,
+                                        ArrayRef<uint32_t> Columns) override {
+    std::vector<uint32_t> IDs;
+    for (size_t i = 0; i < FileIDs.size(); ++i) {
+      uint64_t LineColumn = (static_cast<uint64_t>(Lines[i]) << 32) | Columns[i];
+      auto Inserted =
+        PresumedLocs.insert(std::make_pair(std::make_pair(FileIDs[i], LineColumn), 0));
+      if (Inserted.second) {
+        Inserted.first->second = PresumedLocs.size();
+      }
+      IDs.push_back(Inserted.first->second);
+    }
+    return IDs;
+  }
+
+  void beginUnit() override {
+    Unit.clear();
+    UnitInputs.clear();
+  }
+
+  void commitUnit() override {
+    for (FactBatch &Batch : Unit) {
+      apply(Batch);
+    }
+    Unit.clear();
+    Inputs[CompileCommandID] = std::move(UnitInputs);
+    UnitInputs.clear();
+    ++NumUnits;
+  }
+
+  void rollbackUnit() override {
+    Unit.clear();
+    UnitInputs.clear();
+    ++NumRolledBack;
+  }
+
+  void write(uint32_t PackageID, FactBatch &Batch) override {
+    Unit.emplace_back();
+    std::swap(Unit.back(), Batch);
+  }
+
+  // Everything is merged at once when the unit commits
+  void merge(uint32_t PackageID) override {}
+
+  void printStatistics(raw_ostream &OS) const override {
+    OS << "Memory storage units committed: " << NumUnits
+       << ", rolled back: " << NumRolledBack << '\n';
+    OS << "File descriptors: " << FileDescriptors.size()
+       << ", presumed locations: " << PresumedLocs.size()
+       << ", decls: " << Decls.size() << '\n';
+    OS << "Method checks: " << MethodChecks.size()
+       << ", field checks: " << FieldChecks.size()
+       << ", public views: " << PublicViews.size()
+       << ", public bases: " << PublicBases.size()
+       << ", public overrides: " << PublicOverrides.size()
+       << ", method dependences: " << MethodDependences.size() << '\n';
+  }
+
+private:
+  // Mirrors the server's merges, a decl keeps the details of its kind from
+  // the first time it's merged with them
+  void apply(FactBatch &Batch) {
+    for (StagedDecl &Staged : Batch.Decls) {
+      auto Inserted = Decls.emplace(Staged.Key, StagedDecl());
+      StagedDecl &Existing = Inserted.first->second;
+      if (Inserted.second || Existing.Kind == DeclKind::Other) {
+        uint32_t PresumedLocID = Existing.PresumedLocID;
+        Existing = std::move(Staged);
+        if (Existing.PresumedLocID == 0) {
+          Existing.PresumedLocID = PresumedLocID;
+        }
+      }
+      else if (Staged.PresumedLocID != 0) {
+        Existing.PresumedLocID = Staged.PresumedLocID;
+      }
+    }
+    for (auto &Check : Batch.MethodChecks) {
+      MethodChecks[Check.first] = Check.second;
+    }
+    for (auto &Check : Batch.FieldChecks) {
+      FieldChecks[std::get<0>(Check)] =
+        std::make_pair(std::get<1>(Check), std::get<2>(Check));
+    }
+    for (auto &View : Batch.PublicViews) {
+      PublicViews.insert(View);
+    }
+    for (auto &Base : Batch.PublicBases) {
+      PublicBases.insert(Base);
+    }
+    for (auto &Override : Batch.PublicOverrides) {
+      PublicOverrides.insert(Override);
+    }
+    for (auto &Dependence : Batch.MethodDependences) {
+      MethodDependences.insert(Dependence);
+    }
+  }
+
+  LocalCompileCommands CompileCommands;
+  unsigned CompileCommandID = 0;
+
+  StringMap<uint32_t> FileDescriptors;
+  DenseMap<std::pair<uint32_t, uint64_t>, uint32_t> PresumedLocs;
+  std::unordered_map<uint64_t, StagedDecl> Decls;
+  std::unordered_map<uint64_t, MethodResultTuple> MethodChecks;
+  std::unordered_map<uint64_t, std::pair<bool, bool>> FieldChecks;
+  DenseSet<std::pair<uint64_t, uint64_t>> PublicViews;
+  DenseSet<std::pair<uint64_t, uint64_t>> PublicBases;
+  DenseSet<std::pair<uint64_t, uint64_t>> PublicOverrides;
+  DenseSet<std::pair<uint64_t, uint64_t>> MethodDependences;
+  std::unordered_map<unsigned, std::vector<InputFile>> Inputs;
+
+  // Rows of the current unit of work
+  std::vector<FactBatch> Unit;
+  std::vector<InputFile> UnitInputs;
+  unsigned NumUnits = 0;
+  unsigned NumRolledBack = 0;
+};
+
+}
+
+std::unique_ptr<Storage> createMemoryStorage(StringRef CompileCommands) {
+  return llvm::make_unique<MemoryStorage>(CompileCommands);
+}
+
+}
+}
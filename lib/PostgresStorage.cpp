@@ -0,0 +1,1155 @@
+#include "Database.h"
+#include "Storage.h"
+#include "Connection.h"
+#include "Writer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <sstream>
+
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+
+#include <unistd.h>
+
+using namespace llvm;
+using namespace clang::immutability;
+
+namespace clang {
+namespace immutability {
+
+// A write of a unit of work. It's kept until its transaction commits, so the
+// transaction can be run again after a failure or spooled to disk.
+struct WriteOp {
+  enum OpKind : uint8_t {
+    Command,
+    Copy,
+  };
+  OpKind Kind = Command;
+  std::string Query;
+  // The binary parameters of a command
+  std::vector<uint32_t> Binaries;
+  // The finished buffer of a copy
+  std::string Data;
+};
+
+// A presumed location of extract mode, its file is a local file descriptor ID
+struct FactLoc {
+  uint32_t FileID;
+  uint32_t Line;
+  uint32_t Column;
+};
+
+namespace {
+void runWriteOp(Connection &Conn, const WriteOp &Op);
+}
+
+class PostgresStorage : public Storage {
+public:
+  PostgresStorage(StringRef ConnInfo, StringRef FactFile, bool AsyncWrites,
+                  bool UnloggedStaging);
+  ~PostgresStorage() override;
+
+  CompileCommandInfo getCompileCommandInfo(unsigned CompileCommandID) override;
+  void setCompileCommand(unsigned CompileCommandID,
+                         uint32_t PackageID) override;
+  std::vector<unsigned>
+  getPendingCompileCommands(uint32_t PackageID) override;
+  std::vector<unsigned> getCompileCommands(uint32_t PackageID) override;
+  std::vector<InputFile>
+  getCompileCommandInputs(unsigned CompileCommandID,
+                          uint32_t PackageID) override;
+  void setCompileCommandInputs(std::vector<InputFile> Inputs) override;
+  void getFileDescriptors(uint32_t PackageID,
+                          StringMap<uint32_t> &FileDescriptors) override;
+  void getDeclIndex(uint32_t PackageID,
+                    DenseMap<uint64_t, KnownDecl> &Decls) override;
+  std::vector<uint32_t>
+  createFileDescriptors(uint32_t PackageID, uint32_t ParentID,
+                        StringRef ParentPath,
+                        ArrayRef<std::string> Names) override;
+  std::vector<uint32_t> getPresumedLocs(ArrayRef<uint32_t> FileIDs,
+                                        ArrayRef<uint32_t> Lines,
+                                        ArrayRef<uint32_t> Columns) override;
+  void beginUnit() override;
+  void commitUnit() override;
+  void rollbackUnit() override;
+  void write(uint32_t PackageID, FactBatch &Batch) override;
+  void merge(uint32_t PackageID) override;
+  bool sync() override;
+  bool wantsBatches() const override {
+    return static_cast<bool>(AsyncWriter);
+  }
+  void printStatistics(raw_ostream &OS) const override;
+
+  unsigned CompileCommandID = 0;
+  uint32_t PackageID = 0;
+  // Packages whose unlogged staging partitions we know exist
+  DenseSet<uint32_t> PartitionedPackages;
+
+  // Lookups that need their result right away always use this connection
+  Connection Conn;
+  // With a writer, every write runs on its connection instead
+  std::unique_ptr<Writer> AsyncWriter;
+
+  // Each translation unit is a unit of work in its own transaction
+  bool InTransaction = false;
+  bool InUnit = false;
+
+  // Writes of the open transaction. Without a writer they're only sent once
+  // the transaction commits, so lookups never run inside of it.
+  std::vector<std::shared_ptr<const WriteOp>> Journal;
+  unsigned NumReplayed = 0;
+  unsigned NumSpooled = 0;
+  unsigned NumDropped = 0;
+
+  // In extract mode committed transactions are appended to the fact file
+  // instead. File descriptor and presumed location IDs are then local to the
+  // process, indexes into FactPaths and FactLocs starting at 1, and they're
+  // written by path, line and column.
+  std::string FactFile;
+  std::ofstream FactStream;
+  StringMap<uint32_t> FactFileIDs;
+  std::vector<std::string> FactPaths;
+  std::vector<FactLoc> FactLocs;
+  unsigned NumFactTransactions = 0;
+
+  // Rows are copied into the package's unlogged partitions and only merged
+  // once it's promoted
+  bool UnloggedStaging = false;
+
+  bool isExtracting() const {
+    return !FactFile.empty();
+  }
+  bool isStagingUnlogged() const {
+    return UnloggedStaging && !isExtracting();
+  }
+
+  Connection &getWriteConnection() {
+    return AsyncWriter ? AsyncWriter->getConnection() : Conn;
+  }
+  void submit(WriteOp Op) {
+    auto Shared = std::make_shared<const WriteOp>(std::move(Op));
+    Journal.push_back(Shared);
+    if (AsyncWriter) {
+      AsyncWriter->submit([Shared](Connection &Conn) {
+        runWriteOp(Conn, *Shared);
+      });
+    }
+  }
+  void submitCommand(const char *Q) {
+    WriteOp Op;
+    Op.Query = Q;
+    submit(std::move(Op));
+  }
+  void submitCopy(StringRef Q, CopyBuffer &Buffer) {
+    if (Buffer.empty()) {
+      return;
+    }
+    WriteOp Op;
+    Op.Kind = WriteOp::Copy;
+    Op.Query = Q.str();
+    Op.Data = Buffer.finish();
+    submit(std::move(Op));
+  }
+  // Rows of the shared staging tables start with their package
+  void addStagingTuple(CopyBuffer &Buffer, uint16_t NumFields) {
+    if (isStagingUnlogged()) {
+      Buffer.addTuple(NumFields + 1);
+      Buffer.addBinary(PackageID);
+    }
+    else {
+      Buffer.addTuple(NumFields);
+    }
+  }
+  void submitStagingCopy(StringRef Table, CopyBuffer &Buffer) {
+    std::string Q = "COPY ";
+    Q += isStagingUnlogged() ? "cpp_doc_shared_staging_" : "cpp_doc_staging_";
+    Q += Table;
+    Q += " FROM STDIN (FORMAT binary)";
+    submitCopy(Q, Buffer);
+  }
+  // Undoes what the writer already ran of the transaction, without a writer
+  // none of it was sent
+  void rollbackSent() {
+    if (!AsyncWriter) {
+      return;
+    }
+    AsyncWriter->submit([](Connection &Conn) {
+      Params P;
+      DeferredResult Rollback(Conn, "ROLLBACK", P);
+      // Whatever failed in the transaction went with it
+      Conn.Error = QueryError();
+      // The staging tables may have been created in what we just rolled back
+      Conn.HasStagingTables = false;
+    });
+  }
+  // Runs J on the write connection once everything before it has run
+  void run(Writer::Job J) {
+    if (AsyncWriter) {
+      AsyncWriter->submit(std::move(J));
+      AsyncWriter->wait();
+    }
+    else {
+      J(Conn);
+    }
+  }
+};
+
+struct FactLoaderImpl {
+  Connection Conn;
+  unsigned NumLoaded = 0;
+  unsigned NumFailed = 0;
+  unsigned NumTransactions = 0;
+  unsigned NumPromoted = 0;
+};
+
+namespace {
+
+// Per-session tables the buffered decls and result rows are copied into
+// before being merged by merge_staged_decls and merge_staged_results
+const char *StagingTables[] = {
+  "CREATE TEMPORARY TABLE IF NOT EXISTS cpp_doc_staging_decl "
+  "(depth integer, decl_key bigint, parent_key bigint, name character varying(4096), "
+  "path character varying(4096), presumed_loc_id integer)",
+  "CREATE TEMPORARY TABLE IF NOT EXISTS cpp_doc_staging_decl_loc "
+  "(depth integer, decl_key bigint, parent_key bigint, name character varying(4096), "
+  "path character varying(4096), file_path character varying(4096), line integer, col integer)",
+  "CREATE TEMPORARY TABLE IF NOT EXISTS cpp_doc_staging_record_decl "
+  "(decl_key bigint, is_abstract boolean, is_dependent boolean)",
+  "CREATE TEMPORARY TABLE IF NOT EXISTS cpp_doc_staging_namespace_decl "
+  "(decl_key bigint)",
+  "CREATE TEMPORARY TABLE IF NOT EXISTS cpp_doc_staging_field_decl "
+  "(decl_key bigint, is_mutable boolean, access integer)",
+  "CREATE TEMPORARY TABLE IF NOT EXISTS cpp_doc_staging_method_decl "
+  "(decl_key bigint, mangled_name character varying(4096), is_const boolean, "
+  "is_pure boolean, access integer)",
+  "CREATE TEMPORARY TABLE IF NOT EXISTS cpp_doc_staging_function_decl "
+  "(decl_key bigint)",
+  "CREATE TEMPORARY TABLE IF NOT EXISTS cpp_doc_staging_check_method "
+  "(method_key bigint, mutate_result integer, return_result integer)",
+  "CREATE TEMPORARY TABLE IF NOT EXISTS cpp_doc_staging_check_field "
+  "(field_key bigint, is_explicit boolean, is_transitive boolean)",
+  "CREATE TEMPORARY TABLE IF NOT EXISTS cpp_doc_staging_public_view "
+  "(record_key bigint, decl_key bigint)",
+  "CREATE TEMPORARY TABLE IF NOT EXISTS cpp_doc_staging_public_base "
+  "(record_key bigint, base_key bigint)",
+  "CREATE TEMPORARY TABLE IF NOT EXISTS cpp_doc_staging_public_override "
+  "(method_key bigint, overridden_key bigint)",
+  "CREATE TEMPORARY TABLE IF NOT EXISTS cpp_doc_staging_method_dependence "
+  "(method_key bigint, callee_key bigint)",
+};
+
+void createStagingTables(Connection &Conn) {
+  if (Conn.HasStagingTables) {
+    return;
+  }
+  Params P;
+  for (const char *Q : StagingTables) {
+    CommandResult Create(Conn, Q, P);
+  }
+  Conn.HasStagingTables = true;
+}
+
+void runWriteOp(Connection &Conn, const WriteOp &Op) {
+  // The transaction already failed, it will be run again from the start
+  if (Conn.Error) {
+    return;
+  }
+  // Created outside of a transaction the tables stay for the whole session
+  createStagingTables(Conn);
+
+  if (Op.Kind == WriteOp::Copy) {
+    copyIn(Conn, Op.Query.c_str(), Op.Data);
+    return;
+  }
+  Params P;
+  for (uint32_t Binary : Op.Binaries) {
+    P.addBinary(Binary);
+  }
+  DeferredResult Command(Conn, Op.Query.c_str(), P);
+}
+
+// Leaves what's left of a failed transaction behind, a lost connection is
+// reestablished instead
+bool resetConnection(Connection &Conn) {
+  Conn.Error = QueryError();
+  if (PQstatus(Conn.Handle) == CONNECTION_OK) {
+    Params P;
+    DeferredResult Rollback(Conn, "ROLLBACK", P);
+    sync(Conn);
+    Conn.HasStagingTables = false;
+    if (!Conn.Error) {
+      return true;
+    }
+    Conn.Error = QueryError();
+  }
+  return reconnect(Conn);
+}
+
+enum class Recovery {
+  Replayed,
+  Dropped,
+  Exhausted,
+};
+
+// Runs a failed transaction again until it goes through, or the error isn't
+// retryable, or we run out of attempts
+Recovery replayJournal(Connection &Conn,
+                       ArrayRef<std::shared_ptr<const WriteOp>> Journal) {
+  for (unsigned Attempt = 0; Conn.Error; ++Attempt) {
+    QueryError Error = Conn.Error;
+    if (Error.Kind == ErrorKind::Fatal || Attempt == MaxRetries) {
+      resetConnection(Conn);
+      Conn.Error = QueryError();
+      return Error.Kind == ErrorKind::Fatal
+        ? Recovery::Dropped : Recovery::Exhausted;
+    }
+
+    errs() << "Retrying transaction: " << Error.Message;
+    ++Conn.NumRetries;
+    sleepBeforeRetry(Attempt);
+    if (!resetConnection(Conn)) {
+      Conn.Error = Error;
+      Conn.Error.Kind = ErrorKind::ConnectionLost;
+      continue;
+    }
+    for (auto &Op : Journal) {
+      runWriteOp(Conn, *Op);
+    }
+    sync(Conn);
+  }
+  return Recovery::Replayed;
+}
+
+// Transactions that couldn't be written are spooled here and replayed by the
+// next Database to start. Without a base directory they go to the temporary
+// directory, every run of the user shares it.
+std::string getSpoolDirectory() {
+  if (const char *SpoolDir = ::getenv("CONST_CHECKER_SPOOL_DIR")) {
+    return SpoolDir;
+  }
+  if (const char *BaseDir = ::getenv("CONST_CHECKER_BASE_DIR")) {
+    return std::string(BaseDir) + "/spool";
+  }
+  SmallString<256> SpoolDir;
+  sys::path::system_temp_directory(/*ErasedOnReboot=*/ false, SpoolDir);
+  sys::path::append(SpoolDir, "const-checker-spool");
+  return SpoolDir.str().str();
+}
+
+// Spool and fact files are both a header followed by journaled writes
+const char JournalMagic[] = "CCSPOOL1";
+
+void writeJournalHeader(std::ostream &OS) {
+  OS.write(JournalMagic, sizeof(JournalMagic) - 1);
+}
+
+void writeJournal(std::ostream &OS,
+                  ArrayRef<std::shared_ptr<const WriteOp>> Journal) {
+  auto Write32 = [&OS](uint32_t Value) {
+    OS.write((const char *) &Value, sizeof(Value));
+  };
+  auto WriteString = [&OS, &Write32](const std::string &String) {
+    Write32(String.size());
+    OS.write(String.data(), String.size());
+  };
+
+  for (auto &Op : Journal) {
+    OS.put(Op->Kind);
+    WriteString(Op->Query);
+    Write32(Op->Binaries.size());
+    for (uint32_t Binary : Op->Binaries) {
+      Write32(Binary);
+    }
+    WriteString(Op->Data);
+  }
+}
+
+bool readJournal(std::istream &IS,
+                 std::vector<std::shared_ptr<const WriteOp>> &Journal) {
+  auto Read32 = [&IS]() {
+    uint32_t Value = 0;
+    IS.read((char *) &Value, sizeof(Value));
+    return Value;
+  };
+  auto ReadString = [&IS, &Read32](std::string &String) {
+    String.resize(Read32());
+    IS.read(&String[0], String.size());
+  };
+
+  char Magic[sizeof(JournalMagic) - 1];
+  IS.read(Magic, sizeof(Magic));
+  if (!IS || StringRef(Magic, sizeof(Magic)) != JournalMagic) {
+    return false;
+  }
+  while (IS.peek() != std::char_traits<char>::eof()) {
+    auto Op = std::make_shared<WriteOp>();
+    Op->Kind = static_cast<WriteOp::OpKind>(IS.get());
+    ReadString(Op->Query);
+    Op->Binaries.resize(Read32());
+    for (uint32_t &Binary : Op->Binaries) {
+      Binary = Read32();
+    }
+    ReadString(Op->Data);
+    if (!IS) {
+      return false;
+    }
+    Journal.push_back(std::move(Op));
+  }
+  return true;
+}
+
+void spool(PostgresStorage &Store,
+           std::vector<std::shared_ptr<const WriteOp>> Journal) {
+  // The transaction may have failed before it got to commit
+  if (Journal.back()->Query != "COMMIT") {
+    auto Commit = std::make_shared<WriteOp>();
+    Commit->Query = "COMMIT";
+    Journal.push_back(std::move(Commit));
+  }
+
+  std::string SpoolDir = getSpoolDirectory();
+  if (auto EC = sys::fs::create_directories(SpoolDir)) {
+    errs() << "spool: " << SpoolDir << ": " << EC.message() << '\n';
+    report_fatal_error("Could not spool a transaction");
+  }
+  // Workers of one process may spool at the same time
+  static std::atomic<unsigned> NumSpoolFiles{0};
+  std::stringstream ss;
+  ss << SpoolDir << '/' << Store.CompileCommandID << '-' << ::getpid()
+     << '-' << ++NumSpoolFiles;
+  std::string Path = ss.str();
+
+  // Written under another name first so it's never replayed half done
+  {
+    std::ofstream OS(Path + ".tmp", std::ios::binary);
+    writeJournalHeader(OS);
+    writeJournal(OS, Journal);
+    if (!OS) {
+      report_fatal_error("Could not spool a transaction");
+    }
+  }
+  if (auto EC = sys::fs::rename(Path + ".tmp", Path + ".spool")) {
+    errs() << "spool: " << EC.message() << '\n';
+    report_fatal_error("Could not spool a transaction");
+  }
+  errs() << "Spooled a transaction to " << Path << ".spool\n";
+}
+
+// Replays the transactions spooled by earlier runs. Each file is claimed by
+// renaming it first, so concurrent workers don't replay it twice.
+void replaySpool(PostgresStorage &Store) {
+  std::string SpoolDir = getSpoolDirectory();
+  std::vector<std::string> Paths;
+  std::error_code EC;
+  for (sys::fs::directory_iterator It(SpoolDir, EC), End;
+       !EC && It != End; It.increment(EC)) {
+    if (StringRef(It->path()).endswith(".spool")) {
+      Paths.push_back(It->path());
+    }
+  }
+
+  for (auto &Path : Paths) {
+    std::string Claimed = Path + ".replaying";
+    if (sys::fs::rename(Path, Claimed)) {
+      continue;
+    }
+
+    std::vector<std::shared_ptr<const WriteOp>> Journal;
+    std::ifstream IS(Claimed, std::ios::binary);
+    if (!readJournal(IS, Journal)) {
+      errs() << "Could not read spooled transaction " << Path << '\n';
+      sys::fs::rename(Claimed, Path + ".failed");
+      continue;
+    }
+
+    for (auto &Op : Journal) {
+      runWriteOp(Store.Conn, *Op);
+    }
+    sync(Store.Conn);
+    switch (replayJournal(Store.Conn, Journal)) {
+    case Recovery::Replayed:
+      sys::fs::remove(Claimed);
+      break;
+    case Recovery::Dropped:
+      errs() << "Could not replay spooled transaction " << Path << '\n';
+      sys::fs::rename(Claimed, Path + ".failed");
+      break;
+    case Recovery::Exhausted:
+      // The server is still unreachable, try again next time
+      sys::fs::rename(Claimed, Path);
+      return;
+    }
+  }
+}
+
+// Called after a sync found the open transaction failed. Returns false if
+// its writes were dropped.
+bool recover(PostgresStorage &Store) {
+  assert(!Store.InUnit && "Can't recover in the middle of a unit of work");
+  auto Journal = Store.Journal;
+  Recovery Result;
+  Store.run([&Result, &Journal](Connection &Conn) {
+    Result = replayJournal(Conn, Journal);
+  });
+
+  switch (Result) {
+  case Recovery::Replayed:
+    ++Store.NumReplayed;
+    return true;
+  case Recovery::Dropped:
+    errs() << "Dropped the writes of a failed transaction\n";
+    ++Store.NumDropped;
+    break;
+  case Recovery::Exhausted:
+    if (!Journal.empty()) {
+      spool(Store, Journal);
+      ++Store.NumSpooled;
+    }
+    break;
+  }
+  Store.Journal.clear();
+  Store.InTransaction = false;
+  return Result != Recovery::Dropped;
+}
+
+void printStatements(raw_ostream &OS, StringRef Title, const Connection &Conn) {
+  std::vector<std::pair<StringRef, const PreparedStatement *>> Statements;
+  for (auto &Entry : Conn.Statements) {
+    Statements.emplace_back(Entry.getKey(), &Entry.getValue());
+  }
+  std::sort(Statements.begin(), Statements.end(),
+            [](const std::pair<StringRef, const PreparedStatement *> &A,
+               const std::pair<StringRef, const PreparedStatement *> &B) {
+              return A.second->NumExecutions > B.second->NumExecutions;
+            });
+
+  OS << Title << " (prepares, executions, query):\n";
+  for (auto &Statement : Statements) {
+    OS << "  " << Statement.second->NumPrepares
+       << '\t' << Statement.second->NumExecutions
+       << '\t' << Statement.first << '\n';
+  }
+}
+
+}
+
+PostgresStorage::PostgresStorage(StringRef ConnInfo, StringRef FactFile,
+                                 bool AsyncWrites, bool UnloggedStaging)
+    : FactFile(FactFile.str()), UnloggedStaging(UnloggedStaging) {
+  Conn.ConnInfo = ConnInfo.str();
+  connect(Conn);
+
+  if (isExtracting()) {
+    // Written under another name first so it's never loaded half done
+    FactStream.open(this->FactFile + ".tmp", std::ios::binary);
+    writeJournalHeader(FactStream);
+    if (!FactStream) {
+      errs() << "Could not open " << this->FactFile << ".tmp\n";
+      report_fatal_error("Could not write the fact file");
+    }
+    return;
+  }
+
+  enterPipelineMode(Conn);
+  replaySpool(*this);
+  if (AsyncWrites) {
+    AsyncWriter = llvm::make_unique<Writer>(ConnInfo);
+  }
+}
+
+PostgresStorage::~PostgresStorage() {
+  if (InUnit) {
+    rollbackUnit();
+  }
+  sync();
+  AsyncWriter.reset();
+  disconnect(Conn);
+
+  if (isExtracting()) {
+    FactStream.close();
+    if (!FactStream) {
+      report_fatal_error("Could not write the fact file");
+    }
+    if (auto EC = sys::fs::rename(FactFile + ".tmp", FactFile)) {
+      errs() << "rename: " << FactFile << ": " << EC.message() << '\n';
+      report_fatal_error("Could not write the fact file");
+    }
+  }
+}
+
+CompileCommandInfo
+PostgresStorage::getCompileCommandInfo(unsigned CompileCommandID) {
+  Params P;
+  P.addBinary(CompileCommandID);
+  TupleResult InfoSelect(Conn, "SELECT * FROM get_compile_command_info($1)", P);
+
+  // Packages are unpacked below it, there's no source to run without it
+  const char *BaseDir = ::getenv("CONST_CHECKER_BASE_DIR");
+  if (BaseDir == nullptr) {
+    errs() << "CONST_CHECKER_BASE_DIR has to be set to the directory packages "
+              "are unpacked in\n";
+    report_fatal_error("No base directory");
+  }
+
+  std::stringstream ss;
+  ss << BaseDir;
+  ss << '/';
+  ss << InfoSelect.getValue("package_slug");
+  ss << '/';
+  ss << InfoSelect.getValue("package_version");
+  ss << "/src/";
+
+  CompileCommandInfo Info;
+  Info.PackageID = InfoSelect.getID("package_id");
+  Info.SourceDirectory = ss.str();
+  Info.Source = Info.SourceDirectory + InfoSelect.getValue("source_path");
+  Info.Directory = Info.SourceDirectory + InfoSelect.getValue("directory_path");
+  Info.CommandLine = InfoSelect.getTextArray("command_line");
+  Info.RootDeclID = InfoSelect.getID("root_decl_id");
+  Info.RootFileDescriptorID = InfoSelect.getID("root_file_descriptor_id");
+  return Info;
+}
+
+void PostgresStorage::setCompileCommand(unsigned CompileCommandID,
+                                        uint32_t PackageID) {
+  this->CompileCommandID = CompileCommandID;
+  this->PackageID = PackageID;
+  if (isStagingUnlogged() && PartitionedPackages.insert(PackageID).second) {
+    Params PackageParams;
+    PackageParams.addBinary(PackageID);
+    TupleResult Create(Conn, "SELECT create_staging_partitions($1)", PackageParams);
+  }
+}
+
+std::vector<unsigned>
+PostgresStorage::getPendingCompileCommands(uint32_t PackageID) {
+  Params P;
+  P.addBinary(PackageID);
+  TupleResult PendingSelect(Conn, "SELECT * FROM get_pending_compile_commands($1) AS id", P);
+  std::vector<unsigned> IDs;
+  for (int i = 0; i < PendingSelect.getNumTuples(); ++i) {
+    IDs.push_back(PendingSelect.getID(i, "id"));
+  }
+  return IDs;
+}
+
+std::vector<unsigned>
+PostgresStorage::getCompileCommands(uint32_t PackageID) {
+  Params P;
+  P.addBinary(PackageID);
+  TupleResult CompileCommandSelect(Conn, "SELECT id FROM cpp_doc_compile_command WHERE package_id = $1 ORDER BY id", P);
+  std::vector<unsigned> IDs;
+  for (int i = 0; i < CompileCommandSelect.getNumTuples(); ++i) {
+    IDs.push_back(CompileCommandSelect.getID(i, "id"));
+  }
+  return IDs;
+}
+
+std::vector<InputFile>
+PostgresStorage::getCompileCommandInputs(unsigned CompileCommandID,
+                                         uint32_t PackageID) {
+  Params P;
+  P.addBinary(CompileCommandID);
+  TupleResult InputSelect(Conn, "SELECT path, content_hash FROM cpp_doc_compile_command_input WHERE compile_command_id = $1", P);
+  std::vector<InputFile> Inputs;
+  for (int i = 0; i < InputSelect.getNumTuples(); ++i) {
+    InputFile Input;
+    Input.Path = InputSelect.getValue(i, "path");
+    Input.Hash = InputSelect.getBinary64(i, "content_hash");
+    Inputs.push_back(std::move(Input));
+  }
+  return Inputs;
+}
+
+// Written with the unit's results, a unit that's rolled back keeps the
+// inputs of the last run. With unlogged staging they're staged like the
+// results, the package's promotion publishes them.
+void PostgresStorage::setCompileCommandInputs(std::vector<InputFile> Inputs) {
+  assert(InUnit && "Inputs are only written in a unit of work");
+  WriteOp Clear;
+  Clear.Query = "SELECT clear_compile_command_inputs($1, $2)";
+  Clear.Binaries.push_back(CompileCommandID);
+  Clear.Binaries.push_back(PackageID);
+  submit(std::move(Clear));
+  CopyBuffer Buffer;
+  for (InputFile &Input : Inputs) {
+    addStagingTuple(Buffer, 3);
+    Buffer.addBinary(CompileCommandID);
+    Buffer.addText(Input.Path);
+    Buffer.addBinary64(Input.Hash);
+  }
+  if (isStagingUnlogged()) {
+    submitStagingCopy("compile_command_input", Buffer);
+  }
+  else {
+    submitCopy("COPY cpp_doc_compile_command_input (compile_command_id, path, content_hash) FROM STDIN (FORMAT binary)", Buffer);
+  }
+}
+
+void PostgresStorage::getFileDescriptors(uint32_t PackageID,
+                                         StringMap<uint32_t> &FileDescriptors) {
+  if (isExtracting()) {
+    return;
+  }
+  Params P;
+  P.addBinary(PackageID);
+  TupleResult FileDescriptorSelect(Conn, "SELECT path, id FROM cpp_doc_file_descriptor WHERE package_id = $1", P);
+  for (int i = 0; i < FileDescriptorSelect.getNumTuples(); ++i) {
+    FileDescriptors[FileDescriptorSelect.getValue(i, "path")] =
+      FileDescriptorSelect.getID(i, "id");
+  }
+}
+
+void PostgresStorage::getDeclIndex(uint32_t PackageID,
+                                   DenseMap<uint64_t, KnownDecl> &Decls) {
+  Params P;
+  P.addBinary(PackageID);
+  TupleResult DeclIndexSelect(Conn, "SELECT * FROM get_decl_index($1)", P);
+  Decls.reserve(DeclIndexSelect.getNumTuples());
+  for (int i = 0; i < DeclIndexSelect.getNumTuples(); ++i) {
+    KnownDecl &Known = Decls[DeclIndexSelect.getBinary64(i, "decl_key")];
+    // Their presumed locations mean nothing in extract mode, so those decls
+    // are staged again whenever we have a location for them
+    if (!isExtracting()) {
+      Known.PresumedLocID = DeclIndexSelect.getID(i, "presumed_loc_id");
+    }
+    Known.HasKind = DeclIndexSelect.getBool(i, "has_kind");
+    Known.IsChecked = DeclIndexSelect.getBool(i, "is_checked");
+  }
+}
+
+std::vector<uint32_t>
+PostgresStorage::createFileDescriptors(uint32_t PackageID, uint32_t ParentID,
+                                       StringRef ParentPath,
+                                       ArrayRef<std::string> Names) {
+  std::vector<uint32_t> IDs;
+  if (isExtracting()) {
+    std::string Path = ParentPath.str();
+    for (auto &Name : Names) {
+      if (!Path.empty()) {
+        Path += '/';
+      }
+      Path += Name;
+      auto Inserted = FactFileIDs.insert(std::make_pair(Path, 0));
+      if (Inserted.second) {
+        FactPaths.push_back(Path);
+        Inserted.first->second = FactPaths.size();
+      }
+      IDs.push_back(Inserted.first->second);
+    }
+    return IDs;
+  }
+
+  Params P;
+  P.addBinary(PackageID);
+  P.addBinary(ParentID);
+  auto S = ParentPath.str();
+  P.addText(S.c_str());
+  P.addTextArray(Names);
+
+  TupleResult FileDescriptorSelect(Conn, "SELECT * FROM get_file_descriptors($1, $2, $3, $4)", P);
+  assert(FileDescriptorSelect.getNumTuples() == (int) Names.size());
+  for (int i = 0; i < FileDescriptorSelect.getNumTuples(); ++i) {
+    IDs.push_back(FileDescriptorSelect.getBinary(i));
+  }
+  return IDs;
+}
+
+std::vector<uint32_t>
+PostgresStorage::getPresumedLocs(ArrayRef<uint32_t> FileIDs,
+                                 ArrayRef<uint32_t> Lines,
+                                 ArrayRef<uint32_t> Columns) {
+  std::vector<uint32_t> IDs;
+  if (isExtracting()) {
+    for (size_t i = 0; i < FileIDs.size(); ++i) {
+      FactLocs.push_back({FileIDs[i], Lines[i], Columns[i]});
+      IDs.push_back(FactLocs.size());
+    }
+    return IDs;
+  }
+
+  if (FileIDs.size() == 1) {
+    Params P;
+    P.addBinary(FileIDs[0]);
+    P.addBinary(Lines[0]);
+    P.addBinary(Columns[0]);
+    TupleResult PresumedLocSelect(Conn, "SELECT get_presumed_loc($1, $2, $3)", P);
+    IDs.push_back(PresumedLocSelect.getBinary());
+    return IDs;
+  }
+
+  Params P;
+  P.addBinaryArray(FileIDs);
+  P.addBinaryArray(Lines);
+  P.addBinaryArray(Columns);
+  TupleResult PresumedLocSelect(Conn, "SELECT * FROM get_presumed_locs($1, $2, $3)", P);
+  DenseMap<std::pair<uint32_t, uint64_t>, uint32_t> Found;
+  for (int i = 0; i < PresumedLocSelect.getNumTuples(); ++i) {
+    uint64_t LineColumn = PresumedLocSelect.getID(i, "line");
+    LineColumn = (LineColumn << 32) | PresumedLocSelect.getID(i, "col");
+    auto Key = std::make_pair(PresumedLocSelect.getID(i, "file_id"), LineColumn);
+    Found[Key] = PresumedLocSelect.getID(i, "id");
+  }
+  for (size_t i = 0; i < FileIDs.size(); ++i) {
+    uint64_t LineColumn = (static_cast<uint64_t>(Lines[i]) << 32) | Columns[i];
+    IDs.push_back(Found.lookup(std::make_pair(FileIDs[i], LineColumn)));
+  }
+  return IDs;
+}
+
+void PostgresStorage::beginUnit() {
+  assert(!InUnit && "Unit of work already started");
+  submitCommand("BEGIN");
+  InTransaction = true;
+  InUnit = true;
+}
+
+void PostgresStorage::commitUnit() {
+  assert(InUnit && "No unit of work to commit");
+  // Committed along with the unit's results, so the compile command is
+  // only skipped as checked once they're in
+  WriteOp Checked;
+  Checked.Query = "SELECT set_compile_command_checked($1)";
+  Checked.Binaries.push_back(CompileCommandID);
+  submit(std::move(Checked));
+  submitCommand("COMMIT");
+  InTransaction = false;
+  InUnit = false;
+}
+
+void PostgresStorage::rollbackUnit() {
+  assert(InUnit && "No unit of work to roll back");
+  // The unit's writes are left out if the transaction is ever run again
+  Journal.clear();
+  rollbackSent();
+  InTransaction = false;
+  InUnit = false;
+}
+
+bool PostgresStorage::sync() {
+  immutability::sync(Conn);
+  if (isExtracting()) {
+    if (!InTransaction && !Journal.empty()) {
+      writeJournal(FactStream, Journal);
+      if (!FactStream) {
+        report_fatal_error("Could not write the fact file");
+      }
+      ++NumFactTransactions;
+      Journal.clear();
+    }
+    return true;
+  }
+  if (AsyncWriter) {
+    AsyncWriter->wait();
+  }
+  else if (!InTransaction) {
+    for (auto &Op : Journal) {
+      runWriteOp(Conn, *Op);
+    }
+    immutability::sync(Conn);
+  }
+
+  bool Stored = true;
+  if (getWriteConnection().Error) {
+    Stored = recover(*this);
+  }
+  if (!InTransaction) {
+    Journal.clear();
+  }
+  return Stored;
+}
+
+void PostgresStorage::write(uint32_t PackageID, FactBatch &Batch) {
+  if (!Batch.Decls.empty()) {
+    CopyBuffer Decls, Records, Namespaces, Fields, Methods, Functions;
+    for (StagedDecl &Staged : Batch.Decls) {
+      if (isExtracting()) {
+        Decls.addTuple(8);
+      }
+      else {
+        addStagingTuple(Decls, 6);
+      }
+      Decls.addBinary(Staged.Depth);
+      Decls.addBinary64(Staged.Key);
+      Decls.addBinary64(Staged.ParentKey);
+      Decls.addText(Staged.Name);
+      Decls.addText(Staged.Path);
+      if (isExtracting()) {
+        if (Staged.PresumedLocID != 0) {
+          const FactLoc &Loc = FactLocs[Staged.PresumedLocID - 1];
+          Decls.addText(FactPaths[Loc.FileID - 1]);
+          Decls.addBinary(Loc.Line);
+          Decls.addBinary(Loc.Column);
+        }
+        else {
+          Decls.addNull();
+          Decls.addNull();
+          Decls.addNull();
+        }
+      }
+      else if (Staged.PresumedLocID != 0) {
+        Decls.addBinary(Staged.PresumedLocID);
+      }
+      else {
+        Decls.addNull();
+      }
+
+      switch (Staged.Kind) {
+      case DeclKind::Record:
+        addStagingTuple(Records, 3);
+        Records.addBinary64(Staged.Key);
+        Records.addBool(Staged.IsAbstract);
+        Records.addBool(Staged.IsDependent);
+        break;
+      case DeclKind::Namespace:
+        addStagingTuple(Namespaces, 1);
+        Namespaces.addBinary64(Staged.Key);
+        break;
+      case DeclKind::Field:
+        addStagingTuple(Fields, 3);
+        Fields.addBinary64(Staged.Key);
+        Fields.addBool(Staged.IsMutable);
+        Fields.addBinary(Staged.Access);
+        break;
+      case DeclKind::Method:
+        addStagingTuple(Methods, 5);
+        Methods.addBinary64(Staged.Key);
+        Methods.addText(Staged.MangledName);
+        Methods.addBool(Staged.IsConst);
+        Methods.addBool(Staged.IsPure);
+        Methods.addBinary(Staged.Access);
+        break;
+      case DeclKind::Function:
+        addStagingTuple(Functions, 1);
+        Functions.addBinary64(Staged.Key);
+        break;
+      case DeclKind::Other:
+        break;
+      }
+    }
+    if (isExtracting()) {
+      submitCopy("COPY cpp_doc_staging_decl_loc FROM STDIN (FORMAT binary)", Decls);
+    }
+    else {
+      submitStagingCopy("decl", Decls);
+    }
+    submitStagingCopy("record_decl", Records);
+    submitStagingCopy("namespace_decl", Namespaces);
+    submitStagingCopy("field_decl", Fields);
+    submitStagingCopy("method_decl", Methods);
+    submitStagingCopy("function_decl", Functions);
+  }
+
+  if (!Batch.MethodChecks.empty()) {
+    CopyBuffer Buffer;
+    for (auto &Check : Batch.MethodChecks) {
+      addStagingTuple(Buffer, 3);
+      Buffer.addBinary64(Check.first);
+      Buffer.addBinary(static_cast<uint32_t>(Check.second.mutateResult));
+      Buffer.addBinary(static_cast<uint32_t>(Check.second.returnResult));
+    }
+    submitStagingCopy("check_method", Buffer);
+  }
+
+  if (!Batch.FieldChecks.empty()) {
+    CopyBuffer Buffer;
+    for (auto &Check : Batch.FieldChecks) {
+      addStagingTuple(Buffer, 3);
+      Buffer.addBinary64(std::get<0>(Check));
+      Buffer.addBool(std::get<1>(Check));
+      Buffer.addBool(std::get<2>(Check));
+    }
+    submitStagingCopy("check_field", Buffer);
+  }
+
+  if (!Batch.PublicViews.empty()) {
+    CopyBuffer Buffer;
+    for (auto &View : Batch.PublicViews) {
+      addStagingTuple(Buffer, 2);
+      Buffer.addBinary64(View.first);
+      Buffer.addBinary64(View.second);
+    }
+    submitStagingCopy("public_view", Buffer);
+  }
+
+  if (!Batch.PublicBases.empty()) {
+    CopyBuffer Buffer;
+    for (auto &Base : Batch.PublicBases) {
+      addStagingTuple(Buffer, 2);
+      Buffer.addBinary64(Base.first);
+      Buffer.addBinary64(Base.second);
+    }
+    submitStagingCopy("public_base", Buffer);
+  }
+
+  if (!Batch.PublicOverrides.empty()) {
+    CopyBuffer Buffer;
+    for (auto &Override : Batch.PublicOverrides) {
+      addStagingTuple(Buffer, 2);
+      Buffer.addBinary64(Override.first);
+      Buffer.addBinary64(Override.second);
+    }
+    submitStagingCopy("public_override", Buffer);
+  }
+
+  if (!Batch.MethodDependences.empty()) {
+    CopyBuffer Buffer;
+    for (auto &Dependence : Batch.MethodDependences) {
+      addStagingTuple(Buffer, 2);
+      Buffer.addBinary64(Dependence.first);
+      Buffer.addBinary64(Dependence.second);
+    }
+    submitStagingCopy("method_dependence", Buffer);
+  }
+}
+
+void PostgresStorage::merge(uint32_t PackageID) {
+  // Published when the package is promoted
+  if (isStagingUnlogged()) {
+    return;
+  }
+  // Decls first, the results are resolved through their keys
+  WriteOp MergeDecls;
+  MergeDecls.Query = "SELECT merge_staged_decls($1)";
+  MergeDecls.Binaries.push_back(PackageID);
+  WriteOp MergeResults = MergeDecls;
+  MergeResults.Query = "SELECT merge_staged_results($1)";
+  if (isExtracting()) {
+    WriteOp MergeLocs = MergeDecls;
+    MergeLocs.Query = "SELECT merge_staged_decl_locs($1)";
+    submit(std::move(MergeLocs));
+  }
+  submit(std::move(MergeDecls));
+  submit(std::move(MergeResults));
+}
+
+void PostgresStorage::printStatistics(raw_ostream &OS) const {
+  printStatements(OS, "Prepared statements", Conn);
+  OS << "Retried queries: " << Conn.NumRetries
+     << ", reconnects: " << Conn.NumReconnects << '\n';
+  OS << "Failed transactions replayed: " << NumReplayed
+     << ", spooled: " << NumSpooled
+     << ", dropped: " << NumDropped << '\n';
+  if (isExtracting()) {
+    OS << "Fact file transactions: " << NumFactTransactions
+       << ", files: " << FactPaths.size()
+       << ", presumed locations: " << FactLocs.size() << '\n';
+  }
+  if (AsyncWriter) {
+    OS << "Writer jobs: " << AsyncWriter->getNumJobs()
+       << ", stalled on a full queue: " << AsyncWriter->getNumStalls()
+       << '\n';
+    printStatements(OS, "Writer prepared statements",
+                    AsyncWriter->getConnection());
+    OS << "Writer retried transactions: "
+       << AsyncWriter->getConnection().NumRetries
+       << ", reconnects: " << AsyncWriter->getConnection().NumReconnects
+       << '\n';
+  }
+}
+
+std::unique_ptr<Storage> createPostgresStorage(StringRef ConnInfo,
+                                               StringRef FactFile,
+                                               bool AsyncWrites,
+                                               bool UnloggedStaging) {
+  return llvm::make_unique<PostgresStorage>(ConnInfo, FactFile, AsyncWrites,
+                                            UnloggedStaging);
+}
+
+std::unique_ptr<Storage> createPostgresStorage() {
+  return createPostgresStorage("dbname = cpp_doc", StringRef(), false, false);
+}
+
+FactLoader::FactLoader(StringRef ConnInfo)
+    : Impl(llvm::make_unique<FactLoaderImpl>()) {
+  Impl->Conn.ConnInfo = ConnInfo.str();
+  connect(Impl->Conn);
+  enterPipelineMode(Impl->Conn);
+}
+
+FactLoader::~FactLoader() {
+  disconnect(Impl->Conn);
+}
+
+bool FactLoader::load(StringRef Path) {
+  std::vector<std::shared_ptr<const WriteOp>> Journal;
+  std::ifstream IS(Path.str(), std::ios::binary);
+  if (!readJournal(IS, Journal)) {
+    errs() << "Could not read fact file " << Path << '\n';
+    ++Impl->NumFailed;
+    return false;
+  }
+
+  // Transactions are run one at a time so a failed one is all that's run
+  // again. The merges are idempotent, loading a file twice is harmless.
+  auto Begin = Journal.begin();
+  while (Begin != Journal.end()) {
+    auto End = std::find_if(Begin, Journal.end(),
+                            [](const std::shared_ptr<const WriteOp> &Op) {
+                              return Op->Query == "COMMIT";
+                            });
+    if (End != Journal.end()) {
+      ++End;
+    }
+    ArrayRef<std::shared_ptr<const WriteOp>> Transaction(&*Begin, End - Begin);
+    for (auto &Op : Transaction) {
+      runWriteOp(Impl->Conn, *Op);
+    }
+    sync(Impl->Conn);
+    if (replayJournal(Impl->Conn, Transaction) != Recovery::Replayed) {
+      errs() << "Could not load fact file " << Path << '\n';
+      ++Impl->NumFailed;
+      return false;
+    }
+    ++Impl->NumTransactions;
+    Begin = End;
+  }
+  ++Impl->NumLoaded;
+  return true;
+}
+
+bool FactLoader::promote(uint32_t PackageID) {
+  std::vector<std::shared_ptr<const WriteOp>> Journal;
+  auto Begin = std::make_shared<WriteOp>();
+  Begin->Query = "BEGIN";
+  auto Promote = std::make_shared<WriteOp>();
+  Promote->Query = "SELECT promote_staged_package($1)";
+  Promote->Binaries.push_back(PackageID);
+  auto Commit = std::make_shared<WriteOp>();
+  Commit->Query = "COMMIT";
+  Journal.push_back(std::move(Begin));
+  Journal.push_back(std::move(Promote));
+  Journal.push_back(std::move(Commit));
+
+  for (auto &Op : Journal) {
+    runWriteOp(Impl->Conn, *Op);
+  }
+  sync(Impl->Conn);
+  if (replayJournal(Impl->Conn, Journal) != Recovery::Replayed) {
+    errs() << "Could not promote package " << PackageID << '\n';
+    ++Impl->NumFailed;
+    return false;
+  }
+  ++Impl->NumPromoted;
+  return true;
+}
+
+void FactLoader::printStatistics(raw_ostream &OS) const {
+  printStatements(OS, "Prepared statements", Impl->Conn);
+  OS << "Retried queries: " << Impl->Conn.NumRetries
+     << ", reconnects: " << Impl->Conn.NumReconnects << '\n';
+  OS << "Fact files loaded: " << Impl->NumLoaded
+     << ", failed: " << Impl->NumFailed
+     << ", transactions: " << Impl->NumTransactions
+     << ", packages promoted: " << Impl->NumPromoted << '\n';
+}
+
+}
+}
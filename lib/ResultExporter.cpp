@@ -0,0 +1,131 @@
+#include "Database.h"
+#include "Connection.h"
+
+#include <chrono>
+
+using namespace llvm;
+
+namespace clang {
+namespace immutability {
+
+struct ResultExporterImpl {
+  Connection Conn;
+  uint64_t NumMethods = 0;
+  uint64_t NumFields = 0;
+  unsigned NumPackages = 0;
+  unsigned NumFailed = 0;
+  std::chrono::steady_clock::duration Elapsed{};
+};
+
+namespace {
+
+uint32_t getBinary(const PGresult *R, int Row, int Field) {
+  return ntohl(*((const uint32_t *) PQgetvalue(R, Row, Field)));
+}
+
+bool getBool(const PGresult *R, int Row, int Field) {
+  return *PQgetvalue(R, Row, Field) != 0;
+}
+
+void writePath(raw_ostream &OS, const PGresult *R, int Row, int Field) {
+  StringRef Path(PQgetvalue(R, Row, Field), PQgetlength(R, Row, Field));
+  // Paths almost never need escaping, write them whole when they don't
+  if (Path.find_first_of("\t\n\\") == StringRef::npos) {
+    OS << Path;
+    return;
+  }
+  for (char C : Path) {
+    switch (C) {
+    case '\t':
+      OS << "\\t";
+      break;
+    case '\n':
+      OS << "\\n";
+      break;
+    case '\\':
+      OS << "\\\\";
+      break;
+    default:
+      OS << C;
+    }
+  }
+}
+
+}
+
+ResultExporter::ResultExporter(StringRef ConnInfo)
+    : Impl(llvm::make_unique<ResultExporterImpl>()) {
+  Impl->Conn.ConnInfo = ConnInfo.str();
+  connect(Impl->Conn);
+}
+
+ResultExporter::~ResultExporter() {
+  disconnect(Impl->Conn);
+}
+
+bool ResultExporter::exportPackage(uint32_t PackageID, raw_ostream &OS) {
+  auto Start = std::chrono::steady_clock::now();
+  Connection &Conn = Impl->Conn;
+  Params P;
+  CommandResult Begin(Conn, "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY", P);
+
+  P.addBinary(PackageID);
+  streamRows(Conn,
+             "SELECT decl.path, method.is_const, check_method.mutate_result, check_method.return_result "
+             "FROM cpp_doc_clang_immutability_check_method AS check_method "
+             "JOIN cpp_doc_decl AS decl ON decl.id = check_method.method_id "
+             "JOIN cpp_doc_method_decl AS method ON method.decl_id = check_method.method_id "
+             "WHERE decl.package_id = $1",
+             P, [this, &OS](const PGresult *R, int Row) {
+               OS << "M\t";
+               writePath(OS, R, Row, 0);
+               OS << '\t' << (getBool(R, Row, 1) ? '1' : '0')
+                  << '\t' << getBinary(R, Row, 2)
+                  << '\t' << getBinary(R, Row, 3) << '\n';
+               ++Impl->NumMethods;
+             });
+  streamRows(Conn,
+             "SELECT decl.path, check_field.is_explicit, check_field.is_transitive "
+             "FROM cpp_doc_clang_immutability_check_field AS check_field "
+             "JOIN cpp_doc_decl AS decl ON decl.id = check_field.field_id "
+             "WHERE decl.package_id = $1",
+             P, [this, &OS](const PGresult *R, int Row) {
+               OS << "F\t";
+               writePath(OS, R, Row, 0);
+               OS << '\t' << (getBool(R, Row, 1) ? '1' : '0')
+                  << '\t' << (getBool(R, Row, 2) ? '1' : '0') << '\n';
+               ++Impl->NumFields;
+             });
+
+  // Only read from, a failed snapshot is simply let go
+  bool Failed = static_cast<bool>(Conn.Error);
+  Conn.Error = QueryError();
+  P.clear();
+  CommandResult End(Conn, Failed ? "ROLLBACK" : "COMMIT", P);
+  Failed = Failed || static_cast<bool>(Conn.Error);
+  Conn.Error = QueryError();
+
+  Impl->Elapsed += std::chrono::steady_clock::now() - Start;
+  if (Failed) {
+    errs() << "Could not export package " << PackageID << '\n';
+    ++Impl->NumFailed;
+    return false;
+  }
+  ++Impl->NumPackages;
+  return true;
+}
+
+void ResultExporter::printStatistics(raw_ostream &OS) const {
+  double Seconds = std::chrono::duration<double>(Impl->Elapsed).count();
+  uint64_t NumRows = Impl->NumMethods + Impl->NumFields;
+  OS << "Packages exported: " << Impl->NumPackages
+     << ", failed: " << Impl->NumFailed << '\n';
+  OS << "Method checks: " << Impl->NumMethods
+     << ", field checks: " << Impl->NumFields << '\n';
+  OS << "Rows per second: "
+     << (Seconds > 0 ? static_cast<uint64_t>(NumRows / Seconds) : NumRows)
+     << '\n';
+}
+
+}
+}
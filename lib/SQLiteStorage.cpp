@@ -0,0 +1,511 @@
+#include "Storage.h"
+
+#include <algorithm>
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/Support/ErrorHandling.h>
+
+#include <sqlite3.h>
+
+using namespace llvm;
+
+namespace clang {
+namespace immutability {
+
+namespace {
+
+// The tables of the database the results are read from, keyed the same way.
+// Decl keys are stored as signed 64-bit integers like bigint.
+const char *Schema =
+  "CREATE TABLE IF NOT EXISTS cpp_doc_package "
+  "(id INTEGER PRIMARY KEY, source_directory TEXT NOT NULL UNIQUE);"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_file_descriptor "
+  "(id INTEGER PRIMARY KEY, package_id INTEGER NOT NULL, parent_id INTEGER, "
+  "name TEXT NOT NULL, path TEXT NOT NULL, UNIQUE (package_id, path));"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_presumed_loc "
+  "(id INTEGER PRIMARY KEY, file_id INTEGER NOT NULL, line INTEGER NOT NULL, "
+  "col INTEGER NOT NULL, UNIQUE (file_id, line, col));"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_decl "
+  "(id INTEGER PRIMARY KEY, package_id INTEGER NOT NULL, parent_id INTEGER, "
+  "name TEXT NOT NULL, path TEXT NOT NULL, presumed_loc_id INTEGER, "
+  "decl_key INTEGER NOT NULL, UNIQUE (package_id, decl_key));"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_record_decl "
+  "(decl_id INTEGER PRIMARY KEY, is_abstract INTEGER NOT NULL, "
+  "is_dependent INTEGER NOT NULL);"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_namespace_decl "
+  "(decl_id INTEGER PRIMARY KEY);"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_field_decl "
+  "(decl_id INTEGER PRIMARY KEY, is_mutable INTEGER NOT NULL, "
+  "access INTEGER NOT NULL);"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_method_decl "
+  "(decl_id INTEGER PRIMARY KEY, mangled_name TEXT NOT NULL, "
+  "is_const INTEGER NOT NULL, is_pure INTEGER NOT NULL, access INTEGER NOT NULL);"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_function_decl "
+  "(decl_id INTEGER PRIMARY KEY);"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_clang_immutability_check_method "
+  "(method_id INTEGER PRIMARY KEY, mutate_result INTEGER NOT NULL, "
+  "return_result INTEGER NOT NULL);"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_clang_immutability_check_field "
+  "(field_id INTEGER PRIMARY KEY, is_explicit INTEGER NOT NULL, "
+  "is_transitive INTEGER NOT NULL);"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_public_view "
+  "(record_id INTEGER NOT NULL, decl_id INTEGER NOT NULL, "
+  "PRIMARY KEY (record_id, decl_id));"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_public_base "
+  "(record_id INTEGER NOT NULL, base_id INTEGER NOT NULL, "
+  "PRIMARY KEY (record_id, base_id));"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_public_override "
+  "(method_id INTEGER NOT NULL, overridden_id INTEGER NOT NULL, "
+  "PRIMARY KEY (method_id, overridden_id));"
+  // Compile commands are numbered by their position in the JSON compilation
+  // database
+  "CREATE TABLE IF NOT EXISTS cpp_doc_checked_compile_command "
+  "(package_id INTEGER NOT NULL, compile_command_id INTEGER NOT NULL, "
+  "PRIMARY KEY (package_id, compile_command_id));"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_compile_command_input "
+  "(package_id INTEGER NOT NULL, compile_command_id INTEGER NOT NULL, "
+  "path TEXT NOT NULL, content_hash INTEGER NOT NULL, "
+  "PRIMARY KEY (package_id, compile_command_id, path));"
+  "CREATE TABLE IF NOT EXISTS cpp_doc_immutability_method_dependence "
+  "(method_id INTEGER NOT NULL, callee_id INTEGER NOT NULL, "
+  "PRIMARY KEY (method_id, callee_id));"
+  // The same expansion of inherited members as the database's
+  "CREATE VIEW IF NOT EXISTS cpp_doc_inherited_public_view AS "
+  "WITH RECURSIVE ancestor (record_id, base_id) AS ("
+  "SELECT record_id, record_id FROM (SELECT record_id FROM cpp_doc_public_view "
+  "UNION SELECT record_id FROM cpp_doc_public_base) "
+  "UNION SELECT ancestor.record_id, base.base_id FROM ancestor "
+  "JOIN cpp_doc_public_base AS base ON base.record_id = ancestor.base_id) "
+  "SELECT DISTINCT ancestor.record_id, member.decl_id FROM ancestor "
+  "JOIN cpp_doc_record_decl AS record ON record.decl_id = ancestor.record_id "
+  "JOIN cpp_doc_public_view AS member ON member.record_id = ancestor.base_id "
+  "WHERE NOT record.is_abstract AND NOT record.is_dependent AND NOT EXISTS ("
+  "SELECT 1 FROM ancestor AS other "
+  "JOIN cpp_doc_public_view AS other_member ON other_member.record_id = other.base_id "
+  "JOIN cpp_doc_public_override AS override ON override.method_id = other_member.decl_id "
+  "WHERE other.record_id = ancestor.record_id AND override.overridden_id = member.decl_id);";
+
+struct SQLiteStatement {
+  sqlite3_stmt *Handle = nullptr;
+  unsigned NumExecutions = 0;
+};
+
+class SQLiteStorage : public Storage {
+public:
+  SQLiteStorage(StringRef Path, StringRef CompileCommands)
+      : CompileCommands(CompileCommands) {
+    std::string S = Path.str();
+    check(sqlite3_open(S.c_str(), &Handle), "sqlite3_open");
+    // Other processes may be writing to the same file
+    sqlite3_busy_timeout(Handle, 60000);
+    exec("PRAGMA journal_mode = WAL");
+    exec("PRAGMA synchronous = NORMAL");
+    exec(Schema);
+  }
+
+  ~SQLiteStorage() override {
+    for (auto &Entry : Statements) {
+      sqlite3_finalize(Entry.getValue().Handle);
+    }
+    sqlite3_close(Handle);
+  }
+
+  CompileCommandInfo getCompileCommandInfo(unsigned CompileCommandID) override {
+    CompileCommandInfo Info =
+      CompileCommands.getCompileCommandInfo(CompileCommandID);
+
+    exec("BEGIN IMMEDIATE");
+    sqlite3_stmt *Insert = prepare("INSERT INTO cpp_doc_package (source_directory) VALUES (?1) ON CONFLICT DO NOTHING");
+    bindText(Insert, 1, Info.SourceDirectory);
+    step(Insert);
+    sqlite3_stmt *Select = prepare("SELECT id FROM cpp_doc_package WHERE source_directory = ?1");
+    bindText(Select, 1, Info.SourceDirectory);
+    Info.PackageID = selectID(Select);
+
+    Insert = prepare("INSERT INTO cpp_doc_file_descriptor (package_id, parent_id, name, path) VALUES (?1, NULL, '', '') ON CONFLICT DO NOTHING");
+    sqlite3_bind_int(Insert, 1, Info.PackageID);
+    step(Insert);
+    Select = prepare("SELECT id FROM cpp_doc_file_descriptor WHERE package_id = ?1 AND path = ''");
+    sqlite3_bind_int(Select, 1, Info.PackageID);
+    Info.RootFileDescriptorID = selectID(Select);
+
+    Insert = prepare("INSERT INTO cpp_doc_decl (package_id, parent_id, name, path, presumed_loc_id, decl_key) VALUES (?1, NULL, '', '', NULL, 0) ON CONFLICT DO NOTHING");
+    sqlite3_bind_int(Insert, 1, Info.PackageID);
+    step(Insert);
+    Select = prepare("SELECT id FROM cpp_doc_decl WHERE package_id = ?1 AND decl_key = 0");
+    sqlite3_bind_int(Select, 1, Info.PackageID);
+    Info.RootDeclID = selectID(Select);
+    exec("COMMIT");
+    return Info;
+  }
+
+  void setCompileCommand(unsigned CompileCommandID,
+                         uint32_t PackageID) override {
+    this->CompileCommandID = CompileCommandID;
+    this->PackageID = PackageID;
+  }
+
+  std::vector<unsigned>
+  getPendingCompileCommands(uint32_t PackageID) override {
+    std::vector<unsigned> IDs;
+    for (unsigned ID : CompileCommands.getCompileCommandIDs()) {
+      sqlite3_stmt *Select = prepare("SELECT 1 FROM cpp_doc_checked_compile_command WHERE package_id = ?1 AND compile_command_id = ?2");
+      sqlite3_bind_int(Select, 1, PackageID);
+      sqlite3_bind_int(Select, 2, ID);
+      if (!step(Select)) {
+        IDs.push_back(ID);
+      }
+    }
+    return IDs;
+  }
+
+  std::vector<unsigned> getCompileCommands(uint32_t PackageID) override {
+    return CompileCommands.getCompileCommandIDs();
+  }
+
+  std::vector<InputFile>
+  getCompileCommandInputs(unsigned CompileCommandID,
+                          uint32_t PackageID) override {
+    sqlite3_stmt *Select = prepare("SELECT path, content_hash FROM cpp_doc_compile_command_input WHERE package_id = ?1 AND compile_command_id = ?2");
+    sqlite3_bind_int(Select, 1, PackageID);
+    sqlite3_bind_int(Select, 2, CompileCommandID);
+    std::vector<InputFile> Inputs;
+    while (step(Select)) {
+      InputFile Input;
+      Input.Path = reinterpret_cast<const char *>(sqlite3_column_text(Select, 0));
+      Input.Hash = sqlite3_column_int64(Select, 1);
+      Inputs.push_back(std::move(Input));
+    }
+    return Inputs;
+  }
+
+  void setCompileCommandInputs(std::vector<InputFile> Inputs) override {
+    UnitInputs = std::move(Inputs);
+  }
+
+  void getFileDescriptors(uint32_t PackageID,
+                          StringMap<uint32_t> &Found) override {
+    sqlite3_stmt *Select = prepare("SELECT path, id FROM cpp_doc_file_descriptor WHERE package_id = ?1");
+    sqlite3_bind_int(Select, 1, PackageID);
+    while (step(Select)) {
+      StringRef Path(reinterpret_cast<const char *>(sqlite3_column_text(Select, 0)),
+                     sqlite3_column_bytes(Select, 0));
+      Found[Path] = sqlite3_column_int(Select, 1);
+    }
+  }
+
+  void getDeclIndex(uint32_t PackageID,
+                    DenseMap<uint64_t, KnownDecl> &Found) override {
+    sqlite3_stmt *Select = prepare(
+      "SELECT decl.decl_key, coalesce(decl.presumed_loc_id, 0), "
+      "EXISTS (SELECT 1 FROM cpp_doc_record_decl WHERE decl_id = decl.id) "
+      "OR EXISTS (SELECT 1 FROM cpp_doc_namespace_decl WHERE decl_id = decl.id) "
+      "OR EXISTS (SELECT 1 FROM cpp_doc_field_decl WHERE decl_id = decl.id) "
+      "OR EXISTS (SELECT 1 FROM cpp_doc_method_decl WHERE decl_id = decl.id) "
+      "OR EXISTS (SELECT 1 FROM cpp_doc_function_decl WHERE decl_id = decl.id), "
+      "EXISTS (SELECT 1 FROM cpp_doc_clang_immutability_check_method WHERE method_id = decl.id) "
+      "FROM cpp_doc_decl AS decl WHERE decl.package_id = ?1");
+    sqlite3_bind_int(Select, 1, PackageID);
+    while (step(Select)) {
+      KnownDecl &Known = Found[sqlite3_column_int64(Select, 0)];
+      Known.PresumedLocID = sqlite3_column_int(Select, 1);
+      Known.HasKind = sqlite3_column_int(Select, 2);
+      Known.IsChecked = sqlite3_column_int(Select, 3);
+    }
+  }
+
+  std::vector<uint32_t>
+  createFileDescriptors(uint32_t PackageID, uint32_t ParentID,
+                        StringRef ParentPath,
+                        ArrayRef<std::string> Names) override {
+    std::vector<uint32_t> IDs;
+    std::string Path = ParentPath.str();
+    exec("BEGIN IMMEDIATE");
+    for (auto &Name : Names) {
+      if (!Path.empty()) {
+        Path += '/';
+      }
+      Path += Name;
+      sqlite3_stmt *Insert = prepare("INSERT INTO cpp_doc_file_descriptor (package_id, parent_id, name, path) VALUES (?1, ?2, ?3, ?4) ON CONFLICT DO NOTHING");
+      sqlite3_bind_int(Insert, 1, PackageID);
+      sqlite3_bind_int(Insert, 2, ParentID);
+      bindText(Insert, 3, Name);
+      bindText(Insert, 4, Path);
+      step(Insert);
+      sqlite3_stmt *Select = prepare("SELECT id FROM cpp_doc_file_descriptor WHERE package_id = ?1 AND path = ?2");
+      sqlite3_bind_int(Select, 1, PackageID);
+      bindText(Select, 2, Path);
+      ParentID = selectID(Select);
+      IDs.push_back(ParentID);
+    }
+    exec("COMMIT");
+    return IDs;
+  }
+
+  std::vector<uint32_t> getPresumedLocs(ArrayRef<uint32_t> FileIDs,
+                                        ArrayRef<uint32_t> Lines,
+                                        ArrayRef<uint32_t> Columns) override {
+    std::vector<uint32_t> IDs;
+    exec("BEGIN IMMEDIATE");
+    for (size_t i = 0; i < FileIDs.size(); ++i) {
+      sqlite3_stmt *Insert = prepare("INSERT INTO cpp_doc_presumed_loc (file_id, line, col) VALUES (?1, ?2, ?3) ON CONFLICT DO NOTHING");
+      sqlite3_bind_int(Insert, 1, FileIDs[i]);
+      sqlite3_bind_int(Insert, 2, Lines[i]);
+      sqlite3_bind_int(Insert, 3, Columns[i]);
+      step(Insert);
+      sqlite3_stmt *Select = prepare("SELECT id FROM cpp_doc_presumed_loc WHERE file_id = ?1 AND line = ?2 AND col = ?3");
+      sqlite3_bind_int(Select, 1, FileIDs[i]);
+      sqlite3_bind_int(Select, 2, Lines[i]);
+      sqlite3_bind_int(Select, 3, Columns[i]);
+      IDs.push_back(selectID(Select));
+    }
+    exec("COMMIT");
+    return IDs;
+  }
+
+  // Writes are held until the unit commits, so lookups never run inside of
+  // its transaction
+  void beginUnit() override {
+    Unit.clear();
+    UnitInputs.clear();
+  }
+
+  void commitUnit() override {
+    exec("BEGIN IMMEDIATE");
+    for (FactBatch &Batch : Unit) {
+      apply(Batch);
+    }
+    sqlite3_stmt *Insert = prepare("INSERT INTO cpp_doc_checked_compile_command (package_id, compile_command_id) VALUES (?1, ?2) ON CONFLICT DO NOTHING");
+    sqlite3_bind_int(Insert, 1, PackageID);
+    sqlite3_bind_int(Insert, 2, CompileCommandID);
+    step(Insert);
+    sqlite3_stmt *Delete = prepare("DELETE FROM cpp_doc_compile_command_input WHERE package_id = ?1 AND compile_command_id = ?2");
+    sqlite3_bind_int(Delete, 1, PackageID);
+    sqlite3_bind_int(Delete, 2, CompileCommandID);
+    step(Delete);
+    for (InputFile &Input : UnitInputs) {
+      Insert = prepare("INSERT INTO cpp_doc_compile_command_input (package_id, compile_command_id, path, content_hash) VALUES (?1, ?2, ?3, ?4)");
+      sqlite3_bind_int(Insert, 1, PackageID);
+      sqlite3_bind_int(Insert, 2, CompileCommandID);
+      bindText(Insert, 3, Input.Path);
+      sqlite3_bind_int64(Insert, 4, Input.Hash);
+      step(Insert);
+    }
+    exec("COMMIT");
+    Unit.clear();
+    UnitInputs.clear();
+    ++NumUnits;
+  }
+
+  void rollbackUnit() override {
+    Unit.clear();
+    UnitInputs.clear();
+  }
+
+  void write(uint32_t PackageID, FactBatch &Batch) override {
+    this->PackageID = PackageID;
+    Unit.emplace_back();
+    std::swap(Unit.back(), Batch);
+  }
+
+  // Everything is merged at once when the unit commits
+  void merge(uint32_t PackageID) override {}
+
+  void printStatistics(raw_ostream &OS) const override {
+    std::vector<std::pair<StringRef, unsigned>> Executions;
+    for (auto &Entry : Statements) {
+      Executions.emplace_back(Entry.getKey(), Entry.getValue().NumExecutions);
+    }
+    std::sort(Executions.begin(), Executions.end(),
+              [](const std::pair<StringRef, unsigned> &A,
+                 const std::pair<StringRef, unsigned> &B) {
+                return A.second > B.second;
+              });
+    OS << "SQLite statements (executions, query):\n";
+    for (auto &Statement : Executions) {
+      OS << "  " << Statement.second << '\t' << Statement.first << '\n';
+    }
+    OS << "SQLite units committed: " << NumUnits << '\n';
+  }
+
+private:
+  // Mirrors merge_staged_decls and merge_staged_results
+  void apply(FactBatch &Batch) {
+    // A parent has to exist before its children
+    std::stable_sort(Batch.Decls.begin(), Batch.Decls.end(),
+                     [](const StagedDecl &A, const StagedDecl &B) {
+                       return A.Depth < B.Depth;
+                     });
+    for (StagedDecl &Staged : Batch.Decls) {
+      sqlite3_stmt *Insert = prepare(
+        "INSERT INTO cpp_doc_decl (package_id, parent_id, name, path, presumed_loc_id, decl_key) "
+        "SELECT ?1, parent.id, ?2, ?3, ?4, ?5 FROM cpp_doc_decl AS parent "
+        "WHERE parent.package_id = ?1 AND parent.decl_key = ?6 "
+        "ON CONFLICT (package_id, decl_key) DO UPDATE "
+        "SET presumed_loc_id = coalesce(excluded.presumed_loc_id, presumed_loc_id)");
+      sqlite3_bind_int(Insert, 1, PackageID);
+      bindText(Insert, 2, Staged.Name);
+      bindText(Insert, 3, Staged.Path);
+      if (Staged.PresumedLocID != 0) {
+        sqlite3_bind_int(Insert, 4, Staged.PresumedLocID);
+      }
+      else {
+        sqlite3_bind_null(Insert, 4);
+      }
+      sqlite3_bind_int64(Insert, 5, Staged.Key);
+      sqlite3_bind_int64(Insert, 6, Staged.ParentKey);
+      step(Insert);
+
+      sqlite3_stmt *Kind = nullptr;
+      switch (Staged.Kind) {
+      case DeclKind::Record:
+        Kind = prepare("INSERT INTO cpp_doc_record_decl (decl_id, is_abstract, is_dependent) SELECT id, ?3, ?4 FROM cpp_doc_decl WHERE package_id = ?1 AND decl_key = ?2 ON CONFLICT DO NOTHING");
+        sqlite3_bind_int(Kind, 3, Staged.IsAbstract);
+        sqlite3_bind_int(Kind, 4, Staged.IsDependent);
+        break;
+      case DeclKind::Namespace:
+        Kind = prepare("INSERT INTO cpp_doc_namespace_decl (decl_id) SELECT id FROM cpp_doc_decl WHERE package_id = ?1 AND decl_key = ?2 ON CONFLICT DO NOTHING");
+        break;
+      case DeclKind::Field:
+        Kind = prepare("INSERT INTO cpp_doc_field_decl (decl_id, is_mutable, access) SELECT id, ?3, ?4 FROM cpp_doc_decl WHERE package_id = ?1 AND decl_key = ?2 ON CONFLICT DO NOTHING");
+        sqlite3_bind_int(Kind, 3, Staged.IsMutable);
+        sqlite3_bind_int(Kind, 4, Staged.Access);
+        break;
+      case DeclKind::Method:
+        Kind = prepare("INSERT INTO cpp_doc_method_decl (decl_id, mangled_name, is_const, is_pure, access) SELECT id, ?3, ?4, ?5, ?6 FROM cpp_doc_decl WHERE package_id = ?1 AND decl_key = ?2 ON CONFLICT DO NOTHING");
+        bindText(Kind, 3, Staged.MangledName);
+        sqlite3_bind_int(Kind, 4, Staged.IsConst);
+        sqlite3_bind_int(Kind, 5, Staged.IsPure);
+        sqlite3_bind_int(Kind, 6, Staged.Access);
+        break;
+      case DeclKind::Function:
+        Kind = prepare("INSERT INTO cpp_doc_function_decl (decl_id) SELECT id FROM cpp_doc_decl WHERE package_id = ?1 AND decl_key = ?2 ON CONFLICT DO NOTHING");
+        break;
+      case DeclKind::Other:
+        break;
+      }
+      if (Kind) {
+        sqlite3_bind_int(Kind, 1, PackageID);
+        sqlite3_bind_int64(Kind, 2, Staged.Key);
+        step(Kind);
+      }
+    }
+
+    for (auto &Check : Batch.MethodChecks) {
+      sqlite3_stmt *Insert = prepare("INSERT INTO cpp_doc_clang_immutability_check_method (method_id, mutate_result, return_result) SELECT id, ?3, ?4 FROM cpp_doc_decl WHERE package_id = ?1 AND decl_key = ?2 ON CONFLICT (method_id) DO UPDATE SET mutate_result = excluded.mutate_result, return_result = excluded.return_result");
+      sqlite3_bind_int(Insert, 1, PackageID);
+      sqlite3_bind_int64(Insert, 2, Check.first);
+      sqlite3_bind_int(Insert, 3, static_cast<int>(Check.second.mutateResult));
+      sqlite3_bind_int(Insert, 4, static_cast<int>(Check.second.returnResult));
+      step(Insert);
+    }
+
+    for (auto &Check : Batch.FieldChecks) {
+      sqlite3_stmt *Insert = prepare("INSERT INTO cpp_doc_clang_immutability_check_field (field_id, is_explicit, is_transitive) SELECT id, ?3, ?4 FROM cpp_doc_decl WHERE package_id = ?1 AND decl_key = ?2 ON CONFLICT (field_id) DO UPDATE SET is_explicit = excluded.is_explicit, is_transitive = excluded.is_transitive");
+      sqlite3_bind_int(Insert, 1, PackageID);
+      sqlite3_bind_int64(Insert, 2, std::get<0>(Check));
+      sqlite3_bind_int(Insert, 3, std::get<1>(Check));
+      sqlite3_bind_int(Insert, 4, std::get<2>(Check));
+      step(Insert);
+    }
+
+    for (auto &View : Batch.PublicViews) {
+      sqlite3_stmt *Insert = prepare("INSERT INTO cpp_doc_public_view (record_id, decl_id) SELECT record.id, decl.id FROM cpp_doc_decl AS record, cpp_doc_decl AS decl WHERE record.package_id = ?1 AND record.decl_key = ?2 AND decl.package_id = ?1 AND decl.decl_key = ?3 ON CONFLICT DO NOTHING");
+      sqlite3_bind_int(Insert, 1, PackageID);
+      sqlite3_bind_int64(Insert, 2, View.first);
+      sqlite3_bind_int64(Insert, 3, View.second);
+      step(Insert);
+    }
+
+    for (auto &Base : Batch.PublicBases) {
+      sqlite3_stmt *Insert = prepare("INSERT INTO cpp_doc_public_base (record_id, base_id) SELECT record.id, base.id FROM cpp_doc_decl AS record, cpp_doc_decl AS base WHERE record.package_id = ?1 AND record.decl_key = ?2 AND base.package_id = ?1 AND base.decl_key = ?3 ON CONFLICT DO NOTHING");
+      sqlite3_bind_int(Insert, 1, PackageID);
+      sqlite3_bind_int64(Insert, 2, Base.first);
+      sqlite3_bind_int64(Insert, 3, Base.second);
+      step(Insert);
+    }
+
+    for (auto &Override : Batch.PublicOverrides) {
+      sqlite3_stmt *Insert = prepare("INSERT INTO cpp_doc_public_override (method_id, overridden_id) SELECT method.id, overridden.id FROM cpp_doc_decl AS method, cpp_doc_decl AS overridden WHERE method.package_id = ?1 AND method.decl_key = ?2 AND overridden.package_id = ?1 AND overridden.decl_key = ?3 ON CONFLICT DO NOTHING");
+      sqlite3_bind_int(Insert, 1, PackageID);
+      sqlite3_bind_int64(Insert, 2, Override.first);
+      sqlite3_bind_int64(Insert, 3, Override.second);
+      step(Insert);
+    }
+
+    for (auto &Dependence : Batch.MethodDependences) {
+      sqlite3_stmt *Insert = prepare("INSERT INTO cpp_doc_immutability_method_dependence (method_id, callee_id) SELECT method.id, callee.id FROM cpp_doc_decl AS method, cpp_doc_decl AS callee WHERE method.package_id = ?1 AND method.decl_key = ?2 AND callee.package_id = ?1 AND callee.decl_key = ?3 ON CONFLICT DO NOTHING");
+      sqlite3_bind_int(Insert, 1, PackageID);
+      sqlite3_bind_int64(Insert, 2, Dependence.first);
+      sqlite3_bind_int64(Insert, 3, Dependence.second);
+      step(Insert);
+    }
+  }
+
+  // SQLite is a local file, any error is one we can't recover from
+  void check(int Result, StringRef What) {
+    if (Result == SQLITE_OK || Result == SQLITE_ROW || Result == SQLITE_DONE) {
+      return;
+    }
+    errs() << What << ": " << sqlite3_errmsg(Handle) << '\n';
+    report_fatal_error("SQLite query failed");
+  }
+
+  void exec(const char *Q) {
+    check(sqlite3_exec(Handle, Q, nullptr, nullptr, nullptr), Q);
+  }
+
+  // Every distinct query is prepared once, keyed by its text
+  sqlite3_stmt *prepare(const char *Q) {
+    SQLiteStatement &Statement = Statements[Q];
+    ++Statement.NumExecutions;
+    if (Statement.Handle == nullptr) {
+      check(sqlite3_prepare_v2(Handle, Q, -1, &Statement.Handle, nullptr), Q);
+    }
+    else {
+      sqlite3_reset(Statement.Handle);
+      sqlite3_clear_bindings(Statement.Handle);
+    }
+    return Statement.Handle;
+  }
+
+  // Returns true while there are rows
+  bool step(sqlite3_stmt *Statement) {
+    int Result = sqlite3_step(Statement);
+    check(Result, sqlite3_sql(Statement));
+    return Result == SQLITE_ROW;
+  }
+
+  uint32_t selectID(sqlite3_stmt *Select) {
+    if (!step(Select)) {
+      report_fatal_error("SQLite lookup found nothing");
+    }
+    return sqlite3_column_int(Select, 0);
+  }
+
+  void bindText(sqlite3_stmt *Statement, int Index, const std::string &Text) {
+    sqlite3_bind_text(Statement, Index, Text.data(), Text.size(),
+                      SQLITE_TRANSIENT);
+  }
+
+  LocalCompileCommands CompileCommands;
+  sqlite3 *Handle = nullptr;
+  StringMap<SQLiteStatement> Statements;
+  unsigned CompileCommandID = 0;
+  uint32_t PackageID = 0;
+
+  // Rows of the current unit of work
+  std::vector<FactBatch> Unit;
+  std::vector<InputFile> UnitInputs;
+  unsigned NumUnits = 0;
+};
+
+}
+
+std::unique_ptr<Storage> createSQLiteStorage(StringRef Path,
+                                             StringRef CompileCommands) {
+  return llvm::make_unique<SQLiteStorage>(Path, CompileCommands);
+}
+
+}
+}
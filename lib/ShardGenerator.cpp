@@ -0,0 +1,628 @@
+#include "Database.h"
+#include "Connection.h"
+#include "FNV.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+
+using namespace llvm;
+
+namespace clang {
+namespace immutability {
+
+namespace {
+
+struct ShardMember {
+  std::string Name;
+  std::string Path;
+  bool IsMethod = false;
+  // Whether a method is const or a field is mutable
+  bool Qualified = false;
+  uint32_t Access = 0;
+  bool IsChecked = false;
+  // The mutate and return results of a method, or whether a field is
+  // explicit and transitive
+  uint32_t First = 0;
+  uint32_t Second = 0;
+};
+
+struct ShardNode {
+  uint32_t ID = 0;
+  uint32_t ParentID = 0;
+  bool HasParent = false;
+  std::string Name;
+  std::string Path;
+  bool IsRecord = false;
+  bool IsAbstract = false;
+  bool IsDependent = false;
+  std::vector<const ShardNode *> Children;
+  std::vector<ShardMember> Members;
+};
+
+// A shard written by an earlier run, along with the hash of its contents
+struct ShardEntry {
+  std::string FileName;
+  uint64_t Hash;
+};
+
+uint32_t getBinary(const PGresult *R, int Row, int Field) {
+  return ntohl(*((const uint32_t *) PQgetvalue(R, Row, Field)));
+}
+
+bool getBool(const PGresult *R, int Row, int Field) {
+  return *PQgetvalue(R, Row, Field) != 0;
+}
+
+std::string getText(const PGresult *R, int Row, int Field) {
+  return std::string(PQgetvalue(R, Row, Field), PQgetlength(R, Row, Field));
+}
+
+void writeString(raw_ostream &OS, StringRef S) {
+  OS << '"';
+  for (char C : S) {
+    switch (C) {
+    case '"':
+      OS << "\\\"";
+      break;
+    case '\\':
+      OS << "\\\\";
+      break;
+    case '\n':
+      OS << "\\n";
+      break;
+    case '\t':
+      OS << "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(C) < 0x20) {
+        OS << "\\u00";
+        OS.write_hex(static_cast<unsigned char>(C) >> 4);
+        OS.write_hex(C & 0xf);
+      }
+      else {
+        OS << C;
+      }
+    }
+  }
+  OS << '"';
+}
+
+const char *getMutateName(uint32_t Result) {
+  switch (static_cast<MutateResult>(Result)) {
+  case MutateResult::NO_MUTATION:
+    return "none";
+  case MutateResult::MAYBE_MUTATION:
+    return "maybe";
+  }
+  return "unknown";
+}
+
+const char *getReturnName(uint32_t Result) {
+  switch (static_cast<ReturnResult>(Result)) {
+  case ReturnResult::NOOP:
+    return "noop";
+  case ReturnResult::FIELD_TRANSITIVE:
+    return "field_transitive";
+  case ReturnResult::FIELD_NON_TRANSITIVE:
+    return "field_non_transitive";
+  case ReturnResult::OTHER:
+    return "other";
+  }
+  return "unknown";
+}
+
+std::string getShardFileName(const ShardNode &Node) {
+  return std::to_string(Node.ID) + ".json";
+}
+
+void writeNodeRef(raw_ostream &OS, const ShardNode &Node) {
+  OS << "{\"id\":" << Node.ID << ",\"kind\":"
+     << (Node.IsRecord ? "\"record\"" : "\"namespace\"") << ",\"name\":";
+  writeString(OS, Node.Name);
+  OS << ",\"path\":";
+  writeString(OS, Node.Path);
+  OS << '}';
+}
+
+// One line of JSON, the same node always renders the same bytes
+std::string renderShard(const ShardNode &Node) {
+  std::string Content;
+  raw_string_ostream OS(Content);
+  OS << "{\"id\":" << Node.ID;
+  if (Node.HasParent) {
+    OS << ",\"parent\":" << Node.ParentID;
+  }
+  OS << ",\"kind\":" << (Node.IsRecord ? "\"record\"" : "\"namespace\"")
+     << ",\"name\":";
+  writeString(OS, Node.Name);
+  OS << ",\"path\":";
+  writeString(OS, Node.Path);
+  if (Node.IsRecord) {
+    OS << ",\"abstract\":" << (Node.IsAbstract ? "true" : "false")
+       << ",\"dependent\":" << (Node.IsDependent ? "true" : "false");
+  }
+
+  OS << ",\"children\":[";
+  for (size_t i = 0; i < Node.Children.size(); ++i) {
+    if (i != 0) {
+      OS << ',';
+    }
+    writeNodeRef(OS, *Node.Children[i]);
+  }
+  for (bool Methods : {true, false}) {
+    OS << (Methods ? "],\"methods\":[" : "],\"fields\":[");
+    bool First = true;
+    for (const ShardMember &Member : Node.Members) {
+      if (Member.IsMethod != Methods) {
+        continue;
+      }
+      if (!First) {
+        OS << ',';
+      }
+      First = false;
+      OS << "{\"name\":";
+      writeString(OS, Member.Name);
+      OS << ",\"path\":";
+      writeString(OS, Member.Path);
+      OS << ",\"access\":" << Member.Access;
+      if (Methods) {
+        OS << ",\"const\":" << (Member.Qualified ? "true" : "false");
+        if (Member.IsChecked) {
+          OS << ",\"mutate\":\"" << getMutateName(Member.First)
+             << "\",\"return\":\"" << getReturnName(Member.Second) << '"';
+        }
+      }
+      else {
+        OS << ",\"mutable\":" << (Member.Qualified ? "true" : "false");
+        if (Member.IsChecked) {
+          OS << ",\"explicit\":" << (Member.First ? "true" : "false")
+             << ",\"transitive\":" << (Member.Second ? "true" : "false");
+        }
+      }
+      OS << '}';
+    }
+  }
+  OS << "]}\n";
+  return std::move(OS.str());
+}
+
+// Written next to the file and renamed over it, so the web server never
+// serves half a shard
+bool writeFileAtomically(StringRef Path, StringRef Content) {
+  std::string TempPath = (Path + ".tmp").str();
+  {
+    std::error_code EC;
+    raw_fd_ostream OS(TempPath, EC, sys::fs::OF_None);
+    if (EC) {
+      errs() << TempPath << ": " << EC.message() << '\n';
+      return false;
+    }
+    OS << Content;
+    OS.close();
+    if (OS.has_error()) {
+      errs() << TempPath << ": " << OS.error().message() << '\n';
+      OS.clear_error();
+      sys::fs::remove(TempPath);
+      return false;
+    }
+  }
+  if (std::error_code EC = sys::fs::rename(TempPath, Path)) {
+    errs() << Path << ": " << EC.message() << '\n';
+    sys::fs::remove(TempPath);
+    return false;
+  }
+  return true;
+}
+
+// Each line of the manifest is a file name and the hash of its contents
+StringMap<uint64_t> readManifest(StringRef Path) {
+  StringMap<uint64_t> Hashes;
+  auto Buffer = MemoryBuffer::getFile(Path);
+  if (!Buffer) {
+    return Hashes;
+  }
+  SmallVector<StringRef, 0> Lines;
+  (*Buffer)->getBuffer().split(Lines, '\n', -1, false);
+  for (StringRef Line : Lines) {
+    std::pair<StringRef, StringRef> Fields = Line.split(' ');
+    uint64_t Hash;
+    if (!Fields.second.getAsInteger(16, Hash)) {
+      Hashes[Fields.first] = Hash;
+    }
+  }
+  return Hashes;
+}
+
+}
+
+struct ShardGeneratorImpl {
+  Connection Conn;
+  unsigned NumJobs;
+  unsigned NumPackages = 0;
+  unsigned NumFailed = 0;
+  std::atomic<uint64_t> NumWritten{0};
+  std::atomic<uint64_t> NumUnchanged{0};
+  uint64_t NumRemoved = 0;
+
+  bool read(uint32_t PackageID, std::unordered_map<uint32_t, ShardNode> &Nodes);
+  // Renders every shard below the node, and the node itself. Only shards
+  // whose contents changed since the last run are written.
+  bool writeSubtree(const ShardNode &Root, bool Recursive,
+                    StringRef Directory,
+                    const StringMap<uint64_t> &OldHashes,
+                    std::vector<ShardEntry> &Entries);
+};
+
+bool ShardGeneratorImpl::read(uint32_t PackageID,
+                              std::unordered_map<uint32_t, ShardNode> &Nodes) {
+  Params P;
+  CommandResult Begin(Conn, "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY", P);
+
+  // The root decl has no parent, every shard hangs off of it
+  P.addBinary(PackageID);
+  streamRows(Conn,
+             "SELECT decl.id, decl.parent_id, decl.name, decl.path, record.decl_id IS NOT NULL, "
+             "COALESCE(record.is_abstract, false), COALESCE(record.is_dependent, false) "
+             "FROM cpp_doc_decl AS decl "
+             "LEFT JOIN cpp_doc_record_decl AS record ON record.decl_id = decl.id "
+             "WHERE decl.package_id = $1 AND (decl.parent_id IS NULL "
+             "OR record.decl_id IS NOT NULL "
+             "OR EXISTS (SELECT 1 FROM cpp_doc_namespace_decl WHERE decl_id = decl.id))",
+             P, [&Nodes](const PGresult *R, int Row) {
+               ShardNode &Node = Nodes[getBinary(R, Row, 0)];
+               Node.ID = getBinary(R, Row, 0);
+               Node.HasParent = !PQgetisnull(R, Row, 1);
+               if (Node.HasParent) {
+                 Node.ParentID = getBinary(R, Row, 1);
+               }
+               Node.Name = getText(R, Row, 2);
+               Node.Path = getText(R, Row, 3);
+               Node.IsRecord = getBool(R, Row, 4);
+               Node.IsAbstract = getBool(R, Row, 5);
+               Node.IsDependent = getBool(R, Row, 6);
+             });
+
+  // Members are only kept if their parent has a shard
+  auto AddMember = [&Nodes](const PGresult *R, int Row, bool IsMethod) {
+    auto Parent = Nodes.find(getBinary(R, Row, 0));
+    if (Parent == Nodes.end()) {
+      return;
+    }
+    Parent->second.Members.emplace_back();
+    ShardMember &Member = Parent->second.Members.back();
+    Member.Name = getText(R, Row, 1);
+    Member.Path = getText(R, Row, 2);
+    Member.IsMethod = IsMethod;
+    Member.Qualified = getBool(R, Row, 3);
+    Member.Access = getBinary(R, Row, 4);
+    Member.IsChecked = !PQgetisnull(R, Row, 5);
+    if (!Member.IsChecked) {
+      return;
+    }
+    if (IsMethod) {
+      Member.First = getBinary(R, Row, 5);
+      Member.Second = getBinary(R, Row, 6);
+    }
+    else {
+      Member.First = getBool(R, Row, 5);
+      Member.Second = getBool(R, Row, 6);
+    }
+  };
+  streamRows(Conn,
+             "SELECT decl.parent_id, decl.name, decl.path, method.is_const, method.access, "
+             "check_method.mutate_result, check_method.return_result "
+             "FROM cpp_doc_method_decl AS method "
+             "JOIN cpp_doc_decl AS decl ON decl.id = method.decl_id "
+             "LEFT JOIN cpp_doc_clang_immutability_check_method AS check_method ON check_method.method_id = method.decl_id "
+             "WHERE decl.package_id = $1",
+             P, [&AddMember](const PGresult *R, int Row) {
+               AddMember(R, Row, true);
+             });
+  streamRows(Conn,
+             "SELECT decl.parent_id, decl.name, decl.path, field.is_mutable, field.access, "
+             "check_field.is_explicit, check_field.is_transitive "
+             "FROM cpp_doc_field_decl AS field "
+             "JOIN cpp_doc_decl AS decl ON decl.id = field.decl_id "
+             "LEFT JOIN cpp_doc_clang_immutability_check_field AS check_field ON check_field.field_id = field.decl_id "
+             "WHERE decl.package_id = $1",
+             P, [&AddMember](const PGresult *R, int Row) {
+               AddMember(R, Row, false);
+             });
+
+  bool Failed = static_cast<bool>(Conn.Error);
+  Conn.Error = QueryError();
+  P.clear();
+  CommandResult End(Conn, Failed ? "ROLLBACK" : "COMMIT", P);
+  Failed = Failed || static_cast<bool>(Conn.Error);
+  Conn.Error = QueryError();
+  return !Failed;
+}
+
+bool ShardGeneratorImpl::writeSubtree(const ShardNode &Root, bool Recursive,
+                                      StringRef Directory,
+                                      const StringMap<uint64_t> &OldHashes,
+                                      std::vector<ShardEntry> &Entries) {
+  bool Written = true;
+  std::vector<const ShardNode *> Worklist = {&Root};
+  while (!Worklist.empty()) {
+    const ShardNode *Node = Worklist.back();
+    Worklist.pop_back();
+    if (Recursive) {
+      Worklist.insert(Worklist.end(), Node->Children.begin(),
+                      Node->Children.end());
+    }
+
+    std::string Content = renderShard(*Node);
+    ShardEntry Entry{getShardFileName(*Node), hashFNV(Content)};
+    SmallString<256> Path(Directory);
+    sys::path::append(Path, Entry.FileName);
+    auto Old = OldHashes.find(Entry.FileName);
+    if (Old != OldHashes.end() && Old->second == Entry.Hash
+        && sys::fs::exists(Path)) {
+      ++NumUnchanged;
+    }
+    else if (writeFileAtomically(Path, Content)) {
+      ++NumWritten;
+    }
+    else {
+      // The file of the last run stays along with its entry, the next run
+      // sees the hash differs and writes it again
+      Written = false;
+      if (Old == OldHashes.end()) {
+        continue;
+      }
+      Entry.Hash = Old->second;
+    }
+    Entries.push_back(std::move(Entry));
+  }
+  return Written;
+}
+
+ShardGenerator::ShardGenerator(StringRef ConnInfo, unsigned NumJobs)
+    : Impl(llvm::make_unique<ShardGeneratorImpl>()) {
+  Impl->Conn.ConnInfo = ConnInfo.str();
+  Impl->NumJobs = NumJobs != 0 ? NumJobs : std::thread::hardware_concurrency();
+  if (Impl->NumJobs == 0) {
+    Impl->NumJobs = 1;
+  }
+  connect(Impl->Conn);
+}
+
+ShardGenerator::~ShardGenerator() {
+  disconnect(Impl->Conn);
+}
+
+bool ShardGenerator::generate(uint32_t PackageID, StringRef OutputDirectory) {
+  std::unordered_map<uint32_t, ShardNode> Nodes;
+  if (!Impl->read(PackageID, Nodes)) {
+    errs() << "Could not read package " << PackageID << '\n';
+    ++Impl->NumFailed;
+    return false;
+  }
+
+  ShardNode *Root = nullptr;
+  for (auto &Entry : Nodes) {
+    ShardNode &Node = Entry.second;
+    if (!Node.HasParent) {
+      Root = &Node;
+    }
+  }
+  if (!Root) {
+    errs() << "Package " << PackageID << " has no root decl\n";
+    ++Impl->NumFailed;
+    return false;
+  }
+  for (auto &Entry : Nodes) {
+    ShardNode &Node = Entry.second;
+    if (&Node == Root) {
+      continue;
+    }
+    // Records local to a function have no shard for their parent, they're
+    // listed with the root instead
+    auto Parent = Nodes.find(Node.ParentID);
+    if (Parent == Nodes.end()) {
+      Node.ParentID = Root->ID;
+      Root->Children.push_back(&Node);
+    }
+    else {
+      Parent->second.Children.push_back(&Node);
+    }
+  }
+  // Rows come back in any order, sorting keeps unchanged shards byte for byte
+  // the same
+  for (auto &Entry : Nodes) {
+    ShardNode &Node = Entry.second;
+    std::sort(Node.Children.begin(), Node.Children.end(),
+              [](const ShardNode *A, const ShardNode *B) {
+                return std::tie(A->Path, A->ID) < std::tie(B->Path, B->ID);
+              });
+    std::sort(Node.Members.begin(), Node.Members.end(),
+              [](const ShardMember &A, const ShardMember &B) {
+                return std::tie(A.IsMethod, A.Path) < std::tie(B.IsMethod, B.Path);
+              });
+  }
+
+  SmallString<256> Directory(OutputDirectory);
+  sys::path::append(Directory, std::to_string(PackageID));
+  if (std::error_code EC = sys::fs::create_directories(Directory)) {
+    errs() << Directory << ": " << EC.message() << '\n';
+    ++Impl->NumFailed;
+    return false;
+  }
+  SmallString<256> ManifestPath(Directory);
+  sys::path::append(ManifestPath, "shards.manifest");
+  StringMap<uint64_t> OldHashes = readManifest(ManifestPath);
+
+  // The root's own shard is one task, each of its children's subtrees is
+  // another. Top-level namespaces are rendered and written in parallel.
+  std::vector<const ShardNode *> Tasks = {Root};
+  Tasks.insert(Tasks.end(), Root->Children.begin(), Root->Children.end());
+  std::vector<std::vector<ShardEntry>> Entries(Tasks.size());
+  std::atomic<size_t> NextTask{0};
+  std::atomic<bool> Written{true};
+  auto Work = [&]() {
+    for (size_t i = NextTask++; i < Tasks.size(); i = NextTask++) {
+      if (!Impl->writeSubtree(*Tasks[i], i != 0, Directory, OldHashes,
+                              Entries[i])) {
+        Written = false;
+      }
+    }
+  };
+  std::vector<std::thread> Threads;
+  unsigned NumThreads = std::min<size_t>(Impl->NumJobs, Tasks.size());
+  for (unsigned i = 1; i < NumThreads; ++i) {
+    Threads.emplace_back(Work);
+  }
+  Work();
+  for (std::thread &Thread : Threads) {
+    Thread.join();
+  }
+
+  // The index lists every shard, so a page finds its file without a query
+  std::string Index;
+  raw_string_ostream IndexOS(Index);
+  IndexOS << "{\"package\":" << PackageID << ",\"root\":" << Root->ID
+          << ",\"shards\":[";
+  std::vector<const ShardNode *> Sorted;
+  for (auto &Entry : Nodes) {
+    Sorted.push_back(&Entry.second);
+  }
+  std::sort(Sorted.begin(), Sorted.end(),
+            [](const ShardNode *A, const ShardNode *B) {
+              return A->ID < B->ID;
+            });
+  for (size_t i = 0; i < Sorted.size(); ++i) {
+    const ShardNode &Node = *Sorted[i];
+    if (i != 0) {
+      IndexOS << ',';
+    }
+    IndexOS << "{\"id\":" << Node.ID;
+    if (Node.HasParent) {
+      IndexOS << ",\"parent\":" << Node.ParentID;
+    }
+    IndexOS << ",\"kind\":" << (Node.IsRecord ? "\"record\"" : "\"namespace\"")
+            << ",\"path\":";
+    writeString(IndexOS, Node.Path);
+    IndexOS << ",\"file\":";
+    writeString(IndexOS, getShardFileName(Node));
+    IndexOS << '}';
+  }
+  IndexOS << "]}\n";
+  IndexOS.flush();
+  ShardEntry IndexEntry{"index.json", hashFNV(Index)};
+  SmallString<256> IndexPath(Directory);
+  sys::path::append(IndexPath, IndexEntry.FileName);
+  auto OldIndex = OldHashes.find(IndexEntry.FileName);
+  if (OldIndex == OldHashes.end() || OldIndex->second != IndexEntry.Hash
+      || !sys::fs::exists(IndexPath)) {
+    if (writeFileAtomically(IndexPath, Index)) {
+      ++Impl->NumWritten;
+    }
+    else {
+      Written = false;
+      if (OldIndex != OldHashes.end()) {
+        IndexEntry.Hash = OldIndex->second;
+      }
+      else {
+        IndexEntry.FileName.clear();
+      }
+    }
+  }
+  else {
+    ++Impl->NumUnchanged;
+  }
+
+  // Shards of decls that are gone are removed, then the manifest is replaced
+  StringMap<uint64_t> NewHashes;
+  if (!IndexEntry.FileName.empty()) {
+    NewHashes[IndexEntry.FileName] = IndexEntry.Hash;
+  }
+  for (auto &TaskEntries : Entries) {
+    for (ShardEntry &Entry : TaskEntries) {
+      NewHashes[Entry.FileName] = Entry.Hash;
+    }
+  }
+  for (auto &Old : OldHashes) {
+    if (NewHashes.count(Old.getKey())) {
+      continue;
+    }
+    SmallString<256> Path(Directory);
+    sys::path::append(Path, Old.getKey());
+    if (!sys::fs::remove(Path)) {
+      ++Impl->NumRemoved;
+    }
+  }
+  std::string Manifest;
+  raw_string_ostream ManifestOS(Manifest);
+  for (auto &Entry : NewHashes) {
+    ManifestOS << Entry.getKey() << ' ';
+    ManifestOS.write_hex(Entry.getValue());
+    ManifestOS << '\n';
+  }
+  ManifestOS.flush();
+  if (!writeFileAtomically(ManifestPath, Manifest)) {
+    Written = false;
+  }
+
+  if (!Written) {
+    ++Impl->NumFailed;
+    return false;
+  }
+  ++Impl->NumPackages;
+  return true;
+}
+
+bool ShardGenerator::writePackageIndex(StringRef OutputDirectory) {
+  // Every package directory with an index, whichever run generated it
+  std::vector<uint32_t> PackageIDs;
+  std::error_code EC;
+  for (sys::fs::directory_iterator It(OutputDirectory, EC), End;
+       It != End && !EC; It.increment(EC)) {
+    StringRef Name = sys::path::filename(It->path());
+    uint32_t PackageID;
+    SmallString<256> IndexPath(It->path());
+    sys::path::append(IndexPath, "index.json");
+    if (!Name.getAsInteger(10, PackageID) && sys::fs::exists(IndexPath)) {
+      PackageIDs.push_back(PackageID);
+    }
+  }
+  if (EC) {
+    errs() << OutputDirectory << ": " << EC.message() << '\n';
+    return false;
+  }
+  std::sort(PackageIDs.begin(), PackageIDs.end());
+
+  std::string Index;
+  raw_string_ostream OS(Index);
+  OS << "{\"packages\":[";
+  for (size_t i = 0; i < PackageIDs.size(); ++i) {
+    if (i != 0) {
+      OS << ',';
+    }
+    OS << PackageIDs[i];
+  }
+  OS << "]}\n";
+  OS.flush();
+  SmallString<256> Path(OutputDirectory);
+  sys::path::append(Path, "packages.json");
+  return writeFileAtomically(Path, Index);
+}
+
+void ShardGenerator::printStatistics(raw_ostream &OS) const {
+  OS << "Packages sharded: " << Impl->NumPackages
+     << ", failed: " << Impl->NumFailed << '\n';
+  OS << "Shards written: " << Impl->NumWritten
+     << ", unchanged: " << Impl->NumUnchanged
+     << ", removed: " << Impl->NumRemoved << '\n';
+}
+
+}
+}
@@ -0,0 +1,101 @@
+#include "Storage.h"
+
+#include <clang/Tooling/JSONCompilationDatabase.h>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+
+using namespace llvm;
+using namespace clang::tooling;
+
+namespace clang {
+namespace immutability {
+
+Storage::~Storage() = default;
+
+namespace {
+
+std::unique_ptr<JSONCompilationDatabase>
+loadCompileCommands(StringRef CompileCommands) {
+  std::string Error;
+  auto Commands = JSONCompilationDatabase::loadFromFile(
+    CompileCommands, Error, JSONCommandLineSyntax::AutoDetect);
+  if (!Commands) {
+    errs() << CompileCommands << ": " << Error << '\n';
+    report_fatal_error("Could not load the compile commands");
+  }
+  return Commands;
+}
+
+// Resolved like the paths of presumed locations, with a trailing slash
+std::string getRealDirectory(StringRef Path) {
+  SmallString<256> RealPath;
+  if (sys::fs::real_path(Path, RealPath)) {
+    RealPath = Path;
+  }
+  RealPath.push_back('/');
+  return RealPath.str().str();
+}
+
+}
+
+LocalCompileCommands::LocalCompileCommands(StringRef Path)
+    : Path(Path.str()) {
+  Commands = loadCompileCommands(Path)->getAllCompileCommands();
+  for (size_t i = 0; i < Commands.size(); ++i) {
+    SmallString<256> Source(Commands[i].Filename);
+    sys::fs::make_absolute(Commands[i].Directory, Source);
+    for (StringRef Parent : {StringRef(Commands[i].Directory),
+                             sys::path::parent_path(Source)}) {
+      std::string Directory = getRealDirectory(Parent);
+      if (i == 0 && SourceDirectory.empty()) {
+        SourceDirectory = Directory;
+        continue;
+      }
+      // Keep the longest prefix ending with a slash
+      size_t Common = 0;
+      for (size_t j = 0; j < SourceDirectory.size() && j < Directory.size()
+             && SourceDirectory[j] == Directory[j]; ++j) {
+        if (Directory[j] == '/') {
+          Common = j + 1;
+        }
+      }
+      SourceDirectory.resize(Common);
+    }
+  }
+}
+
+CompileCommandInfo
+LocalCompileCommands::getCompileCommandInfo(unsigned CompileCommandID) const {
+  if (CompileCommandID == 0 || CompileCommandID > Commands.size()) {
+    errs() << Path << " has " << Commands.size() << " compile commands\n";
+    report_fatal_error("No such compile command");
+  }
+
+  const CompileCommand &Command = Commands[CompileCommandID - 1];
+  SmallString<256> Source(Command.Filename);
+  sys::fs::make_absolute(Command.Directory, Source);
+
+  CompileCommandInfo Info;
+  Info.PackageID = 0;
+  Info.SourceDirectory = SourceDirectory;
+  Info.Source = Source.str().str();
+  Info.Directory = Command.Directory;
+  Info.CommandLine = Command.CommandLine;
+  Info.RootDeclID = 0;
+  Info.RootFileDescriptorID = 0;
+  return Info;
+}
+
+std::vector<unsigned> LocalCompileCommands::getCompileCommandIDs() const {
+  std::vector<unsigned> IDs(Commands.size());
+  for (size_t i = 0; i < IDs.size(); ++i) {
+    IDs[i] = i + 1;
+  }
+  return IDs;
+}
+
+}
+}
@@ -0,0 +1,77 @@
+#include "Writer.h"
+
+#include <chrono>
+
+namespace clang {
+namespace immutability {
+
+namespace {
+
+// Spin briefly, then sleep, so an idle side doesn't keep a core busy
+void backoff(unsigned &Attempts) {
+  if (Attempts < 64) {
+    std::this_thread::yield();
+  }
+  else {
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+  ++Attempts;
+}
+
+}
+
+Writer::Writer(llvm::StringRef ConnInfo) {
+  Conn.ConnInfo = ConnInfo.str();
+  connect(Conn);
+  enterPipelineMode(Conn);
+  Thread = std::thread(&Writer::run, this);
+}
+
+Writer::~Writer() {
+  submit([this](Connection &Conn) {
+    sync(Conn);
+    Done = true;
+  });
+  Thread.join();
+  disconnect(Conn);
+}
+
+void Writer::submit(Job J) {
+  ++NumJobs;
+  if (Queue.tryPush(J)) {
+    return;
+  }
+  ++NumStalls;
+  unsigned Attempts = 0;
+  do {
+    backoff(Attempts);
+  } while (!Queue.tryPush(J));
+}
+
+void Writer::wait() {
+  submit([](Connection &Conn) {
+    sync(Conn);
+  });
+  unsigned Attempts = 0;
+  while (NumCompleted.load(std::memory_order_acquire) != NumJobs) {
+    backoff(Attempts);
+  }
+}
+
+void Writer::run() {
+  Job J;
+  unsigned Attempts = 0;
+  while (!Done) {
+    if (!Queue.tryPop(J)) {
+      backoff(Attempts);
+      continue;
+    }
+    Attempts = 0;
+    J(Conn);
+    J = nullptr;
+    NumCompleted.fetch_add(1, std::memory_order_release);
+  }
+}
+
+}
+}
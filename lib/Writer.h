@@ -0,0 +1,89 @@
+#ifndef CLANG_IMMUTABILITY_CHECK_WRITER_H
+#define CLANG_IMMUTABILITY_CHECK_WRITER_H
+
+#include "Connection.h"
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <thread>
+
+namespace clang {
+namespace immutability {
+
+// A fixed size ring with one producer and one consumer. Each side only writes
+// its own index, so neither needs a lock.
+template <typename T, size_t Capacity>
+class BoundedQueue {
+  std::array<T, Capacity> Slots;
+  std::atomic<size_t> Head{0}; // Next slot to pop, written by the consumer
+  std::atomic<size_t> Tail{0}; // Next slot to push, written by the producer
+public:
+  bool tryPush(T &Value) {
+    size_t T0 = Tail.load(std::memory_order_relaxed);
+    if (T0 - Head.load(std::memory_order_acquire) == Capacity) {
+      return false;
+    }
+    Slots[T0 % Capacity] = std::move(Value);
+    Tail.store(T0 + 1, std::memory_order_release);
+    return true;
+  }
+  bool tryPop(T &Value) {
+    size_t H = Head.load(std::memory_order_relaxed);
+    if (H == Tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    Value = std::move(Slots[H % Capacity]);
+    Head.store(H + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+// Runs write-only work on its own connection in a background thread, so the
+// analysis doesn't wait on the server. Work is submitted by a single thread.
+//
+// Backpressure: submit() blocks while the queue is full, which bounds the
+// number of unwritten batches held in memory.
+class Writer {
+public:
+  typedef std::function<void(Connection &)> Job;
+
+  explicit Writer(llvm::StringRef ConnInfo);
+  ~Writer();
+  Writer(const Writer &) = delete;
+  Writer &operator=(const Writer &) = delete;
+
+  void submit(Job J);
+  // Flush barrier, returns once every job submitted so far has run and its
+  // results were read
+  void wait();
+
+  unsigned getNumJobs() const {
+    return NumJobs;
+  }
+  unsigned getNumStalls() const {
+    return NumStalls;
+  }
+  // Only safe to use while the writer is idle, after wait()
+  Connection &getConnection() {
+    return Conn;
+  }
+  const Connection &getConnection() const {
+    return Conn;
+  }
+private:
+  void run();
+
+  Connection Conn;
+  BoundedQueue<Job, 64> Queue;
+  std::atomic<unsigned> NumCompleted{0};
+  bool Done = false; // Only touched by the writer thread
+  unsigned NumJobs = 0;
+  unsigned NumStalls = 0;
+  std::thread Thread;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,46 @@
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Signals.h>
+
+#include "Database.h"
+
+using namespace clang::immutability;
+using namespace llvm;
+
+int main(int argc, const char **argv) {
+  llvm::sys::PrintStackTraceOnErrorSignal(argv[0]);
+
+  llvm::cl::OptionCategory Category("const-checker-load Options");
+  cl::list<std::string> FactFiles(
+      cl::Positional, cl::desc("<fact file>..."), cl::ZeroOrMore,
+      cl::cat(Category));
+  cl::list<unsigned> PromotedPackages(
+      "promote",
+      cl::desc("Publish the rows checkers staged with -unlogged-staging for "
+               "this package, after loading the fact files"),
+      cl::value_desc("package id"), cl::CommaSeparated, cl::cat(Category));
+  cl::opt<std::string> ConnInfo(
+      "conninfo", cl::desc("libpq connection string of the database"),
+      cl::init("dbname = cpp_doc"), cl::cat(Category));
+  cl::opt<bool> PrintStatistics(
+      "print-db-stats", cl::desc("Print database statement counters on exit"),
+      cl::cat(Category));
+  cl::HideUnrelatedOptions(Category);
+  cl::ParseCommandLineOptions(argc, argv);
+
+  int Ret = 0;
+  FactLoader Loader(ConnInfo);
+  for (auto &FactFile : FactFiles) {
+    if (!Loader.load(FactFile)) {
+      Ret = 1;
+    }
+  }
+  for (unsigned PackageID : PromotedPackages) {
+    if (!Loader.promote(PackageID)) {
+      Ret = 1;
+    }
+  }
+  if (PrintStatistics) {
+    Loader.printStatistics(llvm::errs());
+  }
+  return Ret;
+}
@@ -1,21 +1,133 @@
 CREATE UNIQUE INDEX cpp_doc_file_descriptor_package_id_parent_null_uniq ON cpp_doc_file_descriptor USING btree (package_id) WHERE parent_id IS NULL;
 CREATE UNIQUE INDEX cpp_doc_decl_package_id_parent_null_uniq ON cpp_doc_decl USING btree (package_id) WHERE parent_id IS NULL;
 
+-- Decl keys are computed by the checker from the package and path, the root
+-- decl of every package has key 0
+ALTER TABLE cpp_doc_decl ADD COLUMN IF NOT EXISTS decl_key bigint;
+UPDATE cpp_doc_decl SET decl_key = 0 WHERE parent_id IS NULL AND decl_key IS NULL;
+
+-- The merges and the decl index only ever look decls up by key, the index
+-- covers the columns they read so the heap isn't touched
+CREATE UNIQUE INDEX IF NOT EXISTS cpp_doc_decl_package_id_decl_key_covering ON cpp_doc_decl USING btree (package_id, decl_key) INCLUDE (id, presumed_loc_id);
+DROP INDEX IF EXISTS cpp_doc_decl_package_id_decl_key_uniq;
+-- Paths are only compared for equality, a hash index stores 4 bytes per row
+-- instead of up to 4096
+CREATE INDEX IF NOT EXISTS cpp_doc_decl_path_hash ON cpp_doc_decl USING hash (path);
+CREATE INDEX IF NOT EXISTS cpp_doc_file_descriptor_path_hash ON cpp_doc_file_descriptor USING hash (path);
+
+-- With unlogged staging the checker doesn't merge its rows at the end of
+-- every translation unit. They're copied into these tables instead, one
+-- UNLOGGED partition per package, and promote_staged_package publishes them
+-- once the package is done. Workers on different packages never touch the
+-- same table, and nothing is written to the WAL until the promotion. A crash
+-- empties unlogged tables, the packages that weren't promoted yet have to be
+-- checked again. The partitions have no indexes, they're only ever scanned
+-- whole.
+CREATE TABLE IF NOT EXISTS cpp_doc_shared_staging_decl (
+  package_id integer NOT NULL, depth integer, decl_key bigint, parent_key bigint,
+  name character varying(4096), path character varying(4096), presumed_loc_id integer
+) PARTITION BY LIST (package_id);
+CREATE TABLE IF NOT EXISTS cpp_doc_shared_staging_record_decl (
+  package_id integer NOT NULL, decl_key bigint, is_abstract boolean, is_dependent boolean
+) PARTITION BY LIST (package_id);
+CREATE TABLE IF NOT EXISTS cpp_doc_shared_staging_namespace_decl (
+  package_id integer NOT NULL, decl_key bigint
+) PARTITION BY LIST (package_id);
+CREATE TABLE IF NOT EXISTS cpp_doc_shared_staging_field_decl (
+  package_id integer NOT NULL, decl_key bigint, is_mutable boolean, access integer
+) PARTITION BY LIST (package_id);
+CREATE TABLE IF NOT EXISTS cpp_doc_shared_staging_method_decl (
+  package_id integer NOT NULL, decl_key bigint, mangled_name character varying(4096),
+  is_const boolean, is_pure boolean, access integer
+) PARTITION BY LIST (package_id);
+CREATE TABLE IF NOT EXISTS cpp_doc_shared_staging_function_decl (
+  package_id integer NOT NULL, decl_key bigint
+) PARTITION BY LIST (package_id);
+CREATE TABLE IF NOT EXISTS cpp_doc_shared_staging_check_method (
+  package_id integer NOT NULL, method_key bigint, mutate_result integer, return_result integer
+) PARTITION BY LIST (package_id);
+CREATE TABLE IF NOT EXISTS cpp_doc_shared_staging_check_field (
+  package_id integer NOT NULL, field_key bigint, is_explicit boolean, is_transitive boolean
+) PARTITION BY LIST (package_id);
+CREATE TABLE IF NOT EXISTS cpp_doc_shared_staging_public_view (
+  package_id integer NOT NULL, record_key bigint, decl_key bigint
+) PARTITION BY LIST (package_id);
+CREATE TABLE IF NOT EXISTS cpp_doc_shared_staging_public_base (
+  package_id integer NOT NULL, record_key bigint, base_key bigint
+) PARTITION BY LIST (package_id);
+CREATE TABLE IF NOT EXISTS cpp_doc_shared_staging_public_override (
+  package_id integer NOT NULL, method_key bigint, overridden_key bigint
+) PARTITION BY LIST (package_id);
+CREATE TABLE IF NOT EXISTS cpp_doc_shared_staging_method_dependence (
+  package_id integer NOT NULL, method_key bigint, callee_key bigint
+) PARTITION BY LIST (package_id);
+CREATE TABLE IF NOT EXISTS cpp_doc_shared_staging_compile_command_input (
+  package_id integer NOT NULL, compile_command_id integer, path text, content_hash bigint
+) PARTITION BY LIST (package_id);
+
+-- cpp_doc_public_view only holds the direct public members of each record.
+-- Inherited ones are found by following the public bases of a record, except
+-- for base methods hidden by a public method of the record or a closer base.
+CREATE TABLE IF NOT EXISTS cpp_doc_public_base (
+  record_id integer NOT NULL REFERENCES cpp_doc_decl (id),
+  base_id integer NOT NULL REFERENCES cpp_doc_decl (id),
+  PRIMARY KEY (record_id, base_id)
+);
+CREATE TABLE IF NOT EXISTS cpp_doc_public_override (
+  method_id integer NOT NULL REFERENCES cpp_doc_decl (id),
+  overridden_id integer NOT NULL REFERENCES cpp_doc_decl (id),
+  PRIMARY KEY (method_id, overridden_id)
+);
+
+-- Every public method and field of the records the checker analyzed, the
+-- same rows cpp_doc_public_view held when inherited members were copied into
+-- each derived record
+CREATE OR REPLACE VIEW cpp_doc_inherited_public_view AS
+WITH RECURSIVE ancestor (record_id, base_id) AS (
+  SELECT record_id, record_id
+  FROM (SELECT record_id FROM cpp_doc_public_view
+        UNION SELECT record_id FROM cpp_doc_public_base) AS record
+  UNION
+  SELECT ancestor.record_id, base.base_id
+  FROM ancestor
+  JOIN cpp_doc_public_base AS base ON base.record_id = ancestor.base_id
+)
+SELECT DISTINCT ancestor.record_id, member.decl_id
+FROM ancestor
+JOIN cpp_doc_record_decl AS record ON record.decl_id = ancestor.record_id
+JOIN cpp_doc_public_view AS member ON member.record_id = ancestor.base_id
+WHERE NOT record.is_abstract AND NOT record.is_dependent
+  AND NOT EXISTS (
+    SELECT 1
+    FROM ancestor AS other
+    JOIN cpp_doc_public_view AS other_member ON other_member.record_id = other.base_id
+    JOIN cpp_doc_public_override AS override ON override.method_id = other_member.decl_id
+    WHERE other.record_id = ancestor.record_id AND override.overridden_id = member.decl_id);
+
+-- The expansion stored for queries that can't afford the recursion, kept up
+-- to date with refresh_expanded_public_view
+CREATE MATERIALIZED VIEW IF NOT EXISTS cpp_doc_expanded_public_view AS
+SELECT record_id, decl_id FROM cpp_doc_inherited_public_view;
+CREATE UNIQUE INDEX IF NOT EXISTS cpp_doc_expanded_public_view_uniq ON cpp_doc_expanded_public_view USING btree (record_id, decl_id);
+
 CREATE OR REPLACE FUNCTION get_presumed_loc(p_file_id integer,
                                             p_line integer,
                                             p_col integer) RETURNS integer AS $$
 DECLARE
-  myrec cpp_doc_presumed_loc%ROWTYPE;
+  v_id integer;
 BEGIN
-  SELECT id INTO STRICT myrec FROM cpp_doc_presumed_loc WHERE file_id = p_file_id AND line = p_line AND col = p_col;
-  RETURN myrec.id;
-EXCEPTION
-  WHEN NO_DATA_FOUND THEN
-    INSERT INTO cpp_doc_presumed_loc (file_id, line, col) VALUES (p_file_id, p_line, p_col) ON CONFLICT DO NOTHING;
-    SELECT id INTO STRICT myrec FROM cpp_doc_presumed_loc WHERE file_id = p_file_id AND line = p_line AND col = p_col;
-    RETURN myrec.id;
-  WHEN TOO_MANY_ROWS THEN
-    RAISE EXCEPTION 'presumed_loc not unique';
+  -- Under READ COMMITTED each statement sees rows committed before it starts,
+  -- so a conflicting insert is visible to the next select
+  LOOP
+    SELECT id INTO v_id FROM cpp_doc_presumed_loc WHERE file_id = p_file_id AND line = p_line AND col = p_col;
+    IF FOUND THEN
+      RETURN v_id;
+    END IF;
+    INSERT INTO cpp_doc_presumed_loc (file_id, line, col) VALUES (p_file_id, p_line, p_col) ON CONFLICT DO NOTHING RETURNING id INTO v_id;
+    IF FOUND THEN
+      RETURN v_id;
+    END IF;
+  END LOOP;
 END;
 $$ LANGUAGE plpgsql;
 
@@ -24,68 +136,202 @@ CREATE OR REPLACE FUNCTION get_file_descriptor(p_package_id integer,
                                                p_name character varying (4096),
                                                p_path character varying(4096)) RETURNS integer AS $$
 DECLARE
-  myrec cpp_doc_file_descriptor%ROWTYPE;
+  v_id integer;
 BEGIN
-  SELECT id INTO STRICT myrec FROM cpp_doc_file_descriptor WHERE package_id = p_package_id AND parent_id = p_parent_id AND name = p_name;
-  RETURN myrec.id;
-EXCEPTION
-  WHEN NO_DATA_FOUND THEN
-    INSERT INTO cpp_doc_file_descriptor (package_id, parent_id, name, path) VALUES (p_package_id, p_parent_id, p_name, p_path) ON CONFLICT DO NOTHING;
-    SELECT id INTO STRICT myrec FROM cpp_doc_file_descriptor WHERE package_id = p_package_id AND parent_id = p_parent_id AND name = p_name;
-    RETURN myrec.id;
-  WHEN TOO_MANY_ROWS THEN
-    RAISE EXCEPTION 'file_descriptor not unique';
+  LOOP
+    SELECT id INTO v_id FROM cpp_doc_file_descriptor WHERE package_id = p_package_id AND parent_id = p_parent_id AND name = p_name;
+    IF FOUND THEN
+      RETURN v_id;
+    END IF;
+    INSERT INTO cpp_doc_file_descriptor (package_id, parent_id, name, path) VALUES (p_package_id, p_parent_id, p_name, p_path) ON CONFLICT DO NOTHING RETURNING id INTO v_id;
+    IF FOUND THEN
+      RETURN v_id;
+    END IF;
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Resolves many presumed locations with one set-based statement, creating the
+-- ones that don't exist yet
+CREATE OR REPLACE FUNCTION get_presumed_locs(p_file_ids integer[],
+                                             p_lines integer[],
+                                             p_cols integer[])
+RETURNS TABLE (file_id integer, line integer, col integer, id integer) AS $$
+#variable_conflict use_column
+BEGIN
+  -- A consistent insertion order avoids deadlocks with concurrent callers
+  INSERT INTO cpp_doc_presumed_loc (file_id, line, col)
+  SELECT wanted.file_id, wanted.line, wanted.col
+  FROM unnest(p_file_ids, p_lines, p_cols) AS wanted(file_id, line, col)
+  ORDER BY wanted.file_id, wanted.line, wanted.col
+  ON CONFLICT DO NOTHING;
+
+  RETURN QUERY
+  SELECT loc.file_id, loc.line, loc.col, loc.id
+  FROM unnest(p_file_ids, p_lines, p_cols) AS wanted(file_id, line, col)
+  JOIN cpp_doc_presumed_loc AS loc
+    ON loc.file_id = wanted.file_id AND loc.line = wanted.line AND loc.col = wanted.col;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Creates a chain of file descriptors below p_parent_id, each name is the
+-- child of the one before it. Returns their IDs in the same order.
+CREATE OR REPLACE FUNCTION get_file_descriptors(p_package_id integer,
+                                                p_parent_id integer,
+                                                p_parent_path character varying(4096),
+                                                p_names text[]) RETURNS SETOF integer AS $$
+DECLARE
+  v_parent_id integer := p_parent_id;
+  v_path character varying(4096) := p_parent_path;
+  v_name text;
+BEGIN
+  FOREACH v_name IN ARRAY p_names LOOP
+    IF v_path = '' THEN
+      v_path := v_name;
+    ELSE
+      v_path := v_path || '/' || v_name;
+    END IF;
+    v_parent_id := get_file_descriptor(p_package_id, v_parent_id, v_name, v_path);
+    RETURN NEXT v_parent_id;
+  END LOOP;
 END;
 $$ LANGUAGE plpgsql;
 
 CREATE OR REPLACE FUNCTION get_root_file_descriptor(p_package_id integer) RETURNS integer AS $$
 DECLARE
-  myrec cpp_doc_file_descriptor%ROWTYPE;
+  v_id integer;
 BEGIN
-  SELECT id INTO STRICT myrec FROM cpp_doc_file_descriptor WHERE package_id = p_package_id AND parent_id IS NULL;
-  RETURN myrec.id;
-EXCEPTION
-  WHEN NO_DATA_FOUND THEN
-    INSERT INTO cpp_doc_file_descriptor (package_id, parent_id, name, path) VALUES (p_package_id, NULL, '', '') ON CONFLICT DO NOTHING;
-    SELECT id INTO STRICT myrec FROM cpp_doc_file_descriptor WHERE package_id = p_package_id AND parent_id IS NULL;
-    RETURN myrec.id;
-  WHEN TOO_MANY_ROWS THEN
-    RAISE EXCEPTION 'file_descriptor not unique';
+  LOOP
+    SELECT id INTO v_id FROM cpp_doc_file_descriptor WHERE package_id = p_package_id AND parent_id IS NULL;
+    IF FOUND THEN
+      RETURN v_id;
+    END IF;
+    INSERT INTO cpp_doc_file_descriptor (package_id, parent_id, name, path) VALUES (p_package_id, NULL, '', '') ON CONFLICT DO NOTHING RETURNING id INTO v_id;
+    IF FOUND THEN
+      RETURN v_id;
+    END IF;
+  END LOOP;
 END;
 $$ LANGUAGE plpgsql;
 
 CREATE OR REPLACE FUNCTION get_root_decl(p_package_id integer) RETURNS integer AS $$
 DECLARE
-  myrec cpp_doc_decl%ROWTYPE;
+  v_id integer;
 BEGIN
-  SELECT id INTO STRICT myrec FROM cpp_doc_decl WHERE package_id = p_package_id AND parent_id IS NULL;
-  RETURN myrec.id;
-EXCEPTION
-  WHEN NO_DATA_FOUND THEN
-    INSERT INTO cpp_doc_decl (package_id, parent_id, name, path, presumed_loc_id) VALUES (p_package_id, NULL, '', '', NULL) ON CONFLICT DO NOTHING;
-    SELECT id INTO STRICT myrec FROM cpp_doc_decl WHERE package_id = p_package_id AND parent_id IS NULL;
-    RETURN myrec.id;
-  WHEN TOO_MANY_ROWS THEN
-    RAISE EXCEPTION 'decl not unique';
+  LOOP
+    SELECT id INTO v_id FROM cpp_doc_decl WHERE package_id = p_package_id AND parent_id IS NULL;
+    IF FOUND THEN
+      RETURN v_id;
+    END IF;
+    INSERT INTO cpp_doc_decl (package_id, parent_id, name, path, presumed_loc_id, decl_key) VALUES (p_package_id, NULL, '', '', NULL, 0) ON CONFLICT DO NOTHING RETURNING id INTO v_id;
+    IF FOUND THEN
+      RETURN v_id;
+    END IF;
+  END LOOP;
 END;
 $$ LANGUAGE plpgsql;
 
+CREATE OR REPLACE FUNCTION get_compile_command_info(p_compile_command_id integer)
+RETURNS TABLE (package_id integer,
+               package_slug text,
+               package_version text,
+               source_path text,
+               directory_path text,
+               root_decl_id integer,
+               root_file_descriptor_id integer,
+               command_line text[]) AS $$
+  SELECT cc.package_id, package_name.slug::text, package.version::text,
+         source.path::text, directory.path::text,
+         get_root_decl(cc.package_id), get_root_file_descriptor(cc.package_id),
+         cc.command_line::text[]
+  FROM cpp_doc_compile_command AS cc
+  JOIN cpp_doc_package AS package ON package.id = cc.package_id
+  JOIN cpp_doc_package_name AS package_name ON package_name.id = package.package_name_id
+  JOIN cpp_doc_file_descriptor AS source ON source.id = cc.file_id
+  JOIN cpp_doc_file_descriptor AS directory ON directory.id = cc.directory_id
+  WHERE cc.id = p_compile_command_id;
+$$ LANGUAGE sql;
+
+-- Compile commands whose translation unit was checked, marked in the same
+-- transaction as its results. With unlogged staging the results are only
+-- published once the package is promoted, a crash before then needs the
+-- package's marks deleted to check it again.
+CREATE TABLE IF NOT EXISTS cpp_doc_checked_compile_command (
+  compile_command_id integer PRIMARY KEY REFERENCES cpp_doc_compile_command (id),
+  checked_at timestamp with time zone NOT NULL DEFAULT now()
+);
+
+CREATE OR REPLACE FUNCTION set_compile_command_checked(p_compile_command_id integer) RETURNS void AS $$
+  INSERT INTO cpp_doc_checked_compile_command (compile_command_id) VALUES (p_compile_command_id)
+  ON CONFLICT (compile_command_id) DO UPDATE SET checked_at = now();
+$$ LANGUAGE sql;
+
+CREATE OR REPLACE FUNCTION get_pending_compile_commands(p_package_id integer)
+RETURNS SETOF integer AS $$
+  SELECT cc.id
+  FROM cpp_doc_compile_command AS cc
+  WHERE cc.package_id = p_package_id
+        AND NOT EXISTS (SELECT 1 FROM cpp_doc_checked_compile_command WHERE compile_command_id = cc.id)
+  ORDER BY cc.id;
+$$ LANGUAGE sql;
+
+-- Files of the package each compile command read the last time its results
+-- were committed, a compile command whose files all hash the same can be
+-- skipped by incremental runs. The row with an empty path is its command
+-- line. With unlogged staging they're cleared right away and only published
+-- along with the results.
+CREATE TABLE IF NOT EXISTS cpp_doc_compile_command_input (
+  compile_command_id integer NOT NULL REFERENCES cpp_doc_compile_command (id),
+  path text NOT NULL,
+  content_hash bigint NOT NULL,
+  PRIMARY KEY (compile_command_id, path)
+);
+
+DROP FUNCTION IF EXISTS clear_compile_command_inputs(integer);
+CREATE OR REPLACE FUNCTION clear_compile_command_inputs(p_compile_command_id integer,
+                                                        p_package_id integer) RETURNS void AS $$
+  DELETE FROM cpp_doc_compile_command_input WHERE compile_command_id = p_compile_command_id;
+  DELETE FROM cpp_doc_shared_staging_compile_command_input
+  WHERE package_id = p_package_id AND compile_command_id = p_compile_command_id;
+$$ LANGUAGE sql;
+
+-- Every keyed decl of a package, has_kind is set once the row for its kind
+-- (record, namespace, field, method or function) exists and is_checked once
+-- a method's check result does
+DROP FUNCTION IF EXISTS get_decl_index(integer);
+CREATE OR REPLACE FUNCTION get_decl_index(p_package_id integer)
+RETURNS TABLE (decl_key bigint,
+               presumed_loc_id integer,
+               has_kind boolean,
+               is_checked boolean) AS $$
+  SELECT decl.decl_key, coalesce(decl.presumed_loc_id, 0),
+         EXISTS (SELECT 1 FROM cpp_doc_record_decl WHERE decl_id = decl.id)
+         OR EXISTS (SELECT 1 FROM cpp_doc_namespace_decl WHERE decl_id = decl.id)
+         OR EXISTS (SELECT 1 FROM cpp_doc_field_decl WHERE decl_id = decl.id)
+         OR EXISTS (SELECT 1 FROM cpp_doc_method_decl WHERE decl_id = decl.id)
+         OR EXISTS (SELECT 1 FROM cpp_doc_function_decl WHERE decl_id = decl.id),
+         EXISTS (SELECT 1 FROM cpp_doc_clang_immutability_check_method WHERE method_id = decl.id)
+  FROM cpp_doc_decl AS decl
+  WHERE decl.package_id = p_package_id AND decl.decl_key IS NOT NULL;
+$$ LANGUAGE sql;
+
 CREATE OR REPLACE FUNCTION get_decl(p_package_id integer,
                                     p_parent_id integer,
                                     p_name character varying (4096),
                                     p_path character varying(4096)) RETURNS integer AS $$
 DECLARE
-  myrec cpp_doc_decl%ROWTYPE;
+  v_id integer;
 BEGIN
-  SELECT id INTO STRICT myrec FROM cpp_doc_decl WHERE package_id = p_package_id AND path = p_path;
-  RETURN myrec.id;
-EXCEPTION
-  WHEN NO_DATA_FOUND THEN
-    INSERT INTO cpp_doc_decl (package_id, parent_id, name, path, presumed_loc_id) VALUES (p_package_id, p_parent_id, p_name, p_path, NULL) ON CONFLICT DO NOTHING;
-    SELECT id INTO STRICT myrec FROM cpp_doc_decl WHERE package_id = p_package_id AND path = p_path;
-    RETURN myrec.id;
-  WHEN TOO_MANY_ROWS THEN
-    RAISE EXCEPTION 'decl not unique';
+  LOOP
+    SELECT id INTO v_id FROM cpp_doc_decl WHERE package_id = p_package_id AND path = p_path;
+    IF FOUND THEN
+      RETURN v_id;
+    END IF;
+    INSERT INTO cpp_doc_decl (package_id, parent_id, name, path, presumed_loc_id) VALUES (p_package_id, p_parent_id, p_name, p_path, NULL) ON CONFLICT DO NOTHING RETURNING id INTO v_id;
+    IF FOUND THEN
+      RETURN v_id;
+    END IF;
+  END LOOP;
 END;
 $$ LANGUAGE plpgsql;
 
@@ -95,18 +341,48 @@ CREATE OR REPLACE FUNCTION get_decl(p_package_id integer,
                                            p_path character varying(4096),
                                            p_presumed_loc_id integer) RETURNS integer AS $$
 DECLARE
-  myrec cpp_doc_decl%ROWTYPE;
+  v_id integer;
+BEGIN
+  LOOP
+    UPDATE cpp_doc_decl SET presumed_loc_id = p_presumed_loc_id
+    WHERE package_id = p_package_id AND path = p_path AND presumed_loc_id IS DISTINCT FROM p_presumed_loc_id;
+    SELECT id INTO v_id FROM cpp_doc_decl WHERE package_id = p_package_id AND path = p_path;
+    IF FOUND THEN
+      RETURN v_id;
+    END IF;
+    INSERT INTO cpp_doc_decl (package_id, parent_id, name, path, presumed_loc_id) VALUES (p_package_id, p_parent_id, p_name, p_path, p_presumed_loc_id) ON CONFLICT DO NOTHING RETURNING id INTO v_id;
+    IF FOUND THEN
+      RETURN v_id;
+    END IF;
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Resolves many decls with set-based statements, element i of every array
+-- describes one decl. Returns the ID of each decl by path.
+CREATE OR REPLACE FUNCTION get_decls(p_package_id integer,
+                                     p_parent_ids integer[],
+                                     p_names text[],
+                                     p_paths text[],
+                                     p_presumed_loc_ids integer[])
+RETURNS TABLE (path character varying(4096), id integer) AS $$
+#variable_conflict use_column
 BEGIN
-  SELECT id INTO STRICT myrec FROM cpp_doc_decl WHERE package_id = p_package_id AND path = p_path;
-  UPDATE cpp_doc_decl SET presumed_loc_id = p_presumed_loc_id WHERE id = myrec.id;
-  RETURN myrec.id;
-EXCEPTION
-  WHEN NO_DATA_FOUND THEN
-    INSERT INTO cpp_doc_decl (package_id, parent_id, name, path, presumed_loc_id) VALUES (p_package_id, p_parent_id, p_name, p_path, p_presumed_loc_id) ON CONFLICT DO NOTHING;
-    SELECT id INTO STRICT myrec FROM cpp_doc_decl WHERE package_id = p_package_id AND path = p_path;
-    RETURN myrec.id;
-  WHEN TOO_MANY_ROWS THEN
-    RAISE EXCEPTION 'decl not unique';
+  UPDATE cpp_doc_decl AS decl SET presumed_loc_id = wanted.presumed_loc_id
+  FROM unnest(p_paths, p_presumed_loc_ids) AS wanted(path, presumed_loc_id)
+  WHERE decl.package_id = p_package_id AND decl.path = wanted.path
+    AND wanted.presumed_loc_id IS NOT NULL AND decl.presumed_loc_id IS DISTINCT FROM wanted.presumed_loc_id;
+
+  INSERT INTO cpp_doc_decl (package_id, parent_id, name, path, presumed_loc_id)
+  SELECT p_package_id, wanted.parent_id, wanted.name, wanted.path, wanted.presumed_loc_id
+  FROM unnest(p_parent_ids, p_names, p_paths, p_presumed_loc_ids) AS wanted(parent_id, name, path, presumed_loc_id)
+  ORDER BY wanted.path
+  ON CONFLICT DO NOTHING;
+
+  RETURN QUERY
+  SELECT decl.path, decl.id
+  FROM unnest(p_paths) AS wanted(path)
+  JOIN cpp_doc_decl AS decl ON decl.package_id = p_package_id AND decl.path = wanted.path;
 END;
 $$ LANGUAGE plpgsql;
 
@@ -115,85 +391,84 @@ CREATE OR REPLACE FUNCTION get_method_decl(p_decl_id integer,
                                            p_is_const boolean,
                                            p_is_pure boolean,
                                            p_access integer) RETURNS void AS $$
-DECLARE
-  myrec cpp_doc_method_decl%ROWTYPE;
 BEGIN
-  SELECT decl_id INTO STRICT myrec FROM cpp_doc_method_decl WHERE decl_id = p_decl_id;
-EXCEPTION
-  WHEN NO_DATA_FOUND THEN
-    INSERT INTO cpp_doc_method_decl (decl_id, mangled_name, is_const, is_pure, access) VALUES (p_decl_id, p_mangled_name, p_is_const, p_is_pure, p_access) ON CONFLICT DO NOTHING;
-  WHEN TOO_MANY_ROWS THEN
-    RAISE EXCEPTION 'method_decl not unique';
+  INSERT INTO cpp_doc_method_decl (decl_id, mangled_name, is_const, is_pure, access) VALUES (p_decl_id, p_mangled_name, p_is_const, p_is_pure, p_access) ON CONFLICT DO NOTHING;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION get_method_decls(p_decl_ids integer[],
+                                            p_mangled_names text[],
+                                            p_is_consts boolean[],
+                                            p_is_pures boolean[],
+                                            p_accesses integer[]) RETURNS void AS $$
+BEGIN
+  INSERT INTO cpp_doc_method_decl (decl_id, mangled_name, is_const, is_pure, access)
+  SELECT * FROM unnest(p_decl_ids, p_mangled_names, p_is_consts, p_is_pures, p_accesses)
+  ON CONFLICT DO NOTHING;
 END;
 $$ LANGUAGE plpgsql;
 
 CREATE OR REPLACE FUNCTION get_field_decl(p_decl_id integer,
                                           p_is_mutable boolean,
                                           p_access integer) RETURNS void AS $$
-DECLARE
-  myrec cpp_doc_method_decl%ROWTYPE;
 BEGIN
-  SELECT decl_id INTO STRICT myrec FROM cpp_doc_field_decl WHERE decl_id = p_decl_id;
-EXCEPTION
-  WHEN NO_DATA_FOUND THEN
-    INSERT INTO cpp_doc_field_decl (decl_id, is_mutable, access) VALUES (p_decl_id, p_is_mutable, p_access) ON CONFLICT DO NOTHING;
-  WHEN TOO_MANY_ROWS THEN
-    RAISE EXCEPTION 'field_decl not unique';
+  INSERT INTO cpp_doc_field_decl (decl_id, is_mutable, access) VALUES (p_decl_id, p_is_mutable, p_access) ON CONFLICT DO NOTHING;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION get_field_decls(p_decl_ids integer[],
+                                           p_is_mutables boolean[],
+                                           p_accesses integer[]) RETURNS void AS $$
+BEGIN
+  INSERT INTO cpp_doc_field_decl (decl_id, is_mutable, access)
+  SELECT * FROM unnest(p_decl_ids, p_is_mutables, p_accesses)
+  ON CONFLICT DO NOTHING;
 END;
 $$ LANGUAGE plpgsql;
 
 CREATE OR REPLACE FUNCTION get_function_decl(p_decl_id integer) RETURNS void AS $$
-DECLARE
-  myrec cpp_doc_function_decl%ROWTYPE;
 BEGIN
-  SELECT decl_id INTO STRICT myrec FROM cpp_doc_function_decl WHERE decl_id = p_decl_id;
-EXCEPTION
-  WHEN NO_DATA_FOUND THEN
-    INSERT INTO cpp_doc_function_decl (decl_id) VALUES (p_decl_id) ON CONFLICT DO NOTHING;
-  WHEN TOO_MANY_ROWS THEN
-    RAISE EXCEPTION 'function_decl not unique';
+  INSERT INTO cpp_doc_function_decl (decl_id) VALUES (p_decl_id) ON CONFLICT DO NOTHING;
 END;
 $$ LANGUAGE plpgsql;
 
 CREATE OR REPLACE FUNCTION get_namespace_decl(p_decl_id integer) RETURNS void AS $$
-DECLARE
-  myrec cpp_doc_namespace_decl%ROWTYPE;
 BEGIN
-  SELECT decl_id INTO STRICT myrec FROM cpp_doc_namespace_decl WHERE decl_id = p_decl_id;
-EXCEPTION
-  WHEN NO_DATA_FOUND THEN
-    INSERT INTO cpp_doc_namespace_decl (decl_id) VALUES (p_decl_id) ON CONFLICT DO NOTHING;
-  WHEN TOO_MANY_ROWS THEN
-    RAISE EXCEPTION 'namespace_decl not unique';
+  INSERT INTO cpp_doc_namespace_decl (decl_id) VALUES (p_decl_id) ON CONFLICT DO NOTHING;
 END;
 $$ LANGUAGE plpgsql;
 
 CREATE OR REPLACE FUNCTION get_record_decl(p_decl_id integer,
                                            p_is_abstract boolean,
                                            p_is_dependent boolean) RETURNS void AS $$
-DECLARE
-  myrec cpp_doc_record_decl%ROWTYPE;
 BEGIN
-  SELECT decl_id INTO STRICT myrec FROM cpp_doc_record_decl WHERE decl_id = p_decl_id;
-EXCEPTION
-  WHEN NO_DATA_FOUND THEN
-    INSERT INTO cpp_doc_record_decl (decl_id, is_abstract, is_dependent) VALUES (p_decl_id, p_is_abstract, p_is_dependent) ON CONFLICT DO NOTHING;
-  WHEN TOO_MANY_ROWS THEN
-    RAISE EXCEPTION 'record_decl not unique';
+  INSERT INTO cpp_doc_record_decl (decl_id, is_abstract, is_dependent) VALUES (p_decl_id, p_is_abstract, p_is_dependent) ON CONFLICT DO NOTHING;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION get_record_decls(p_decl_ids integer[],
+                                            p_is_abstracts boolean[],
+                                            p_is_dependents boolean[]) RETURNS void AS $$
+BEGIN
+  INSERT INTO cpp_doc_record_decl (decl_id, is_abstract, is_dependent)
+  SELECT * FROM unnest(p_decl_ids, p_is_abstracts, p_is_dependents)
+  ON CONFLICT DO NOTHING;
 END;
 $$ LANGUAGE plpgsql;
 
 CREATE OR REPLACE FUNCTION get_method_dependence(p_method_id integer,
                                                  p_callee_id integer) RETURNS void AS $$
-DECLARE
-  myrec cpp_doc_immutability_method_dependence%ROWTYPE;
 BEGIN
-  SELECT method_id, callee_id INTO STRICT myrec FROM cpp_doc_immutability_method_dependence WHERE method_id = p_method_id AND callee_id = p_callee_id;
-EXCEPTION
-  WHEN NO_DATA_FOUND THEN
-    INSERT INTO cpp_doc_immutability_method_dependence (method_id, callee_id) VALUES (p_method_id, p_callee_id) ON CONFLICT DO NOTHING;
-  WHEN TOO_MANY_ROWS THEN
-    RAISE EXCEPTION 'immutability_method_dependence not unique';
+  INSERT INTO cpp_doc_immutability_method_dependence (method_id, callee_id) VALUES (p_method_id, p_callee_id) ON CONFLICT DO NOTHING;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION get_method_dependences(p_method_ids integer[],
+                                                  p_callee_ids integer[]) RETURNS void AS $$
+BEGIN
+  INSERT INTO cpp_doc_immutability_method_dependence (method_id, callee_id)
+  SELECT * FROM unnest(p_method_ids, p_callee_ids)
+  ON CONFLICT DO NOTHING;
 END;
 $$ LANGUAGE plpgsql;
 
@@ -217,3 +492,643 @@ BEGIN
   INSERT INTO cpp_doc_public_view (record_id, decl_id) VALUES (p_record_id, p_decl_id) ON CONFLICT DO NOTHING;
 END;
 $$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION get_public_views(p_record_ids integer[], p_decl_ids integer[]) RETURNS void AS $$
+BEGIN
+  INSERT INTO cpp_doc_public_view (record_id, decl_id)
+  SELECT * FROM unnest(p_record_ids, p_decl_ids)
+  ON CONFLICT DO NOTHING;
+END;
+$$ LANGUAGE plpgsql;
+
+-- The staging tables are temporary tables created by the checker's session
+
+-- Returns the file descriptor of a path relative to the package's source
+-- directory, creating it and any of its parents that don't exist yet
+CREATE OR REPLACE FUNCTION get_file_descriptor_from_path(p_package_id integer,
+                                                         p_path character varying(4096)) RETURNS integer AS $$
+DECLARE
+  v_id integer;
+BEGIN
+  SELECT id INTO v_id FROM cpp_doc_file_descriptor WHERE package_id = p_package_id AND path = p_path;
+  IF FOUND THEN
+    RETURN v_id;
+  END IF;
+  v_id := get_root_file_descriptor(p_package_id);
+  IF p_path = '' THEN
+    RETURN v_id;
+  END IF;
+  FOR v_id IN SELECT * FROM get_file_descriptors(p_package_id, v_id, '', string_to_array(p_path, '/')) LOOP
+  END LOOP;
+  RETURN v_id;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Fact files can't know the IDs of presumed locations, their decls name them
+-- by path, line and column instead. Moves those decls into
+-- cpp_doc_staging_decl, creating the locations that don't exist yet.
+CREATE OR REPLACE FUNCTION merge_staged_decl_locs(p_package_id integer) RETURNS void AS $$
+DECLARE
+  v_path character varying(4096);
+BEGIN
+  -- A consistent order avoids deadlocks with concurrent loaders
+  FOR v_path IN SELECT DISTINCT file_path FROM cpp_doc_staging_decl_loc WHERE file_path IS NOT NULL ORDER BY file_path LOOP
+    PERFORM get_file_descriptor_from_path(p_package_id, v_path);
+  END LOOP;
+
+  INSERT INTO cpp_doc_presumed_loc (file_id, line, col)
+  SELECT DISTINCT file.id, staged.line, staged.col
+  FROM cpp_doc_staging_decl_loc AS staged
+  JOIN cpp_doc_file_descriptor AS file ON file.package_id = p_package_id AND file.path = staged.file_path
+  ORDER BY file.id, staged.line, staged.col
+  ON CONFLICT DO NOTHING;
+
+  INSERT INTO cpp_doc_staging_decl (depth, decl_key, parent_key, name, path, presumed_loc_id)
+  SELECT staged.depth, staged.decl_key, staged.parent_key, staged.name, staged.path, loc.id
+  FROM cpp_doc_staging_decl_loc AS staged
+  LEFT JOIN cpp_doc_file_descriptor AS file ON file.package_id = p_package_id AND file.path = staged.file_path
+  LEFT JOIN cpp_doc_presumed_loc AS loc ON loc.file_id = file.id AND loc.line = staged.line AND loc.col = staged.col;
+
+  TRUNCATE cpp_doc_staging_decl_loc;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION merge_staged_decls(p_package_id integer) RETURNS void AS $$
+DECLARE
+  v_depth integer;
+BEGIN
+  -- Decls inserted before they had keys are adopted by path
+  UPDATE cpp_doc_decl AS decl SET decl_key = staged.decl_key
+  FROM cpp_doc_staging_decl AS staged
+  WHERE decl.package_id = p_package_id AND decl.path = staged.path AND decl.decl_key IS NULL;
+
+  -- A parent has to exist before its children, so insert one level at a time
+  FOR v_depth IN SELECT DISTINCT depth FROM cpp_doc_staging_decl ORDER BY depth LOOP
+    INSERT INTO cpp_doc_decl (package_id, parent_id, name, path, presumed_loc_id, decl_key)
+    SELECT p_package_id, parent.id, staged.name, staged.path, staged.presumed_loc_id, staged.decl_key
+    FROM cpp_doc_staging_decl AS staged
+    JOIN cpp_doc_decl AS parent ON parent.package_id = p_package_id AND parent.decl_key = staged.parent_key
+    WHERE staged.depth = v_depth
+    ON CONFLICT DO NOTHING;
+  END LOOP;
+
+  UPDATE cpp_doc_decl AS decl SET presumed_loc_id = staged.presumed_loc_id
+  FROM cpp_doc_staging_decl AS staged
+  WHERE decl.package_id = p_package_id AND decl.decl_key = staged.decl_key
+    AND staged.presumed_loc_id IS NOT NULL AND decl.presumed_loc_id IS DISTINCT FROM staged.presumed_loc_id;
+
+  INSERT INTO cpp_doc_record_decl (decl_id, is_abstract, is_dependent)
+  SELECT decl.id, staged.is_abstract, staged.is_dependent
+  FROM cpp_doc_staging_record_decl AS staged
+  JOIN cpp_doc_decl AS decl ON decl.package_id = p_package_id AND decl.decl_key = staged.decl_key
+  ON CONFLICT DO NOTHING;
+
+  INSERT INTO cpp_doc_namespace_decl (decl_id)
+  SELECT decl.id
+  FROM cpp_doc_staging_namespace_decl AS staged
+  JOIN cpp_doc_decl AS decl ON decl.package_id = p_package_id AND decl.decl_key = staged.decl_key
+  ON CONFLICT DO NOTHING;
+
+  INSERT INTO cpp_doc_field_decl (decl_id, is_mutable, access)
+  SELECT decl.id, staged.is_mutable, staged.access
+  FROM cpp_doc_staging_field_decl AS staged
+  JOIN cpp_doc_decl AS decl ON decl.package_id = p_package_id AND decl.decl_key = staged.decl_key
+  ON CONFLICT DO NOTHING;
+
+  INSERT INTO cpp_doc_method_decl (decl_id, mangled_name, is_const, is_pure, access)
+  SELECT decl.id, staged.mangled_name, staged.is_const, staged.is_pure, staged.access
+  FROM cpp_doc_staging_method_decl AS staged
+  JOIN cpp_doc_decl AS decl ON decl.package_id = p_package_id AND decl.decl_key = staged.decl_key
+  ON CONFLICT DO NOTHING;
+
+  INSERT INTO cpp_doc_function_decl (decl_id)
+  SELECT decl.id
+  FROM cpp_doc_staging_function_decl AS staged
+  JOIN cpp_doc_decl AS decl ON decl.package_id = p_package_id AND decl.decl_key = staged.decl_key
+  ON CONFLICT DO NOTHING;
+
+  TRUNCATE cpp_doc_staging_decl, cpp_doc_staging_record_decl, cpp_doc_staging_namespace_decl,
+           cpp_doc_staging_field_decl, cpp_doc_staging_method_decl, cpp_doc_staging_function_decl;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION merge_staged_results(p_package_id integer) RETURNS void AS $$
+BEGIN
+  -- A check may be staged more than once when it's shipped in batches, an
+  -- upsert can only touch each row once
+  INSERT INTO cpp_doc_clang_immutability_check_method (method_id, mutate_result, return_result)
+  SELECT DISTINCT ON (decl.id) decl.id, staged.mutate_result, staged.return_result
+  FROM cpp_doc_staging_check_method AS staged
+  JOIN cpp_doc_decl AS decl ON decl.package_id = p_package_id AND decl.decl_key = staged.method_key
+  ON CONFLICT (method_id) DO UPDATE SET mutate_result = EXCLUDED.mutate_result, return_result = EXCLUDED.return_result;
+
+  INSERT INTO cpp_doc_clang_immutability_check_field (field_id, is_explicit, is_transitive)
+  SELECT DISTINCT ON (decl.id) decl.id, staged.is_explicit, staged.is_transitive
+  FROM cpp_doc_staging_check_field AS staged
+  JOIN cpp_doc_decl AS decl ON decl.package_id = p_package_id AND decl.decl_key = staged.field_key
+  ON CONFLICT (field_id) DO UPDATE SET is_explicit = EXCLUDED.is_explicit, is_transitive = EXCLUDED.is_transitive;
+
+  INSERT INTO cpp_doc_public_view (record_id, decl_id)
+  SELECT record.id, decl.id
+  FROM cpp_doc_staging_public_view AS staged
+  JOIN cpp_doc_decl AS record ON record.package_id = p_package_id AND record.decl_key = staged.record_key
+  JOIN cpp_doc_decl AS decl ON decl.package_id = p_package_id AND decl.decl_key = staged.decl_key
+  ON CONFLICT DO NOTHING;
+
+  INSERT INTO cpp_doc_public_base (record_id, base_id)
+  SELECT record.id, base.id
+  FROM cpp_doc_staging_public_base AS staged
+  JOIN cpp_doc_decl AS record ON record.package_id = p_package_id AND record.decl_key = staged.record_key
+  JOIN cpp_doc_decl AS base ON base.package_id = p_package_id AND base.decl_key = staged.base_key
+  ON CONFLICT DO NOTHING;
+
+  INSERT INTO cpp_doc_public_override (method_id, overridden_id)
+  SELECT method.id, overridden.id
+  FROM cpp_doc_staging_public_override AS staged
+  JOIN cpp_doc_decl AS method ON method.package_id = p_package_id AND method.decl_key = staged.method_key
+  JOIN cpp_doc_decl AS overridden ON overridden.package_id = p_package_id AND overridden.decl_key = staged.overridden_key
+  ON CONFLICT DO NOTHING;
+
+  INSERT INTO cpp_doc_immutability_method_dependence (method_id, callee_id)
+  SELECT method.id, callee.id
+  FROM cpp_doc_staging_method_dependence AS staged
+  JOIN cpp_doc_decl AS method ON method.package_id = p_package_id AND method.decl_key = staged.method_key
+  JOIN cpp_doc_decl AS callee ON callee.package_id = p_package_id AND callee.decl_key = staged.callee_key
+  ON CONFLICT DO NOTHING;
+
+  TRUNCATE cpp_doc_staging_check_method, cpp_doc_staging_check_field,
+           cpp_doc_staging_public_view, cpp_doc_staging_public_base,
+           cpp_doc_staging_public_override, cpp_doc_staging_method_dependence;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION get_shared_staging_tables() RETURNS SETOF text AS $$
+BEGIN
+  RETURN QUERY SELECT unnest(ARRAY['decl', 'record_decl', 'namespace_decl', 'field_decl',
+                                   'method_decl', 'function_decl', 'check_method',
+                                   'check_field', 'public_view', 'public_base',
+                                   'public_override', 'method_dependence',
+                                   'compile_command_input']);
+END;
+$$ LANGUAGE plpgsql;
+
+-- Creates the unlogged partitions a package's rows are staged in
+CREATE OR REPLACE FUNCTION create_staging_partitions(p_package_id integer) RETURNS void AS $$
+DECLARE
+  v_table text;
+BEGIN
+  -- Concurrent workers of the same package would race to create them
+  PERFORM pg_advisory_xact_lock(hashtext('cpp_doc_shared_staging'), p_package_id);
+  FOR v_table IN SELECT * FROM get_shared_staging_tables() LOOP
+    EXECUTE format('CREATE UNLOGGED TABLE IF NOT EXISTS %I PARTITION OF %I FOR VALUES IN (%s)',
+                   'cpp_doc_shared_staging_' || v_table || '_' || p_package_id,
+                   'cpp_doc_shared_staging_' || v_table, p_package_id);
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Publishes the rows staged for a package by merging them like the rows of a
+-- single translation unit, then empties its partitions. The session's
+-- staging tables have to exist.
+CREATE OR REPLACE FUNCTION promote_staged_package(p_package_id integer) RETURNS void AS $$
+DECLARE
+  v_table text;
+BEGIN
+  PERFORM create_staging_partitions(p_package_id);
+  -- Writers of the package wait until it's published, or rows they commit in
+  -- the meantime would be lost
+  FOR v_table IN SELECT * FROM get_shared_staging_tables() LOOP
+    EXECUTE format('LOCK TABLE %I IN EXCLUSIVE MODE',
+                   'cpp_doc_shared_staging_' || v_table || '_' || p_package_id);
+  END LOOP;
+
+  INSERT INTO cpp_doc_staging_decl (depth, decl_key, parent_key, name, path, presumed_loc_id)
+  SELECT depth, decl_key, parent_key, name, path, presumed_loc_id
+  FROM cpp_doc_shared_staging_decl WHERE package_id = p_package_id;
+  INSERT INTO cpp_doc_staging_record_decl (decl_key, is_abstract, is_dependent)
+  SELECT decl_key, is_abstract, is_dependent
+  FROM cpp_doc_shared_staging_record_decl WHERE package_id = p_package_id;
+  INSERT INTO cpp_doc_staging_namespace_decl (decl_key)
+  SELECT decl_key
+  FROM cpp_doc_shared_staging_namespace_decl WHERE package_id = p_package_id;
+  INSERT INTO cpp_doc_staging_field_decl (decl_key, is_mutable, access)
+  SELECT decl_key, is_mutable, access
+  FROM cpp_doc_shared_staging_field_decl WHERE package_id = p_package_id;
+  INSERT INTO cpp_doc_staging_method_decl (decl_key, mangled_name, is_const, is_pure, access)
+  SELECT decl_key, mangled_name, is_const, is_pure, access
+  FROM cpp_doc_shared_staging_method_decl WHERE package_id = p_package_id;
+  INSERT INTO cpp_doc_staging_function_decl (decl_key)
+  SELECT decl_key
+  FROM cpp_doc_shared_staging_function_decl WHERE package_id = p_package_id;
+  PERFORM merge_staged_decls(p_package_id);
+
+  INSERT INTO cpp_doc_staging_check_method (method_key, mutate_result, return_result)
+  SELECT method_key, mutate_result, return_result
+  FROM cpp_doc_shared_staging_check_method WHERE package_id = p_package_id;
+  INSERT INTO cpp_doc_staging_check_field (field_key, is_explicit, is_transitive)
+  SELECT field_key, is_explicit, is_transitive
+  FROM cpp_doc_shared_staging_check_field WHERE package_id = p_package_id;
+  INSERT INTO cpp_doc_staging_public_view (record_key, decl_key)
+  SELECT DISTINCT record_key, decl_key
+  FROM cpp_doc_shared_staging_public_view WHERE package_id = p_package_id;
+  INSERT INTO cpp_doc_staging_public_base (record_key, base_key)
+  SELECT DISTINCT record_key, base_key
+  FROM cpp_doc_shared_staging_public_base WHERE package_id = p_package_id;
+  INSERT INTO cpp_doc_staging_public_override (method_key, overridden_key)
+  SELECT DISTINCT method_key, overridden_key
+  FROM cpp_doc_shared_staging_public_override WHERE package_id = p_package_id;
+  INSERT INTO cpp_doc_staging_method_dependence (method_key, callee_key)
+  SELECT DISTINCT method_key, callee_key
+  FROM cpp_doc_shared_staging_method_dependence WHERE package_id = p_package_id;
+  PERFORM merge_staged_results(p_package_id);
+
+  -- Published with the results, a crash before then leaves the compile
+  -- commands without recorded files so incremental runs check them again
+  DELETE FROM cpp_doc_compile_command_input
+  WHERE compile_command_id IN (SELECT compile_command_id
+                               FROM cpp_doc_shared_staging_compile_command_input
+                               WHERE package_id = p_package_id);
+  INSERT INTO cpp_doc_compile_command_input (compile_command_id, path, content_hash)
+  SELECT compile_command_id, path, content_hash
+  FROM cpp_doc_shared_staging_compile_command_input WHERE package_id = p_package_id;
+
+  FOR v_table IN SELECT * FROM get_shared_staging_tables() LOOP
+    EXECUTE format('TRUNCATE %I', 'cpp_doc_shared_staging_' || v_table || '_' || p_package_id);
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION refresh_expanded_public_view() RETURNS void AS $$
+BEGIN
+  REFRESH MATERIALIZED VIEW CONCURRENTLY cpp_doc_expanded_public_view;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Public views written before bases were stored copied every inherited member
+-- into each derived record. Once a package is checked again its records have
+-- their bases, and the copies can go.
+CREATE OR REPLACE FUNCTION compact_public_views(p_package_id integer) RETURNS void AS $$
+BEGIN
+  DELETE FROM cpp_doc_public_view AS view
+  USING cpp_doc_decl AS record, cpp_doc_decl AS member
+  WHERE record.id = view.record_id AND record.package_id = p_package_id
+    AND member.id = view.decl_id AND member.parent_id IS DISTINCT FROM view.record_id
+    AND EXISTS (SELECT 1 FROM cpp_doc_public_base AS base WHERE base.record_id = view.record_id);
+END;
+$$ LANGUAGE plpgsql;
+
+-- Per-package answers to the research questions of the introduction: how many
+-- classes have const methods, how many methods are const and how many of those
+-- are obviously const. Triggers keep them up to date as rows are written, by
+-- the merges or the get_ functions alike. Package totals are spread over a few
+-- slots so concurrent writers of one package don't queue on a single row.
+CREATE TABLE IF NOT EXISTS cpp_doc_record_method_stats (
+  record_id integer PRIMARY KEY,
+  package_id integer NOT NULL,
+  num_methods integer NOT NULL,
+  num_const_methods integer NOT NULL
+);
+CREATE TABLE IF NOT EXISTS cpp_doc_package_method_stats (
+  package_id integer NOT NULL,
+  slot integer NOT NULL,
+  num_methods integer NOT NULL,
+  num_const_methods integer NOT NULL,
+  num_records_with_const_methods integer NOT NULL,
+  PRIMARY KEY (package_id, slot)
+);
+CREATE TABLE IF NOT EXISTS cpp_doc_package_check_method_stats (
+  package_id integer NOT NULL,
+  slot integer NOT NULL,
+  is_const boolean NOT NULL,
+  mutate_result integer NOT NULL,
+  return_result integer NOT NULL,
+  num_methods integer NOT NULL,
+  PRIMARY KEY (package_id, is_const, mutate_result, return_result, slot)
+);
+CREATE TABLE IF NOT EXISTS cpp_doc_package_check_field_stats (
+  package_id integer NOT NULL,
+  slot integer NOT NULL,
+  is_explicit boolean NOT NULL,
+  is_transitive boolean NOT NULL,
+  num_fields integer NOT NULL,
+  PRIMARY KEY (package_id, is_explicit, is_transitive, slot)
+);
+
+CREATE OR REPLACE FUNCTION get_stats_slot() RETURNS integer AS $$
+  SELECT pg_backend_pid() % 16;
+$$ LANGUAGE sql;
+
+CREATE OR REPLACE FUNCTION count_inserted_method_decls() RETURNS trigger AS $$
+BEGIN
+  WITH per_record AS (
+    SELECT decl.package_id, decl.parent_id AS record_id, count(*)::integer AS num_methods,
+           (count(*) FILTER (WHERE new_rows.is_const))::integer AS num_const_methods
+    FROM new_rows
+    JOIN cpp_doc_decl AS decl ON decl.id = new_rows.decl_id
+    GROUP BY decl.package_id, decl.parent_id
+  ), record_stats AS (
+    INSERT INTO cpp_doc_record_method_stats AS stats (record_id, package_id, num_methods, num_const_methods)
+    SELECT record_id, package_id, num_methods, num_const_methods FROM per_record
+    ON CONFLICT (record_id) DO UPDATE SET num_methods = stats.num_methods + EXCLUDED.num_methods,
+                                          num_const_methods = stats.num_const_methods + EXCLUDED.num_const_methods
+    RETURNING stats.record_id, stats.num_const_methods
+  )
+  INSERT INTO cpp_doc_package_method_stats AS stats (package_id, slot, num_methods, num_const_methods,
+                                                    num_records_with_const_methods)
+  -- A record is counted when it gets its first const method
+  SELECT per_record.package_id, get_stats_slot(), sum(per_record.num_methods),
+         sum(per_record.num_const_methods),
+         count(*) FILTER (WHERE per_record.num_const_methods > 0
+                          AND record_stats.num_const_methods = per_record.num_const_methods)
+  FROM per_record
+  JOIN record_stats ON record_stats.record_id = per_record.record_id
+  GROUP BY per_record.package_id
+  ON CONFLICT (package_id, slot) DO UPDATE
+  SET num_methods = stats.num_methods + EXCLUDED.num_methods,
+      num_const_methods = stats.num_const_methods + EXCLUDED.num_const_methods,
+      num_records_with_const_methods = stats.num_records_with_const_methods + EXCLUDED.num_records_with_const_methods;
+  RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+-- An upsert fires the insert trigger for its new rows and the update trigger
+-- for the rest. Updated rows take their old results back out.
+CREATE OR REPLACE FUNCTION count_inserted_check_methods() RETURNS trigger AS $$
+BEGIN
+  INSERT INTO cpp_doc_package_check_method_stats AS stats (package_id, slot, is_const, mutate_result,
+                                                          return_result, num_methods)
+  SELECT decl.package_id, get_stats_slot(), method.is_const, new_rows.mutate_result,
+         new_rows.return_result, count(*)
+  FROM new_rows
+  JOIN cpp_doc_method_decl AS method ON method.decl_id = new_rows.method_id
+  JOIN cpp_doc_decl AS decl ON decl.id = new_rows.method_id
+  GROUP BY decl.package_id, method.is_const, new_rows.mutate_result, new_rows.return_result
+  ON CONFLICT (package_id, is_const, mutate_result, return_result, slot) DO UPDATE
+  SET num_methods = stats.num_methods + EXCLUDED.num_methods;
+  RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION count_updated_check_methods() RETURNS trigger AS $$
+BEGIN
+  INSERT INTO cpp_doc_package_check_method_stats AS stats (package_id, slot, is_const, mutate_result,
+                                                          return_result, num_methods)
+  SELECT decl.package_id, get_stats_slot(), method.is_const, changed.mutate_result,
+         changed.return_result, sum(changed.delta)
+  FROM (SELECT method_id, mutate_result, return_result, 1 AS delta FROM new_rows
+        UNION ALL
+        SELECT method_id, mutate_result, return_result, -1 AS delta FROM old_rows) AS changed
+  JOIN cpp_doc_method_decl AS method ON method.decl_id = changed.method_id
+  JOIN cpp_doc_decl AS decl ON decl.id = changed.method_id
+  GROUP BY decl.package_id, method.is_const, changed.mutate_result, changed.return_result
+  HAVING sum(changed.delta) <> 0
+  ON CONFLICT (package_id, is_const, mutate_result, return_result, slot) DO UPDATE
+  SET num_methods = stats.num_methods + EXCLUDED.num_methods;
+  RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION count_inserted_check_fields() RETURNS trigger AS $$
+BEGIN
+  INSERT INTO cpp_doc_package_check_field_stats AS stats (package_id, slot, is_explicit, is_transitive,
+                                                         num_fields)
+  SELECT decl.package_id, get_stats_slot(), new_rows.is_explicit, new_rows.is_transitive, count(*)
+  FROM new_rows
+  JOIN cpp_doc_decl AS decl ON decl.id = new_rows.field_id
+  GROUP BY decl.package_id, new_rows.is_explicit, new_rows.is_transitive
+  ON CONFLICT (package_id, is_explicit, is_transitive, slot) DO UPDATE
+  SET num_fields = stats.num_fields + EXCLUDED.num_fields;
+  RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION count_updated_check_fields() RETURNS trigger AS $$
+BEGIN
+  INSERT INTO cpp_doc_package_check_field_stats AS stats (package_id, slot, is_explicit, is_transitive,
+                                                         num_fields)
+  SELECT decl.package_id, get_stats_slot(), changed.is_explicit, changed.is_transitive,
+         sum(changed.delta)
+  FROM (SELECT field_id, is_explicit, is_transitive, 1 AS delta FROM new_rows
+        UNION ALL
+        SELECT field_id, is_explicit, is_transitive, -1 AS delta FROM old_rows) AS changed
+  JOIN cpp_doc_decl AS decl ON decl.id = changed.field_id
+  GROUP BY decl.package_id, changed.is_explicit, changed.is_transitive
+  HAVING sum(changed.delta) <> 0
+  ON CONFLICT (package_id, is_explicit, is_transitive, slot) DO UPDATE
+  SET num_fields = stats.num_fields + EXCLUDED.num_fields;
+  RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+DROP TRIGGER IF EXISTS cpp_doc_method_decl_insert_stats ON cpp_doc_method_decl;
+CREATE TRIGGER cpp_doc_method_decl_insert_stats AFTER INSERT ON cpp_doc_method_decl
+REFERENCING NEW TABLE AS new_rows
+FOR EACH STATEMENT EXECUTE PROCEDURE count_inserted_method_decls();
+DROP TRIGGER IF EXISTS cpp_doc_check_method_insert_stats ON cpp_doc_clang_immutability_check_method;
+CREATE TRIGGER cpp_doc_check_method_insert_stats AFTER INSERT ON cpp_doc_clang_immutability_check_method
+REFERENCING NEW TABLE AS new_rows
+FOR EACH STATEMENT EXECUTE PROCEDURE count_inserted_check_methods();
+DROP TRIGGER IF EXISTS cpp_doc_check_method_update_stats ON cpp_doc_clang_immutability_check_method;
+CREATE TRIGGER cpp_doc_check_method_update_stats AFTER UPDATE ON cpp_doc_clang_immutability_check_method
+REFERENCING OLD TABLE AS old_rows NEW TABLE AS new_rows
+FOR EACH STATEMENT EXECUTE PROCEDURE count_updated_check_methods();
+DROP TRIGGER IF EXISTS cpp_doc_check_field_insert_stats ON cpp_doc_clang_immutability_check_field;
+CREATE TRIGGER cpp_doc_check_field_insert_stats AFTER INSERT ON cpp_doc_clang_immutability_check_field
+REFERENCING NEW TABLE AS new_rows
+FOR EACH STATEMENT EXECUTE PROCEDURE count_inserted_check_fields();
+DROP TRIGGER IF EXISTS cpp_doc_check_field_update_stats ON cpp_doc_clang_immutability_check_field;
+CREATE TRIGGER cpp_doc_check_field_update_stats AFTER UPDATE ON cpp_doc_clang_immutability_check_field
+REFERENCING OLD TABLE AS old_rows NEW TABLE AS new_rows
+FOR EACH STATEMENT EXECUTE PROCEDURE count_updated_check_fields();
+
+-- Recounts a package from scratch, for packages written before the triggers
+-- existed. Writers wait until it's done.
+CREATE OR REPLACE FUNCTION rebuild_package_stats(p_package_id integer) RETURNS void AS $$
+BEGIN
+  LOCK TABLE cpp_doc_record_method_stats, cpp_doc_package_method_stats,
+             cpp_doc_package_check_method_stats, cpp_doc_package_check_field_stats
+  IN SHARE ROW EXCLUSIVE MODE;
+
+  DELETE FROM cpp_doc_record_method_stats WHERE package_id = p_package_id;
+  DELETE FROM cpp_doc_package_method_stats WHERE package_id = p_package_id;
+  DELETE FROM cpp_doc_package_check_method_stats WHERE package_id = p_package_id;
+  DELETE FROM cpp_doc_package_check_field_stats WHERE package_id = p_package_id;
+
+  INSERT INTO cpp_doc_record_method_stats (record_id, package_id, num_methods, num_const_methods)
+  SELECT decl.parent_id, p_package_id, count(*), count(*) FILTER (WHERE method.is_const)
+  FROM cpp_doc_method_decl AS method
+  JOIN cpp_doc_decl AS decl ON decl.id = method.decl_id
+  WHERE decl.package_id = p_package_id
+  GROUP BY decl.parent_id;
+
+  INSERT INTO cpp_doc_package_method_stats (package_id, slot, num_methods, num_const_methods,
+                                            num_records_with_const_methods)
+  SELECT p_package_id, 0, coalesce(sum(num_methods), 0), coalesce(sum(num_const_methods), 0),
+         count(*) FILTER (WHERE num_const_methods > 0)
+  FROM cpp_doc_record_method_stats
+  WHERE package_id = p_package_id;
+
+  INSERT INTO cpp_doc_package_check_method_stats (package_id, slot, is_const, mutate_result,
+                                                  return_result, num_methods)
+  SELECT p_package_id, 0, method.is_const, check_method.mutate_result, check_method.return_result, count(*)
+  FROM cpp_doc_clang_immutability_check_method AS check_method
+  JOIN cpp_doc_method_decl AS method ON method.decl_id = check_method.method_id
+  JOIN cpp_doc_decl AS decl ON decl.id = check_method.method_id
+  WHERE decl.package_id = p_package_id
+  GROUP BY method.is_const, check_method.mutate_result, check_method.return_result;
+
+  INSERT INTO cpp_doc_package_check_field_stats (package_id, slot, is_explicit, is_transitive, num_fields)
+  SELECT p_package_id, 0, check_field.is_explicit, check_field.is_transitive, count(*)
+  FROM cpp_doc_clang_immutability_check_field AS check_field
+  JOIN cpp_doc_decl AS decl ON decl.id = check_field.field_id
+  WHERE decl.package_id = p_package_id
+  GROUP BY check_field.is_explicit, check_field.is_transitive;
+END;
+$$ LANGUAGE plpgsql;
+
+-- What the dashboards read. A const method is obviously const when it
+-- doesn't mutate and returns nothing or a transitively const field.
+CREATE OR REPLACE VIEW cpp_doc_package_stats AS
+WITH methods AS (
+  SELECT package_id, sum(num_methods) AS num_methods, sum(num_const_methods) AS num_const_methods,
+         sum(num_records_with_const_methods) AS num_records_with_const_methods
+  FROM cpp_doc_package_method_stats
+  GROUP BY package_id
+), checks AS (
+  SELECT package_id, sum(num_methods) AS num_checked_methods,
+         sum(num_methods) FILTER (WHERE is_const) AS num_checked_const_methods,
+         sum(num_methods) FILTER (WHERE is_const AND mutate_result = 1 AND return_result IN (1, 2))
+           AS num_obviously_const_methods,
+         sum(num_methods) FILTER (WHERE NOT is_const AND mutate_result = 1 AND return_result IN (1, 2))
+           AS num_could_be_const_methods
+  FROM cpp_doc_package_check_method_stats
+  GROUP BY package_id
+), fields AS (
+  SELECT package_id, sum(num_fields) AS num_checked_fields,
+         sum(num_fields) FILTER (WHERE is_explicit) AS num_explicitly_const_fields,
+         sum(num_fields) FILTER (WHERE is_transitive) AS num_transitively_const_fields
+  FROM cpp_doc_package_check_field_stats
+  GROUP BY package_id
+)
+SELECT package_id,
+       coalesce(methods.num_methods, 0) AS num_methods,
+       coalesce(methods.num_const_methods, 0) AS num_const_methods,
+       coalesce(methods.num_records_with_const_methods, 0) AS num_records_with_const_methods,
+       coalesce(checks.num_checked_methods, 0) AS num_checked_methods,
+       coalesce(checks.num_checked_const_methods, 0) AS num_checked_const_methods,
+       coalesce(checks.num_obviously_const_methods, 0) AS num_obviously_const_methods,
+       coalesce(checks.num_could_be_const_methods, 0) AS num_could_be_const_methods,
+       coalesce(fields.num_checked_fields, 0) AS num_checked_fields,
+       coalesce(fields.num_explicitly_const_fields, 0) AS num_explicitly_const_fields,
+       coalesce(fields.num_transitively_const_fields, 0) AS num_transitively_const_fields
+FROM methods
+FULL JOIN checks USING (package_id)
+FULL JOIN fields USING (package_id);
+
+-- The backlog of compile commands for const-checker -worker. A worker claims
+-- a pending job, or one whose lease expired because its worker died, and
+-- renews the lease while it runs. A job that fails, or whose lease expires,
+-- goes back to pending until it has been attempted max_attempts times.
+CREATE TABLE IF NOT EXISTS cpp_doc_check_job (
+  compile_command_id integer PRIMARY KEY REFERENCES cpp_doc_compile_command (id),
+  package_id integer NOT NULL,
+  state text NOT NULL DEFAULT 'pending' CHECK (state IN ('pending', 'running', 'done', 'failed')),
+  attempts integer NOT NULL DEFAULT 0,
+  max_attempts integer NOT NULL DEFAULT 3,
+  worker text,
+  lease_expires_at timestamp with time zone,
+  last_error text,
+  updated_at timestamp with time zone NOT NULL DEFAULT now()
+);
+-- Only unfinished jobs are ever claimed
+CREATE INDEX IF NOT EXISTS cpp_doc_check_job_unfinished ON cpp_doc_check_job USING btree (compile_command_id) WHERE state IN ('pending', 'running');
+
+CREATE OR REPLACE FUNCTION enqueue_check_job(p_compile_command_id integer) RETURNS void AS $$
+  INSERT INTO cpp_doc_check_job (compile_command_id, package_id)
+  SELECT id, package_id FROM cpp_doc_compile_command WHERE id = p_compile_command_id
+  ON CONFLICT (compile_command_id) DO UPDATE
+  SET state = 'pending', attempts = 0, worker = NULL, lease_expires_at = NULL, updated_at = now()
+  WHERE cpp_doc_check_job.state IN ('done', 'failed');
+$$ LANGUAGE sql;
+
+-- Every compile command of the package that was never checked and isn't
+-- queued already
+CREATE OR REPLACE FUNCTION enqueue_package_check_jobs(p_package_id integer) RETURNS integer AS $$
+  WITH inserted AS (
+    INSERT INTO cpp_doc_check_job (compile_command_id, package_id)
+    SELECT id, p_package_id FROM get_pending_compile_commands(p_package_id) AS id
+    ON CONFLICT (compile_command_id) DO NOTHING
+    RETURNING 1
+  )
+  SELECT count(*)::integer FROM inserted;
+$$ LANGUAGE sql;
+
+CREATE OR REPLACE FUNCTION claim_check_job(p_worker text, p_lease_seconds integer)
+RETURNS SETOF integer AS $$
+BEGIN
+  -- Workers that died on their last attempt leave the job failed
+  UPDATE cpp_doc_check_job
+  SET state = 'failed', last_error = 'Lease expired on the last attempt', updated_at = now()
+  WHERE state = 'running' AND lease_expires_at < now() AND attempts >= max_attempts;
+
+  RETURN QUERY
+  UPDATE cpp_doc_check_job AS job
+  SET state = 'running', attempts = job.attempts + 1, worker = p_worker,
+      lease_expires_at = now() + make_interval(secs => p_lease_seconds), updated_at = now()
+  WHERE job.compile_command_id = (
+    SELECT compile_command_id FROM cpp_doc_check_job
+    WHERE (state = 'pending' OR (state = 'running' AND lease_expires_at < now()))
+          AND attempts < max_attempts
+    ORDER BY compile_command_id
+    LIMIT 1
+    FOR UPDATE SKIP LOCKED
+  )
+  RETURNING job.compile_command_id;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Returns false if the worker lost the lease to another one
+CREATE OR REPLACE FUNCTION renew_check_job_lease(p_compile_command_id integer,
+                                                 p_worker text,
+                                                 p_lease_seconds integer) RETURNS boolean AS $$
+  WITH renewed AS (
+    UPDATE cpp_doc_check_job
+    SET lease_expires_at = now() + make_interval(secs => p_lease_seconds), updated_at = now()
+    WHERE compile_command_id = p_compile_command_id AND worker = p_worker AND state = 'running'
+    RETURNING 1
+  )
+  SELECT EXISTS (SELECT 1 FROM renewed);
+$$ LANGUAGE sql;
+
+-- A failed job is retried by the next worker to claim it, unless it's out of
+-- attempts
+CREATE OR REPLACE FUNCTION finish_check_job(p_compile_command_id integer,
+                                            p_worker text,
+                                            p_succeeded boolean,
+                                            p_error text) RETURNS boolean AS $$
+  WITH finished AS (
+    UPDATE cpp_doc_check_job
+    SET state = CASE WHEN p_succeeded THEN 'done'
+                     WHEN attempts >= max_attempts THEN 'failed'
+                     ELSE 'pending' END,
+        worker = CASE WHEN p_succeeded THEN worker END,
+        lease_expires_at = NULL,
+        last_error = CASE WHEN p_succeeded THEN NULL ELSE p_error END,
+        updated_at = now()
+    WHERE compile_command_id = p_compile_command_id AND worker = p_worker AND state = 'running'
+    RETURNING 1
+  )
+  SELECT EXISTS (SELECT 1 FROM finished);
+$$ LANGUAGE sql;
+
+-- How far along every package's backlog is
+CREATE OR REPLACE VIEW cpp_doc_check_job_progress AS
+SELECT package_id,
+       count(*) FILTER (WHERE state = 'pending') AS num_pending,
+       count(*) FILTER (WHERE state = 'running') AS num_running,
+       count(*) FILTER (WHERE state = 'done') AS num_done,
+       count(*) FILTER (WHERE state = 'failed') AS num_failed,
+       count(*) FILTER (WHERE state = 'pending' AND attempts > 0) AS num_retrying,
+       max(updated_at) AS last_updated_at
+FROM cpp_doc_check_job
+GROUP BY package_id;